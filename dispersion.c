@@ -0,0 +1,377 @@
+/* dispersion.c - analytic (parametric) dispersion models for TFOC materials */
+
+/* ------------------------------ */
+/* Feature test macros            */
+/* ------------------------------ */
+
+/* ------------------------------ */
+/* Standard include files         */
+/* ------------------------------ */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+/* ------------------------------ */
+/* Local include files            */
+/* ------------------------------ */
+#define TFOC_CODE
+#include "tfoc.h"
+#include "gcc_help.h"
+
+/* ------------------------------- */
+/* My local typedef's and defines  */
+/* ------------------------------- */
+#define	DISP_PARMS_MAX		(8)
+
+typedef enum _DISP_TYPE {CAUCHY, SELLMEIER, DRUDE, TAUC_LORENTZ, CODY_LORENTZ} DISP_TYPE;
+
+struct _TFOC_DISPERSION {
+	DISP_TYPE type;
+	double p[DISP_PARMS_MAX];					/* Parameters, in the order of the table below */
+	void *e1_spline;								/* eps1-einf from Kramers-Kronig (if no closed form) */
+	int cursor;										/* Interval of the last e1_spline lookup */
+};
+
+/* ---------------------------------------------------------------------------
+-- Recognized models.  Parameters may be given positionally in this order,
+-- or as name=value in any order; anything not given takes the default.
+-- Energies are in eV, wavelengths (Cauchy, Sellmeier) in um.
+--
+--   cauchy        n = A + B/L^2 + C/L^4,  k = alpha*exp(beta*(E-gamma))
+--   sellmeier     n^2 = A + sum Bi L^2/(L^2-Ci)
+--   drude         eps = einf - wp^2/(E^2 + i*gamma*E)
+--   tauc_lorentz  Jellison & Modine, Appl. Phys. Lett. 69, 371 (1996)
+--   cody_lorentz  Ferlauto et al., J. Appl. Phys. 92, 2424 (2002)
+--------------------------------------------------------------------------- */
+static struct {
+	char *name;
+	DISP_TYPE type;
+	int nparms;
+	char *parm[DISP_PARMS_MAX];
+	double dflt[DISP_PARMS_MAX];
+} Models[] = {
+	{"cauchy",       CAUCHY,       6, {"A", "B", "C", "alpha", "beta", "gamma"},      {1, 0, 0, 0, 0, 0}         },
+	{"sellmeier",    SELLMEIER,    7, {"A", "B1", "C1", "B2", "C2", "B3", "C3"},      {1, 0, 0, 0, 0, 0, 0}      },
+	{"drude",        DRUDE,        3, {"einf", "wp", "gamma"},                        {1, 0, 0}                  },
+	{"tauc_lorentz", TAUC_LORENTZ, 5, {"A", "E0", "C", "Eg", "einf"},                 {0, 0, 0, 0, 1}            },
+	{"cody_lorentz", CODY_LORENTZ, 8, {"A", "E0", "C", "Eg", "Ep", "Et", "Eu", "einf"}, {0, 0, 0, 0, 0, 0, 0, 1} }
+};
+#define	NUM_MODELS	(sizeof(Models)/sizeof(Models[0]))
+
+/* Kramers-Kronig grid for models without a closed form eps1 */
+#define	KK_NPT			(400)					/* Log spaced points for the spline */
+#define	KK_EMIN			(0.01)				/* eV */
+#define	KK_EMAX			(50.0)				/* eV */
+#define	KK_UPPER			(500.0)				/* eV, upper limit of the integral */
+
+/* ------------------------------- */
+/* My external function prototypes */
+/* ------------------------------- */
+BOOL TFOC_IsDispersion(char *text);
+TFOC_DISPERSION *TFOC_ParseDispersion(char *text);
+COMPLEX TFOC_EvalDispersion(TFOC_DISPERSION *model, double lambda);
+void TFOC_FreeDispersion(TFOC_DISPERSION *model);
+
+/* ------------------------------- */
+/* My internal function prototypes */
+/* ------------------------------- */
+static int FindModel(char *text, char **endptr);
+static int MatchWord(char *text, char *word);
+static double Eps2(TFOC_DISPERSION *model, double E);
+static double TaucLorentzEps1(double *p, double E);
+static void *KramersKronig(TFOC_DISPERSION *model);
+
+/* ------------------------------- */
+/* My usage of other external fncs */
+/* ------------------------------- */
+
+/* ------------------------------- */
+/* Locally defined global vars     */
+/* ------------------------------- */
+
+
+/* ===========================================================================
+-- Length of text matching word (case-insensitive, '-' same as '_') if the
+-- word ends there, else 0
+=========================================================================== */
+static int MatchWord(char *text, char *word) {
+	int i;
+
+	for (i=0; word[i]; i++) {
+		if (text[i] == '-' && word[i] == '_') continue;
+		if (tolower(text[i]) != tolower(word[i])) return 0;
+	}
+	return (text[i] == '\0' || isspace(text[i]) || text[i] == '=' || text[i] == ']') ? i : 0;
+}
+
+/* ===========================================================================
+-- Identify the model keyword (optionally preceded by "model") at the start
+-- of text.  Returns index into Models[] or -1, with *endptr past keyword.
+=========================================================================== */
+static int FindModel(char *text, char **endptr) {
+	int i, len;
+
+	while (isspace(*text)) text++;
+	if ( (len = MatchWord(text, "model")) != 0) {
+		text += len;
+		while (isspace(*text)) text++;
+	}
+	for (i=0; i<(int) NUM_MODELS; i++) {
+		if ( (len = MatchWord(text, Models[i].name)) != 0) {
+			if (endptr != NULL) *endptr = text+len;
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* ===========================================================================
+-- Test whether a string (database file line or the inside of a [ ] layer
+-- name) is an analytic dispersion model
+--
+-- Usage: BOOL TFOC_IsDispersion(char *text);
+--
+-- Return: TRUE if text starts with a recognized model keyword
+=========================================================================== */
+BOOL TFOC_IsDispersion(char *text) {
+	return FindModel(text, NULL) >= 0;
+}
+
+/* ===========================================================================
+-- Parse a dispersion model specification
+--
+-- Usage: TFOC_DISPERSION *TFOC_ParseDispersion(char *text);
+--
+-- Inputs: text - "[model] <type> <values>", values positional and/or
+--                name=value.  A trailing ] is ignored.
+--
+-- Output: Error messages to stderr
+--
+-- Return: malloc'd model, or NULL on error
+=========================================================================== */
+TFOC_DISPERSION *TFOC_ParseDispersion(char *text) {
+
+	TFOC_DISPERSION *model;
+	char *aptr, *endptr;
+	int i, imodel, ipos, len;
+	double value, *p;
+
+	if ( (imodel = FindModel(text, &aptr)) < 0) {
+		fprintf(stderr, "ERROR: Unrecognized dispersion model: %s\n", text);
+		return NULL;
+	}
+
+	model = calloc(1, sizeof(*model));
+	model->type = Models[imodel].type;
+	p = model->p;
+	for (i=0; i<Models[imodel].nparms; i++) p[i] = Models[imodel].dflt[i];
+
+/* Positional values fill in order; name=value sets the named one */
+	ipos = 0;
+	while (TRUE) {
+		while (isspace(*aptr) || *aptr == ',') aptr++;
+		if (*aptr == '\0' || *aptr == ']' || *aptr == '#') break;
+		if (isalpha(*aptr)) {
+			for (i=0; i<Models[imodel].nparms; i++) {
+				if ( (len = MatchWord(aptr, Models[imodel].parm[i])) != 0 && aptr[len] == '=') break;
+			}
+			if (i >= Models[imodel].nparms) {
+				fprintf(stderr, "ERROR: Unknown parameter for %s model: %s\n", Models[imodel].name, aptr);
+				TFOC_FreeDispersion(model); return NULL;
+			}
+			aptr += len+1;
+		} else {
+			if ( (i = ipos++) >= Models[imodel].nparms) {
+				fprintf(stderr, "ERROR: Too many values for %s model (%d maximum)\n", Models[imodel].name, Models[imodel].nparms);
+				TFOC_FreeDispersion(model); return NULL;
+			}
+		}
+		value = strtod(aptr, &endptr);
+		if (endptr == aptr) {
+			fprintf(stderr, "ERROR: Invalid value in %s model: %s\n", Models[imodel].name, aptr);
+			TFOC_FreeDispersion(model); return NULL;
+		}
+		p[i] = value;
+		aptr = endptr;
+	}
+
+/* Oscillator models need a resonance and broadening; eps1 by K-K if no closed form */
+	if (model->type == TAUC_LORENTZ || model->type == CODY_LORENTZ) {
+		if (p[1] <= 0 || p[2] <= 0 || p[3] < 0) {
+			fprintf(stderr, "ERROR: %s model requires E0 > 0, C > 0 and Eg >= 0\n", Models[imodel].name);
+			TFOC_FreeDispersion(model); return NULL;
+		}
+		if (model->type == CODY_LORENTZ || p[2] >= 2*p[1]) model->e1_spline = KramersKronig(model);
+	}
+
+	if (TFOC_DEBUG(DEBUG_DATABASE)) {
+		fprintf(stderr, "Dispersion model %s:", Models[imodel].name);
+		for (i=0; i<Models[imodel].nparms; i++) fprintf(stderr, " %s=%g", Models[imodel].parm[i], p[i]);
+		fprintf(stderr, "\n");
+	}
+	return model;
+}
+
+/* ===========================================================================
+-- Imaginary part of the dielectric function for the oscillator models
+=========================================================================== */
+static double Eps2(TFOC_DISPERSION *model, double E) {
+	double *p, L, G, d;
+
+	p = model->p;
+	if (model->type == TAUC_LORENTZ) {						/* A E0 C Eg */
+		if (E <= p[3]) return 0;
+		d = E*E-p[1]*p[1];
+		return p[0]*p[1]*p[2]*(E-p[3])*(E-p[3]) / ((d*d + p[2]*p[2]*E*E)*E);
+	}
+
+/* Cody-Lorentz: A E0 C Eg Ep Et Eu; Urbach tail below Et (if Et > Eg) */
+	if (p[5] > p[3] && E <= p[5]) {
+		d = p[5]-p[3];		G = d*d/(d*d + p[4]*p[4]);
+		d = p[5]*p[5]-p[1]*p[1];
+		L = p[0]*p[1]*p[2]*p[5] / (d*d + p[2]*p[2]*p[5]*p[5]);
+		return (p[6] > 0) ? p[5]*G*L/E * exp((E-p[5])/p[6]) : 0;
+	}
+	if (E <= p[3]) return 0;
+	d = E-p[3];		G = d*d/(d*d + p[4]*p[4]);
+	d = E*E-p[1]*p[1];
+	L = p[0]*p[1]*p[2]*E / (d*d + p[2]*p[2]*E*E);
+	return G*L;
+}
+
+/* ===========================================================================
+-- Closed form Kramers-Kronig eps1 of the Tauc-Lorentz oscillator (less
+-- einf), valid for C < 2*E0.  The two logarithms singular at Eg are
+-- combined so the result is finite there.
+=========================================================================== */
+static double TaucLorentzEps1(double *p, double E) {
+	double A, E0, C, Eg, E2, E02, Eg2, alpha, gamma2, zeta4, aln, aatan, xm, xp, e1;
+
+	A = p[0]; E0 = p[1]; C = p[2]; Eg = p[3];
+	E2 = E*E; E02 = E0*E0; Eg2 = Eg*Eg;
+	alpha  = sqrt(4*E02 - C*C);
+	gamma2 = E02 - C*C/2;
+	zeta4  = (E2-gamma2)*(E2-gamma2) + alpha*alpha*C*C/4;
+	aln    = (Eg2-E02)*E2 + Eg2*C*C - E02*(E02+3*Eg2);
+	aatan  = (E2-E02)*(E02+Eg2) + Eg2*C*C;
+	xm = fabs(E-Eg); xp = E+Eg;
+
+	e1  = A*C*aln/(2*pi*zeta4*alpha*E0) * log((E02+Eg2+alpha*Eg)/(E02+Eg2-alpha*Eg));
+	e1 -= A*aatan/(pi*zeta4*E0) * (pi - atan((2*Eg+alpha)/C) + atan((alpha-2*Eg)/C));
+	e1 += 2*A*E0*Eg*(E2-gamma2)/(pi*zeta4*alpha) * (pi + 2*atan(2*(gamma2-Eg2)/(alpha*C)));
+	e1 += A*E0*C/(pi*zeta4) * ( xp*xp/E*log(xp) - ((xm > 0) ? xm*xm/E*log(xm) : 0)
+										- Eg*log((E02-Eg2)*(E02-Eg2) + Eg2*C*C) );
+	return e1;
+}
+
+/* ===========================================================================
+-- Numerical Kramers-Kronig transform of eps2, done once when the model is
+-- read.  The principal value is removed by subtracting E*eps2(E):
+--   eps1-einf = 2/pi [ int (x eps2(x) - E eps2(E))/(x^2-E^2) dx
+--                      + eps2(E)/2 ln|(U-E)/(U+E)| ]
+-- integrated 0..U with 8 point Gauss-Legendre panels, broken at Eg, Et
+-- and E.  Returns spline of eps1-einf vs. E.
+=========================================================================== */
+static void *KramersKronig(TFOC_DISPERSION *model) {
+
+	static double gx[4] = {0.1834346424956498, 0.5255324099163290, 0.7966664774136267, 0.9602898564975363};
+	static double gw[4] = {0.3626837833783620, 0.3137066702865660, 0.2223810344533745, 0.1012285362903763};
+	double E[KK_NPT], e1[KK_NPT], brk[5], a, b, h, c, x, sum, f0;
+	int i, j, k, nbrk;
+
+	for (i=0; i<KK_NPT; i++) {
+		E[i] = KK_EMIN*pow(KK_EMAX/KK_EMIN, i/(KK_NPT-1.0));
+		f0 = E[i]*Eps2(model, E[i]);
+
+		nbrk = 0;
+		brk[nbrk++] = 0;
+		if (model->p[3] > 0 && model->p[3] < KK_UPPER) brk[nbrk++] = model->p[3];
+		if (model->type == CODY_LORENTZ && model->p[5] > 0 && model->p[5] < KK_UPPER) brk[nbrk++] = model->p[5];
+		brk[nbrk++] = E[i];
+		for (j=1; j<nbrk; j++) {									/* Insertion sort, few entries */
+			for (k=j; k>0 && brk[k] < brk[k-1]; k--) { x = brk[k]; brk[k] = brk[k-1]; brk[k-1] = x; }
+		}
+		brk[nbrk++] = KK_UPPER;
+
+		sum = 0;
+		for (j=0; j<nbrk-1; j++) {
+			for (a=brk[j]; a < brk[j+1]; a=b) {
+				h = 0.05*a; if (h < 0.02) h = 0.02;					/* Panels grow with energy */
+				b = a+h; if (b > brk[j+1]-0.2*h) b = brk[j+1];
+				c = (b-a)/2;
+				for (k=0; k<4; k++) {
+					x = (a+b)/2 - c*gx[k]; sum += c*gw[k]*(x*Eps2(model, x)-f0)/(x*x-E[i]*E[i]);
+					x = (a+b)/2 + c*gx[k]; sum += c*gw[k]*(x*Eps2(model, x)-f0)/(x*x-E[i]*E[i]);
+				}
+			}
+		}
+		sum += f0/(2*E[i]) * log((KK_UPPER-E[i])/(KK_UPPER+E[i]));
+		e1[i] = 2/pi*sum;
+	}
+	return GVFitSpline(NULL, E, e1, KK_NPT, 0);
+}
+
+/* ===========================================================================
+-- Evaluate a dispersion model
+--
+-- Usage: COMPLEX TFOC_EvalDispersion(TFOC_DISPERSION *model, double lambda);
+--
+-- Inputs: model  - from TFOC_ParseDispersion
+--         lambda - wavelength in nm
+--
+-- Return: complex index in the n-ik convention of TFOC_FindNK
+=========================================================================== */
+COMPLEX TFOC_EvalDispersion(TFOC_DISPERSION *model, double lambda) {
+
+	COMPLEX n, eps;
+	double *p, E, L2, d;
+
+	p  = model->p;
+	E  = 1240.0/lambda;												/* eV */
+	L2 = 1E-6*lambda*lambda;										/* um^2 */
+
+	switch (model->type) {
+		case CAUCHY:
+			n.x = p[0] + p[1]/L2 + p[2]/(L2*L2);
+			n.y = -p[3]*exp(p[4]*(E-p[5]));
+			return n;
+		case SELLMEIER:
+			eps.x = p[0] + p[1]*L2/(L2-p[2]) + p[3]*L2/(L2-p[4]) + p[5]*L2/(L2-p[6]);
+			eps.y = 0;
+			break;
+		case DRUDE:
+			d = E*(E*E + p[2]*p[2]);
+			eps.x = p[0] - p[1]*p[1]*E/d;
+			eps.y = p[1]*p[1]*p[2]/d;
+			break;
+		case TAUC_LORENTZ:
+		case CODY_LORENTZ:
+			eps.x = p[(model->type == TAUC_LORENTZ) ? 4 : 7];
+			eps.x += (model->e1_spline != NULL) ? GVEvalSplineAt(model->e1_spline, KK_NPT, E, &model->cursor) : TaucLorentzEps1(p, E);
+			eps.y = Eps2(model, E);
+			break;
+		default:
+			eps.x = 1; eps.y = 0;
+			break;
+	}
+
+	n = CCSQRT(eps);
+	if (n.x < 0) { n.x = -n.x; n.y = -n.y; }
+	n.y = -n.y;															/* n-ik */
+	return n;
+}
+
+/* ===========================================================================
+-- Release a dispersion model and its Kramers-Kronig spline
+--
+-- Usage: void TFOC_FreeDispersion(TFOC_DISPERSION *model);
+--
+-- Inputs: model - from TFOC_ParseDispersion (NULL is ignored)
+=========================================================================== */
+void TFOC_FreeDispersion(TFOC_DISPERSION *model) {
+	if (model == NULL) return;
+	free(model->e1_spline);
+	free(model);
+}
@@ -13,6 +13,7 @@
 #include <float.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stdarg.h>
 
 /* ------------------------------ */
 /* Local include files            */
@@ -26,37 +27,65 @@
 /* ------------------------------- */
 #define	panic			SysPanic(__FILE__, __LINE__)
 
-typedef struct _M_ARRAY {
-	COMPLEX A,B,C,D;
-} M_ARRAY;
+typedef struct _DCOMPLEX {
+	COMPLEX v, d;									/* Value and derivative */
+} DCOMPLEX;
+
+typedef enum _JAC_PARM {JAC_Z, JAC_N, JAC_K} JAC_PARM;
 
 /* ------------------------------- */
 /* My external function prototypes */
 /* ------------------------------- */
 REFL TFOC_ReflN(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[]);
+void TFOC_ReflNBatch(int npt, double theta[], POLARIZATION mode, double lambda[], TFOC_LAYER layer[], double nx[], double ny[], REFL result[]);
+REFL TFOC_ReflNCone(TFOC_CONE *cone, double lambda, TFOC_LAYER layer[]);
+REFL TFOC_ReflNAbsorb(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[], double dz, int npt, double efield[]);
+TFOC_SWEEP *TFOC_SweepInit(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[], int first_row, int last_row);
+REFL TFOC_SweepRefl(TFOC_SWEEP *sweep, TFOC_LAYER layer[]);
+void TFOC_SweepFree(TFOC_SWEEP *sweep);
+REFL TFOC_ReflNJacobian(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[], int nrows, TFOC_JACOBIAN jac[]);
 REFL TFOC_Refl (double theta, POLARIZATION mode, double lambda, COMPLEX n0, COMPLEX n1, COMPLEX ns, double z);
 
-COMPLEX CADD(COMPLEX a, COMPLEX b);			/* Used occasionally by other routines */
-COMPLEX CSUB(COMPLEX a, COMPLEX b);
-COMPLEX CMUL(COMPLEX a, COMPLEX b);
-COMPLEX CDIV(COMPLEX a, COMPLEX b);
-COMPLEX CCSQRT(COMPLEX r);
-COMPLEX CPOW(COMPLEX r, double pow);
-double  CABS(COMPLEX a);
-COMPLEX CSQRT(double r);
+COMPLEX CPOW(COMPLEX r, double pow);			/* Others are inline in tfoc_math.h */
 
 /* ------------------------------- */
 /* My internal function prototypes */
 /* ------------------------------- */
 static REFL my_TFOC_ReflN(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[]);
 static REFL my_TFOC_Refl(double theta, POLARIZATION mode, double lambda, COMPLEX n0, COMPLEX n1, COMPLEX ns, double z);
-
-static BOOL CalcFresnel(double S, POLARIZATION mode, COMPLEX ni, COMPLEX nj, COMPLEX *rij, COMPLEX *tij);
-static M_ARRAY CalcInterface(double S, POLARIZATION mode, COMPLEX ni, COMPLEX nj);
-static M_ARRAY CalcGap(double z, double S, COMPLEX ni, double lambda);
-
-static M_ARRAY IDENTITY_MATRIX(void);
-static M_ARRAY MATMUL(M_ARRAY *a, M_ARRAY *b);
+static void BatchLanes(int nl, int stride, double theta[], POLARIZATION mode, double lambda[], TFOC_LAYER layer[], double nx[], double ny[], REFL result[]);
+static void GaussLegendre(int n, double x[], double w[]);
+
+static COMPLEX CosTheta(double S, COMPLEX ni);
+static BOOL CalcFresnel(POLARIZATION mode, COMPLEX ni, COMPLEX cos_theta_i, COMPLEX nj, COMPLEX cos_theta_j, COMPLEX *rij, COMPLEX *tij);
+static M_ARRAY CalcInterface(POLARIZATION mode, COMPLEX ni, COMPLEX cos_theta_i, COMPLEX nj, COMPLEX cos_theta_j);
+static M_ARRAY CalcGap(double z, COMPLEX ni, COMPLEX cos_theta_i, double lambda);
+static void BlockProduct(POLARIZATION pol[], int npol, double S, double lambda, TFOC_LAYER layer[], int i0, int i1,
+								 COMPLEX ni, COMPLEX cos_i, M_ARRAY Cb[]);
+static BOOL HasRepeats(TFOC_LAYER layer[]);
+static TFOC_LAYER *ExpandRepeats(TFOC_LAYER layer[]);
+static BOOL HasIncoherent(TFOC_LAYER layer[]);
+static BOOL HasGraded(TFOC_LAYER layer[]);
+static COMPLEX ExitIndex(TFOC_LAYER *lay);
+static COMPLEX GradedN(TFOC_LAYER *lay, double u);
+static void MagnusStep(POLARIZATION pol[], int npol, double S, double k0, TFOC_LAYER *lay, double u, double h, M_ARRAY F[]);
+static void GradedGap(POLARIZATION pol[], int npol, double S, double lambda, TFOC_LAYER *lay, M_ARRAY Cg[]);
+static REFL IncoherentReflN(double theta, POLARIZATION pol[], int npol, double lambda, TFOC_LAYER layer[]);
+static double PoyntingFlux(POLARIZATION mode, COMPLEX n, COMPLEX cos_theta, COMPLEX ep, COMPLEX em);
+static REFL NumericJacobian(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[], int nrows, TFOC_JACOBIAN jac[]);
+
+static DCOMPLEX DCMUL(DCOMPLEX a, DCOMPLEX b);
+static DCOMPLEX DCDIV(DCOMPLEX a, DCOMPLEX b);
+static DCOMPLEX DCADD(DCOMPLEX a, DCOMPLEX b);
+static DCOMPLEX DCSUB(DCOMPLEX a, DCOMPLEX b);
+static DCOMPLEX DCosTheta(double S, double dS, DCOMPLEX n);
+static void DCalcInterface(POLARIZATION mode, DCOMPLEX ni, DCOMPLEX cos_i, DCOMPLEX nj, DCOMPLEX cos_j, M_ARRAY *V, M_ARRAY *D);
+static void DCalcGap(double z, double dz, DCOMPLEX ni, DCOMPLEX cos_i, double lambda, M_ARRAY *V, M_ARRAY *D);
+static void DMATMUL(M_ARRAY *V, M_ARRAY *D, M_ARRAY *Mv, M_ARRAY *Md);
+static void DualProduct(POLARIZATION mode, double lambda, double S, double dS, TFOC_LAYER layer[],
+								int istart, int i0, int i1, int row, JAC_PARM parm, double zscale, M_ARRAY *V, M_ARRAY *D);
+
+static M_ARRAY MATPOW(M_ARRAY *a, int n);
 #if 0													/* Not actually used, so comment out for now */
 	static M_ARRAY MATINV(M_ARRAY *a);
 #endif
@@ -70,11 +99,18 @@ static M_ARRAY MATMUL(M_ARRAY *a, M_ARRAY *b);
 /* ------------------------------- */
 
 /* ===========================================================================
--- Routine to print out an array for user	interpretation
+-- Routine to print out an array for user	interpretation.  The label is a
+-- printf format, only expanded when matrix debugging is actually on, so
+-- callers need not build the text in advance.
 =========================================================================== */
-void Print_M_Array(M_ARRAY m, char *text) {
-	if (TFOC_Debug_Flag & DEBUG_MATRIX) {
-		printf("%s\n", text);
+void Print_M_Array(M_ARRAY m, char *fmt, ...) {
+	va_list args;
+
+	if (TFOC_DEBUG(DEBUG_MATRIX)) {
+		va_start(args, fmt);
+		vprintf(fmt, args);
+		va_end(args);
+		printf("\n");
 		printf("  %g%+gi\t%g%+gi\n", m.A.x, m.A.y, m.B.x, m.B.y);
 		printf("  %g%+gi\t%g%+gi\n", m.C.x, m.C.y, m.D.x, m.D.y);
 		printf("\n");
@@ -86,74 +122,1272 @@ void Print_M_Array(M_ARRAY m, char *text) {
 -- Calculate the reflectance off of a complex stack structure.  The
 -- initial and substrate media are specified.  The stack is an array
 -- of material and thickness structures, terminated by a NULL material.
+--
+-- For UNPOLARIZED, the TE and TM products are carried together through a
+-- single walk of the stack.  The angles and propagation matrices do not
+-- depend on polarization and are only calculated once per layer.
+--
+-- Periodic blocks (layer.repeat = N on the first layer of the period) are
+-- evaluated once for entry from the preceding medium, then the product of
+-- one period re-entered from its own last layer is raised to the (N-1)
+-- power by repeated squaring.
+--
+-- Stacks with incoherent layers are handed to IncoherentReflN.
 =========================================================================== */
 REFL TFOC_ReflN(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[]) {
-	REFL te={0.0,0.0},tm;
-	
-	switch (mode) {
-		case TM:
-		case TE:
-			te = my_TFOC_ReflN(theta, mode, lambda, layer);
-			break;
-		case UNPOLARIZED:
-			te = my_TFOC_ReflN(theta, TE, lambda, layer);
-			tm = my_TFOC_ReflN(theta, TM, lambda, layer);
-			te.R = 0.5*(te.R + tm.R);
-			te.T = 0.5*(te.T + tm.T);
-	}
-	return te;
+	return my_TFOC_ReflN(theta, mode, lambda, layer);
 }
 
 static REFL my_TFOC_ReflN(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[]) {
 
-	double S, sin_out;
-	M_ARRAY Ct, Cij, Ciz;
-	COMPLEX ni,nj,one={1.0, 0.0};
+	static POLARIZATION te_tm[2] = {TE, TM};
+	double S, sin_out, factor;
+	M_ARRAY Ct[2], Cij, Ciz, Cb[2], Cp[2], Cg[2];
+	COMPLEX ni,nj,cos_i,cos_j,one={1.0, 0.0};
+	POLARIZATION *pol;
 	REFL rc;
-	char szBuf[256];
-	int i;
+	BOOL trace = TFOC_DEBUG(DEBUG_MATRIX);			/* Matrix trace requested */
+	int i, i1, il, ipol, npol;
+
+	if (mode == UNPOLARIZED) {								/* Both, then average */
+		pol = te_tm; npol = 2;
+	} else {
+		pol = &mode; npol = 1;
+	}
+	if (HasIncoherent(layer)) return IncoherentReflN(theta, pol, npol, lambda, layer);
 
 	S = layer[0].n.x*sin(theta*pi/180.0f);				/* S factor */
 
-	Ct = IDENTITY_MATRIX();									/* Make an identify matrix */
-	sprintf_s(szBuf, sizeof(szBuf), "Ct initial incident indentify matrix (%s)", layer[0].name);
-	Print_M_Array(Ct, szBuf);
+	Ct[0] = Ct[1] = IDENTITY_MATRIX();					/* Make an identify matrix */
+	if (trace) Print_M_Array(Ct[0], "Ct initial incident indentify matrix (%s)", layer[0].name);
 
-	ni = layer[0].n;											/* Current is incident */
+	ni    = layer[0].n;										/* Current is incident */
+	cos_i = CosTheta(S, ni);
 	for (i=1; layer[i].type == SUBLAYER; i++) {
+		if (layer[i].repeat > 1) {							/* Periodic block */
+			i1 = i+layer[i].repeat_layers-1;
+			for (il=i1; il>=i && layer[il].z <= 0.0; il--) ;
+			if (il >= i) {
+				nj    = ExitIndex(&layer[il]);
+				cos_j = CosTheta(S, nj);
+				BlockProduct(pol, npol, S, lambda, layer, i, i1, ni, cos_i, Cb);
+				BlockProduct(pol, npol, S, lambda, layer, i, i1, nj, cos_j, Cp);
+				for (ipol=0; ipol<npol; ipol++) {
+					Cp[ipol] = MATPOW(&Cp[ipol], layer[i].repeat-1);
+					Ct[ipol] = MATMUL(&Ct[ipol], &Cb[ipol]);
+					Ct[ipol] = MATMUL(&Ct[ipol], &Cp[ipol]);
+					if (trace) Print_M_Array(Ct[ipol], "Ct after %d periods of layers %d-%d", layer[i].repeat, i, i1);
+				}
+				ni = nj; cos_i = cos_j;
+			}
+			i = i1;
+			continue;
+		}
 		if (layer[i].z <= 0.0) continue;					/* Not really there	*/
-		nj  = layer[i].n;
-		Cij = CalcInterface(S, mode, ni, nj);
-		sprintf_s(szBuf, sizeof(szBuf), "Cij boundary into layer %d (%s)", i, layer[i].name);
-		Print_M_Array(Cij, szBuf);
-		Ciz = CalcGap(layer[i].z, S, nj, lambda);
-		sprintf_s(szBuf, sizeof(szBuf), "Ciz propogation matrix for %.2f nm", layer[i].z);
-		Print_M_Array(Ciz, szBuf);
-		Ct = MATMUL(&Ct, &Cij);
-		Print_M_Array(Ct, "Ct multiplied by boundary matrix");
-		Ct = MATMUL(&Ct, &Ciz);
-		Print_M_Array(Ct, "Ct multiplied by propogation matrix");
-		ni = nj;
+		nj    = layer[i].n;
+		cos_j = CosTheta(S, nj);
+		if (layer[i].graded != NULL) {
+			GradedGap(pol, npol, S, lambda, &layer[i], Cg);
+		} else {
+			Ciz = CalcGap(layer[i].z, nj, cos_j, lambda);
+			if (trace) Print_M_Array(Ciz, "Ciz propogation matrix for %.2f nm", layer[i].z);
+		}
+		for (ipol=0; ipol<npol; ipol++) {
+			Cij = CalcInterface(pol[ipol], ni, cos_i, nj, cos_j);
+			if (trace) Print_M_Array(Cij, "Cij boundary into layer %d (%s)", i, layer[i].name);
+			Ct[ipol] = MATMUL(&Ct[ipol], &Cij);
+			if (trace) Print_M_Array(Ct[ipol], "Ct multiplied by boundary matrix");
+			Ct[ipol] = MATMUL(&Ct[ipol], (layer[i].graded != NULL) ? &Cg[ipol] : &Ciz);
+			if (trace) Print_M_Array(Ct[ipol], "Ct multiplied by propogation matrix");
+		}
+		if (layer[i].graded != NULL) {
+			nj    = ExitIndex(&layer[i]);
+			cos_j = CosTheta(S, nj);
+		}
+		ni = nj; cos_i = cos_j;
 	}
 
 /* And add the substrate */
-	Cij = CalcInterface(S,mode,ni,layer[i].n);
-	sprintf_s(szBuf, sizeof(szBuf), "Cij final boundary matrix to substrate (%s)", layer[i].name);
-	Print_M_Array(Cij, szBuf);
-	Ct = MATMUL(&Ct, &Cij);
-	Print_M_Array(Ct, "Ct final matrix into substrate");
+	cos_j = CosTheta(S, layer[i].n);
+	for (ipol=0; ipol<npol; ipol++) {
+		Cij = CalcInterface(pol[ipol], ni, cos_i, layer[i].n, cos_j);
+		if (trace) Print_M_Array(Cij, "Cij final boundary matrix to substrate (%s)", layer[i].name);
+		Ct[ipol] = MATMUL(&Ct[ipol], &Cij);
+		if (trace) Print_M_Array(Ct[ipol], "Ct final matrix into substrate");
+	}
 
 /* Calculate the reflectivity */
-	rc.R = pow(CABS(CDIV(Ct.C,Ct.A)),2);
 	sin_out = S/layer[i].n.x;
 	if (sin_out > 1.0 || sin_out < 0.0) {
-		rc.T = 0;
+		factor = 0;
+	} else {
+		factor = layer[i].n.x / layer[0].n.x  *			/* Correct for index of substrate */
+					sqrt(1.0-sin_out*sin_out) / cos(theta*pi/180.0f);	/* Angle correction */
+	}
+	rc.R = rc.T = 0;
+	for (ipol=0; ipol<npol; ipol++) {
+		rc.R += pow(CABS(CDIV(Ct[ipol].C,Ct[ipol].A)),2);
+		rc.T += pow(CABS(CDIV(one, Ct[ipol].A)),2) * factor;	/* Electric field term */
+	}
+	rc.R /= npol;
+	rc.T /= npol;
+
+	return rc;
+}
+
+/* ===========================================================================
+-- Absorbed power in every layer and |E|^2 as a function of depth.  The
+-- stack is walked backwards from the substrate carrying the field vector
+-- [E+, E-], which is exactly the chain of interface and gap matrices used
+-- by TFOC_ReflN applied to [1,0] in the substrate.  The vectors are kept
+-- at the front and back of every layer and scaled by 1/A at the end so the
+-- incident amplitude is 1.  The absorbed fraction is the drop in the normal
+-- Poynting flux across the layer, with tangential fields
+--     TE: E = E+ + E-,        H = n cos (E+ - E-)
+--     TM: E = cos (E+ + E-),  H = n (E+ - E-)
+-- which are continuous across the interfaces of CalcFresnel.
+--
+-- Usage: REFL TFOC_ReflNAbsorb(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[],
+--                              double dz, int npt, double efield[]);
+--
+-- Inputs: theta, mode, lambda, layer - as for TFOC_ReflN
+--         dz     - spacing (nm) of the depth grid for efield
+--         npt    - number of depth points (0 if not wanted)
+--         efield - [npt] array for |E|^2 (NULL if not wanted)
+--
+-- Output: layer[i].absorb - fraction of the incident power absorbed in each
+--                           layer.  0 for the incident medium, T for the
+--                           substrate.  For a repeat block, the total over
+--                           all periods is given on the layers of the period.
+--         efield[k]       - |E|^2 relative to the incident wave at depth k*dz
+--                           below the top surface, continuing into substrate
+--
+-- Return: R and T, as from TFOC_ReflN
+--
+-- Notes: Not defined for stacks with incoherent or graded layers.  absorb
+--        and efield are then returned as 0.
+=========================================================================== */
+REFL TFOC_ReflNAbsorb(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[], double dz, int npt, double efield[]) {
+
+	static POLARIZATION te_tm[2] = {TE, TM};
+	TFOC_LAYER *flat;
+	int *map;										/* Index in layer[] of each flat layer */
+	COMPLEX *vf, *vb;								/* [E+,E-] at front and back of each layer */
+	COMPLEX *ct;									/* cos(theta) in each layer */
+	COMPLEX ep, em, g, h, phase, one={1.0, 0.0}, zero={0.0, 0.0};
+	M_ARRAY Cij, Ciz;
+	POLARIZATION *pol;
+	REFL rc;
+	double S, sinc, depth, u, sin_out, factor;
+	int i, j, k, n, nl, ipol, npol;
+
+	if (mode == UNPOLARIZED) {								/* Both, then average */
+		pol = te_tm; npol = 2;
+	} else {
+		pol = &mode; npol = 1;
+	}
+	for (nl=1; layer[nl-1].type != EOS; nl++) ;
+	for (i=0; i<nl; i++) layer[i].absorb = 0.0;
+	for (k=0; efield != NULL && k<npt; k++) efield[k] = 0.0;
+
+	if (HasIncoherent(layer) || HasGraded(layer)) return my_TFOC_ReflN(theta, mode, lambda, layer);
+
+/* Flat copy of the stack (repeat blocks expanded) and map back to layer[] */
+	if ( (flat = ExpandRepeats(layer)) == NULL) flat = layer;
+	for (n=1; flat[n-1].type != EOS; n++) ;
+	map = malloc(n*sizeof(*map));
+	for (j=0,i=0; ; i++) {
+		if (layer[i].repeat > 1) {
+			for (k=0; k<layer[i].repeat*layer[i].repeat_layers; k++) map[j++] = i + k%layer[i].repeat_layers;
+			i += layer[i].repeat_layers-1;
+			continue;
+		}
+		map[j++] = i;
+		if (layer[i].type == EOS) break;
+	}
+
+	vf = calloc(2*n, sizeof(*vf));
+	vb = calloc(2*n, sizeof(*vb));
+	ct = malloc(n*sizeof(*ct));
+
+	S = flat[0].n.x*sin(theta*pi/180.0f);
+	for (i=0; i<n; i++) ct[i] = CosTheta(S, flat[i].n);
+	rc.R = rc.T = 0;
+
+	for (ipol=0; ipol<npol; ipol++) {
+
+		/* Backwards from [1,0] in the substrate */
+		vf[2*(n-1)] = one; vf[2*(n-1)+1] = zero;
+		j = n-1;														/* Next layer actually present */
+		for (i=n-2; i>=0; i--) {
+			if (i > 0 && flat[i].z <= 0.0) continue;
+			Cij = CalcInterface(pol[ipol], flat[i].n, ct[i], flat[j].n, ct[j]);
+			vb[2*i]   = CADD(CMUL(Cij.A, vf[2*j]), CMUL(Cij.B, vf[2*j+1]));
+			vb[2*i+1] = CADD(CMUL(Cij.C, vf[2*j]), CMUL(Cij.D, vf[2*j+1]));
+			if (i > 0) {
+				Ciz = CalcGap(flat[i].z, flat[i].n, ct[i], lambda);
+				vf[2*i]   = CMUL(Ciz.A, vb[2*i]);
+				vf[2*i+1] = CMUL(Ciz.D, vb[2*i+1]);
+			} else {
+				vf[0] = vb[0]; vf[1] = vb[1];
+			}
+			j = i;
+		}
+
+		/* Scale to unit incident amplitude: A=E+ and C=E- of the incident medium */
+		g = CDIV(one, vf[0]);
+		for (i=0; i<2*n; i++) { vf[i] = CMUL(vf[i], g); vb[i] = CMUL(vb[i], g); }
+		sin_out = S/flat[n-1].n.x;
+		factor = (sin_out > 1.0 || sin_out < 0.0) ? 0 :
+					flat[n-1].n.x / flat[0].n.x * sqrt(1.0-sin_out*sin_out) / cos(theta*pi/180.0f);
+		rc.R += pow(CABS(vf[1]),2);
+		rc.T += pow(CABS(vf[2*(n-1)]),2) * factor;
+
+		/* Absorbed fraction from the drop in flux across each layer */
+		sinc = PoyntingFlux(pol[ipol], flat[0].n, ct[0], one, zero);
+		for (i=1; i<n-1; i++) {
+			if (flat[i].z <= 0.0) continue;
+			layer[map[i]].absorb += (PoyntingFlux(pol[ipol], flat[i].n, ct[i], vf[2*i], vf[2*i+1]) -
+											 PoyntingFlux(pol[ipol], flat[i].n, ct[i], vb[2*i], vb[2*i+1])) / sinc / npol;
+		}
+		layer[map[n-1]].absorb += pow(CABS(vf[2*(n-1)]),2) * factor / npol;
+
+		/* |E|^2 on the depth grid, propagating from the front of each layer */
+		if (efield != NULL) {
+			depth = 0; i = 1;
+			for (k=0; k<npt; k++) {
+				u = k*dz;
+				while (i < n-1 && (flat[i].z <= 0.0 || u >= depth+flat[i].z)) {
+					if (flat[i].z > 0.0) depth += flat[i].z;
+					i++;
+				}
+				u -= depth;
+				phase = CDIV(flat[i].n, ct[i]);
+				phase.x *= (2*pi/lambda)*u;
+				phase.y *= (2*pi/lambda)*u;
+				g.x = cos(phase.x)*exp(phase.y);  g.y = -sin(phase.x)*exp(phase.y);	/* exp(-i phase) */
+				h.x = cos(phase.x)*exp(-phase.y); h.y =  sin(phase.x)*exp(-phase.y);	/* exp(+i phase) */
+				ep = CMUL(vf[2*i], g);
+				em = (i < n-1) ? CMUL(vf[2*i+1], h) : zero;
+				if (pol[ipol] == TE) {
+					efield[k] += pow(CABS(CADD(ep,em)),2) / npol;
+				} else {
+					efield[k] += (pow(CABS(CMUL(ct[i], CADD(ep,em))),2) +
+									  pow(CABS(CSUB(ep,em)),2) * S*S/(flat[i].n.x*flat[i].n.x+flat[i].n.y*flat[i].n.y)) / npol;
+				}
+			}
+		}
+	}
+	rc.R /= npol;
+	rc.T /= npol;
+
+	if (flat != layer) free(flat);
+	free(map); free(vf); free(vb); free(ct);
+	return rc;
+}
+
+/* ===========================================================================
+-- Normal component of the Poynting vector for field amplitudes E+,E- in a
+-- medium, with the tangential fields used by TFOC_ReflNAbsorb.
+=========================================================================== */
+static double PoyntingFlux(POLARIZATION mode, COMPLEX n, COMPLEX cos_theta, COMPLEX ep, COMPLEX em) {
+
+	COMPLEX E, H;
+
+	if (mode == TE) {
+		E = CADD(ep, em);
+		H = CMUL(CMUL(n, cos_theta), CSUB(ep, em));
+	} else {
+		E = CMUL(cos_theta, CADD(ep, em));
+		H = CMUL(n, CSUB(ep, em));
+	}
+	return E.x*H.x + E.y*H.y;									/* Re(E conj(H)) */
+}
+
+/* ===========================================================================
+-- Product of the interfaces and gaps of layers i0..i1 (one period of a
+-- repeat block), entering from medium ni.  Filled for each polarization.
+=========================================================================== */
+static void BlockProduct(POLARIZATION pol[], int npol, double S, double lambda, TFOC_LAYER layer[], int i0, int i1,
+								 COMPLEX ni, COMPLEX cos_i, M_ARRAY Cb[]) {
+	M_ARRAY Cij, Ciz, Cg[2];
+	COMPLEX cos_j;
+	int i, ipol;
+
+	for (ipol=0; ipol<npol; ipol++) Cb[ipol] = IDENTITY_MATRIX();
+	for (i=i0; i<=i1; i++) {
+		if (layer[i].z <= 0.0) continue;
+		cos_j = CosTheta(S, layer[i].n);
+		if (layer[i].graded != NULL) {
+			GradedGap(pol, npol, S, lambda, &layer[i], Cg);
+		} else {
+			Ciz = CalcGap(layer[i].z, layer[i].n, cos_j, lambda);
+		}
+		for (ipol=0; ipol<npol; ipol++) {
+			Cij = CalcInterface(pol[ipol], ni, cos_i, layer[i].n, cos_j);
+			Cb[ipol] = MATMUL(&Cb[ipol], &Cij);
+			Cb[ipol] = MATMUL(&Cb[ipol], (layer[i].graded != NULL) ? &Cg[ipol] : &Ciz);
+		}
+		ni = ExitIndex(&layer[i]);
+		cos_i = (layer[i].graded != NULL) ? CosTheta(S, ni) : cos_j;
+	}
+	return;
+}
+
+/* ===========================================================================
+-- Repeat block support for the routines that need a flat list of layers
+-- (batched, sweep and Jacobian).  ExpandRepeats returns an allocated copy
+-- with every period written out, or NULL if there are no repeat blocks.
+=========================================================================== */
+static BOOL HasRepeats(TFOC_LAYER layer[]) {
+	int i;
+
+	for (i=0; layer[i].type != EOS; i++) if (layer[i].repeat > 1) return TRUE;
+	return FALSE;
+}
+
+static TFOC_LAYER *ExpandRepeats(TFOC_LAYER layer[]) {
+	TFOC_LAYER *flat;
+	int i, j, k, n;
+
+	if (! HasRepeats(layer)) return NULL;
+	for (n=0,i=0; ; i++) {
+		n += (layer[i].repeat > 1) ? (layer[i].repeat-1)*layer[i].repeat_layers + 1 : 1;
+		if (layer[i].type == EOS) break;
+	}
+	flat = malloc(n*sizeof(*flat));
+	for (n=0,i=0; ; i++) {
+		if (layer[i].repeat > 1) {
+			for (k=0; k<layer[i].repeat; k++) {
+				for (j=0; j<layer[i].repeat_layers; j++) {
+					flat[n] = layer[i+j];
+					flat[n].repeat = flat[n].repeat_layers = 0;
+					n++;
+				}
+			}
+			i += layer[i].repeat_layers-1;
+			continue;
+		}
+		flat[n++] = layer[i];
+		if (layer[i].type == EOS) break;
+	}
+	return flat;
+}
+
+/* ===========================================================================
+-- Mixed coherent / incoherent evaluation.  The stack is cut at every
+-- incoherent layer.  Each coherent run between two incoherent media (or the
+-- incident medium / substrate) is reduced to its amplitude matrix M, and
+-- from it the forward and backward r,t of the run
+--     r = C/A,  t = 1/A,  r' = -B/A,  t' = det(M)/A
+-- which give the intensity matrix of the run
+--     P = 1/|t|^2 [ 1       -|r'|^2              ]
+--                 [ |r|^2   |t t'|^2 - |r r'|^2  ]
+-- Incoherent layers contribute diag(|exp(i phase)|^2, |exp(-i phase)|^2).
+-- R and T then follow from the product as for the amplitude matrix.  The
+-- product is renormalized as it goes so that thick absorbing layers do not
+-- overflow.
+=========================================================================== */
+static BOOL HasIncoherent(TFOC_LAYER layer[]) {
+	int i;
+
+	for (i=1; layer[i].type == SUBLAYER; i++) if (layer[i].incoherent && layer[i].z > 0.0) return TRUE;
+	return FALSE;
+}
+
+static BOOL HasGraded(TFOC_LAYER layer[]) {
+	int i;
+
+	for (i=1; layer[i].type == SUBLAYER; i++) if (layer[i].graded != NULL && layer[i].z > 0.0) return TRUE;
+	return FALSE;
+}
+
+static REFL IncoherentReflN(double theta, POLARIZATION pol[], int npol, double lambda, TFOC_LAYER layer[]) {
+
+	TFOC_LAYER *flat;
+	M_ARRAY M, Cij;
+	COMPLEX na, cos_a, nl, cos_l, nb, cos_b, phase, det;
+	double S, sin_out, factor, P[2][2], T[2][2], t00, t01, t10, t11, r2, rp2, t2, tp2, scale, logscale, a;
+	int ia, ib, il, isub, ipol;
+	REFL rc;
+
+	if ( (flat = ExpandRepeats(layer)) != NULL) layer = flat;
+	for (isub=1; layer[isub].type == SUBLAYER; isub++) ;
+
+	S = layer[0].n.x*sin(theta*pi/180.0f);
+	sin_out = S/layer[isub].n.x;
+	if (sin_out > 1.0 || sin_out < 0.0) {
+		factor = 0;
 	} else {
-		rc.T = pow(CABS(CDIV(one, Ct.A)),2) *				/* Electric field term				 */
-				 layer[i].n.x / layer[0].n.x  *				/* Correct for index of substrate */
-				 sqrt(1.0-sin_out*sin_out) / cos(theta*pi/180.0f);	/* Angle correction */
+		factor = layer[isub].n.x / layer[0].n.x * sqrt(1.0-sin_out*sin_out) / cos(theta*pi/180.0f);
+	}
+
+	rc.R = rc.T = 0;
+	for (ipol=0; ipol<npol; ipol++) {
+		T[0][0] = T[1][1] = 1.0; T[0][1] = T[1][0] = 0.0;
+		logscale = 0.0;
+
+		for (ia=0; ia<isub; ia=ib) {
+			for (ib=ia+1; ib<isub && ! (layer[ib].incoherent && layer[ib].z > 0.0); ib++) ;
+
+			/* Coherent run from medium ia through to the interface into ib */
+			na = layer[ia].n; cos_a = CosTheta(S, na);
+			nb = layer[ib].n; cos_b = CosTheta(S, nb);
+			BlockProduct(&pol[ipol], 1, S, lambda, layer, ia+1, ib-1, na, cos_a, &M);
+			for (il=ib-1; il>ia && layer[il].z <= 0.0; il--) ;
+			nl = ExitIndex(&layer[il]); cos_l = CosTheta(S, nl);
+			Cij = CalcInterface(pol[ipol], nl, cos_l, nb, cos_b);
+			M = MATMUL(&M, &Cij);
+
+			t2  = 1.0/(M.A.x*M.A.x+M.A.y*M.A.y);					/* |t|^2		*/
+			r2  = (M.C.x*M.C.x+M.C.y*M.C.y)*t2;						/* |r|^2		*/
+			rp2 = (M.B.x*M.B.x+M.B.y*M.B.y)*t2;						/* |r'|^2	*/
+			det = CSUB(CMUL(M.A,M.D), CMUL(M.B,M.C));
+			tp2 = (det.x*det.x+det.y*det.y)*t2;						/* |t'|^2	*/
+			P[0][0] = 1.0/t2;	P[0][1] = -rp2/t2;
+			P[1][0] = r2/t2;	P[1][1] = (t2*tp2-r2*rp2)/t2;
+
+			t00 = T[0][0]*P[0][0]+T[0][1]*P[1][0];	t01 = T[0][0]*P[0][1]+T[0][1]*P[1][1];
+			t10 = T[1][0]*P[0][0]+T[1][1]*P[1][0];	t11 = T[1][0]*P[0][1]+T[1][1]*P[1][1];
+			T[0][0] = t00; T[0][1] = t01; T[1][0] = t10; T[1][1] = t11;
+
+			/* Incoherent layer itself: diag(exp(a), exp(-a)) with exp(|a|) moved to the scale */
+			if (ib < isub) {
+				phase = CDIV(nb, cos_b);
+				a = -2*phase.y*(2*pi/lambda)*layer[ib].z;
+				if (a >= 0) {
+					T[0][1] *= exp(-2*a); T[1][1] *= exp(-2*a);
+				} else {
+					T[0][0] *= exp(2*a);  T[1][0] *= exp(2*a);
+				}
+				logscale += fabs(a);
+			}
+			scale = fabs(T[0][0]);
+			if (scale > 0) {
+				T[0][0] /= scale; T[0][1] /= scale; T[1][0] /= scale; T[1][1] /= scale;
+				logscale += log(scale);
+			}
+		}
+		rc.R += T[1][0]/T[0][0];
+		rc.T += factor*exp(-logscale)/T[0][0];
 	}
+	rc.R /= npol;
+	rc.T /= npol;
 
+	if (flat != NULL) free(flat);
+	return rc;
+}
+
+/* ===========================================================================
+-- Wavelength-batched version of TFOC_ReflN for spectral sweeps.  The layer
+-- structure (type and thickness) is common to all points, while the angle,
+-- wavelength and complex index of every layer are given per point in
+-- structure-of-arrays form.  Points are processed in groups of BATCH_LANES
+-- with the complex arithmetic written out inline across the group so that
+-- each step of the interface / gap / multiply chain can be vectorized.
+--
+-- Usage: void TFOC_ReflNBatch(int npt, double theta[], POLARIZATION mode, double lambda[],
+--                             TFOC_LAYER layer[], double nx[], double ny[], REFL result[]);
+--
+-- Inputs: npt    - number of points to evaluate
+--         theta  - [npt] incident angle (degrees) for each point
+--         mode   - TE, TM or UNPOLARIZED
+--         lambda - [npt] wavelength (nm) for each point
+--         layer  - layer structure (only type and z are used)
+--         nx, ny - [nlayers*npt] real and imaginary part of the index, n-ik
+--                  convention as in COMPLEX.  Layer i at point j is stored
+--                  at [i*npt+j]
+--
+-- Output: result - [npt] filled with R and T for each point
+--
+-- Return: void
+--
+-- Notes: Matrix debug printing is not available on this path.  Stacks with
+--        repeat blocks, incoherent or graded layers are evaluated point by
+--        point with TFOC_ReflN.  A graded layer's profile is the one set by
+--        the last TFOC_MakeLayers, so its points must share the wavelength.
+=========================================================================== */
+#define	BATCH_LANES	(8)									/* Points evaluated together */
+
+static void BatchLanes(int nl, int stride, double theta[], POLARIZATION mode, double lambda[], TFOC_LAYER layer[], double nx[], double ny[], REFL result[]) {
+
+	static POLARIZATION te_tm[2] = {TE, TM};
+	double S[BATCH_LANES], k0[BATCH_LANES];			/* Snell constant, 2 pi/lambda	*/
+	double nix[BATCH_LANES], niy[BATCH_LANES];		/* Index of current medium			*/
+	double cix[BATCH_LANES], ciy[BATCH_LANES];		/* cos(theta) in current medium	*/
+	double njx[BATCH_LANES], njy[BATCH_LANES];		/* Index of next medium				*/
+	double cjx[BATCH_LANES], cjy[BATCH_LANES];		/* cos(theta) in next medium		*/
+	double gx[BATCH_LANES], gy[BATCH_LANES];			/* exp(i*phase) of a gap			*/
+	double hx[BATCH_LANES], hy[BATCH_LANES];			/* exp(-i*phase) of a gap			*/
+	double Ax[2][BATCH_LANES], Ay[2][BATCH_LANES], Bx[2][BATCH_LANES], By[2][BATCH_LANES];		/* Ct by polarization */
+	double Cx[2][BATCH_LANES], Cy[2][BATCH_LANES], Dx[2][BATCH_LANES], Dy[2][BATCH_LANES];
+	double pax,pay, pbx,pby, ax,ay, bx,by, cx,cy;
+	double IAx,IAy, IBx,IBy, tx,ty, ux,uy, px,py, r, magn, sin_out;
+	POLARIZATION *pol;
+	int i, j, ipol, npol;
+
+	if (mode == UNPOLARIZED) {								/* Both, then average */
+		pol = te_tm; npol = 2;
+	} else {
+		pol = &mode; npol = 1;
+	}
+
+/* Initial values - identity matrix and the incident medium */
+	for (j=0; j<nl; j++) {
+		nix[j] = nx[j]; niy[j] = ny[j];
+		S[j]   = nix[j]*sin(theta[j]*pi/180.0f);
+		k0[j]  = 2*pi/lambda[j];
+		r      = 1.0-S[j]*S[j]/(nix[j]*nix[j]+niy[j]*niy[j]);
+		cix[j] = (r > 0) ? sqrt(r)  : 0;
+		ciy[j] = (r < 0) ? sqrt(-r) : 0;
+	}
+	for (ipol=0; ipol<npol; ipol++) {
+		for (j=0; j<nl; j++) {
+			Ax[ipol][j] = Dx[ipol][j] = 1.0;
+			Ay[ipol][j] = Dy[ipol][j] = Bx[ipol][j] = By[ipol][j] = Cx[ipol][j] = Cy[ipol][j] = 0.0;
+		}
+	}
+
+/* Walk the stack, finishing with the interface into the substrate */
+	for (i=1; ; i++) {
+		if (layer[i].type == SUBLAYER && layer[i].z <= 0.0) continue;		/* Not really there */
+
+		for (j=0; j<nl; j++) {
+			njx[j] = nx[i*stride+j]; njy[j] = ny[i*stride+j];
+			r      = 1.0-S[j]*S[j]/(njx[j]*njx[j]+njy[j]*njy[j]);
+			cjx[j] = (r > 0) ? sqrt(r)  : 0;
+			cjy[j] = (r < 0) ? sqrt(-r) : 0;
+		}
+
+		/* Interface: A=D=1/t, B=C=r/t reduce to b/c and a/c with c=2*ni*cos_theta_i */
+		for (ipol=0; ipol<npol; ipol++) {
+			for (j=0; j<nl; j++) {
+				if (pol[ipol] == TE) {
+					pax = nix[j]*cix[j]-niy[j]*ciy[j]; pay = nix[j]*ciy[j]+niy[j]*cix[j];
+					pbx = njx[j]*cjx[j]-njy[j]*cjy[j]; pby = njx[j]*cjy[j]+njy[j]*cjx[j];
+					cx  = 2*pax; cy = 2*pay;
+				} else {
+					pax = nix[j]*cjx[j]-niy[j]*cjy[j]; pay = nix[j]*cjy[j]+niy[j]*cjx[j];
+					pbx = njx[j]*cix[j]-njy[j]*ciy[j]; pby = njx[j]*ciy[j]+njy[j]*cix[j];
+					cx  = 2*(nix[j]*cix[j]-niy[j]*ciy[j]); cy = 2*(nix[j]*ciy[j]+niy[j]*cix[j]);
+				}
+				ax = pax-pbx; ay = pay-pby;
+				bx = pax+pbx; by = pay+pby;
+				magn = cx*cx+cy*cy;
+				IAx = (bx*cx+by*cy)/magn; IAy = (by*cx-bx*cy)/magn;
+				IBx = (ax*cx+ay*cy)/magn; IBy = (ay*cx-ax*cy)/magn;
+
+				/* Ct = Ct * [IA IB; IB IA] */
+				tx = Ax[ipol][j]*IAx-Ay[ipol][j]*IAy + Bx[ipol][j]*IBx-By[ipol][j]*IBy;
+				ty = Ax[ipol][j]*IAy+Ay[ipol][j]*IAx + Bx[ipol][j]*IBy+By[ipol][j]*IBx;
+				ux = Ax[ipol][j]*IBx-Ay[ipol][j]*IBy + Bx[ipol][j]*IAx-By[ipol][j]*IAy;
+				uy = Ax[ipol][j]*IBy+Ay[ipol][j]*IBx + Bx[ipol][j]*IAy+By[ipol][j]*IAx;
+				Ax[ipol][j] = tx; Ay[ipol][j] = ty; Bx[ipol][j] = ux; By[ipol][j] = uy;
+				tx = Cx[ipol][j]*IAx-Cy[ipol][j]*IAy + Dx[ipol][j]*IBx-Dy[ipol][j]*IBy;
+				ty = Cx[ipol][j]*IAy+Cy[ipol][j]*IAx + Dx[ipol][j]*IBy+Dy[ipol][j]*IBx;
+				ux = Cx[ipol][j]*IBx-Cy[ipol][j]*IBy + Dx[ipol][j]*IAx-Dy[ipol][j]*IAy;
+				uy = Cx[ipol][j]*IBy+Cy[ipol][j]*IBx + Dx[ipol][j]*IAy+Dy[ipol][j]*IAx;
+				Cx[ipol][j] = tx; Cy[ipol][j] = ty; Dx[ipol][j] = ux; Dy[ipol][j] = uy;
+			}
+		}
+
+		for (j=0; j<nl; j++) {
+			nix[j] = njx[j]; niy[j] = njy[j];
+			cix[j] = cjx[j]; ciy[j] = cjy[j];
+		}
+		if (layer[i].type != SUBLAYER) break;					/* That was the substrate */
+
+		/* Propagation: Ct = Ct * [exp(i*phase) 0; 0 exp(-i*phase)], phase = 2 pi z ni/(lambda cos_theta_i) */
+		for (j=0; j<nl; j++) {
+			magn  = cix[j]*cix[j]+ciy[j]*ciy[j];
+			px    = (nix[j]*cix[j]+niy[j]*ciy[j])/magn * k0[j]*layer[i].z;
+			py    = (niy[j]*cix[j]-nix[j]*ciy[j])/magn * k0[j]*layer[i].z;
+			gx[j] = cos(px)*exp(-py); gy[j] =  sin(px)*exp(-py);
+			hx[j] = cos(px)*exp(py);  hy[j] = -sin(px)*exp(py);
+		}
+		for (ipol=0; ipol<npol; ipol++) {
+			for (j=0; j<nl; j++) {
+				tx = Ax[ipol][j]*gx[j]-Ay[ipol][j]*gy[j]; Ay[ipol][j] = Ax[ipol][j]*gy[j]+Ay[ipol][j]*gx[j]; Ax[ipol][j] = tx;
+				tx = Cx[ipol][j]*gx[j]-Cy[ipol][j]*gy[j]; Cy[ipol][j] = Cx[ipol][j]*gy[j]+Cy[ipol][j]*gx[j]; Cx[ipol][j] = tx;
+				tx = Bx[ipol][j]*hx[j]-By[ipol][j]*hy[j]; By[ipol][j] = Bx[ipol][j]*hy[j]+By[ipol][j]*hx[j]; Bx[ipol][j] = tx;
+				tx = Dx[ipol][j]*hx[j]-Dy[ipol][j]*hy[j]; Dy[ipol][j] = Dx[ipol][j]*hy[j]+Dy[ipol][j]*hx[j]; Dx[ipol][j] = tx;
+			}
+		}
+	}
+
+/* Calculate the reflectivity and transmission (nix is now the substrate) */
+	for (j=0; j<nl; j++) {
+		result[j].R = result[j].T = 0;
+		sin_out = S[j]/nix[j];
+		for (ipol=0; ipol<npol; ipol++) {
+			magn = Ax[ipol][j]*Ax[ipol][j]+Ay[ipol][j]*Ay[ipol][j];
+			result[j].R += (Cx[ipol][j]*Cx[ipol][j]+Cy[ipol][j]*Cy[ipol][j])/magn;
+			if (sin_out <= 1.0 && sin_out >= 0.0) {
+				result[j].T += 1.0/magn *										/* Electric field term				 */
+									nix[j] / nx[j] *								/* Correct for index of substrate */
+									sqrt(1.0-sin_out*sin_out) / cos(theta[j]*pi/180.0f);	/* Angle correction */
+			}
+		}
+		result[j].R /= npol;
+		result[j].T /= npol;
+	}
+	return;
+}
+
+void TFOC_ReflNBatch(int npt, double theta[], POLARIZATION mode, double lambda[], TFOC_LAYER layer[], double nx[], double ny[], REFL result[]) {
+
+	TFOC_LAYER *tmp;
+	int i, j, nl;
+
+/* Repeat blocks, incoherent and graded layers are evaluated point by point */
+	if (HasRepeats(layer) || HasIncoherent(layer) || HasGraded(layer)) {
+		for (nl=1; layer[nl-1].type != EOS; nl++) ;
+		tmp = malloc(nl*sizeof(*tmp));
+		memcpy(tmp, layer, nl*sizeof(*tmp));
+		for (j=0; j<npt; j++) {
+			for (i=0; i<nl; i++) { tmp[i].n.x = nx[i*npt+j]; tmp[i].n.y = ny[i*npt+j]; }
+			result[j] = my_TFOC_ReflN(theta[j], mode, lambda[j], tmp);
+		}
+		free(tmp);
+		return;
+	}
+
+	for (j=0; j<npt; j+=BATCH_LANES) {
+		nl = (npt-j < BATCH_LANES) ? npt-j : BATCH_LANES;
+		BatchLanes(nl, npt, theta+j, mode, lambda+j, layer, nx+j, ny+j, result+j);
+	}
+	return;
+}
+
+/* ===========================================================================
+-- Reflectance and transmission averaged over a cone of incidence, as seen
+-- by a microscope objective focused on the sample.  The cone is centred on
+-- the surface normal.  Integration is over the pupil radius rho = sin(theta)
+-- with weight rho*P(rho), which for an aplanatic objective is the power in
+-- the annulus at rho.  All Gauss-Legendre nodes are evaluated in a single
+-- pass of the batched kernel.
+--
+-- Usage: REFL TFOC_ReflNCone(TFOC_CONE *cone, double lambda, TFOC_LAYER layer[]);
+--
+-- Inputs: cone   - na         numerical aperture (n0 sin(theta_max))
+--                  half_angle if > 0, maximum angle (deg) used instead of na
+--                  nodes      number of quadrature nodes (<= 0 for default)
+--                  fill       Gaussian pupil fill (1/e^2 radius over pupil
+--                             radius), 0 for uniform illumination
+--         lambda - wavelength (nm)
+--         layer  - layer expansion from TFOC_MakeLayers
+--
+-- Return: Averaged R and T.  Both 0 if the NA exceeds the incident index.
+--
+-- Notes: Integrating a linearly polarized beam over the full azimuth of the
+--        cone gives equal weight to TE and TM at every angle, so there is no
+--        polarization argument; the unpolarized average is always returned.
+=========================================================================== */
+#define	CONE_NODES_DFLT	(12)
+#define	CONE_NODES_MAX		(64)
+
+REFL TFOC_ReflNCone(TFOC_CONE *cone, double lambda, TFOC_LAYER layer[]) {
+
+	double x[CONE_NODES_MAX], w[CONE_NODES_MAX];
+	double theta[CONE_NODES_MAX], lval[CONE_NODES_MAX];
+	REFL rval[CONE_NODES_MAX], result;
+	double *nx, *ny;
+	double sin_max, rho, pupil, wsum;
+	int i, k, nl, nodes;
+
+	result.R = result.T = 0.0;
+
+	if ((nodes = cone->nodes) <= 0) nodes = CONE_NODES_DFLT;
+	if (nodes > CONE_NODES_MAX) nodes = CONE_NODES_MAX;
+
+	if (cone->half_angle > 0) {
+		sin_max = sin(cone->half_angle*pi/180.0);
+	} else {
+		sin_max = cone->na / layer[0].n.x;
+	}
+	if (sin_max <= 0) return my_TFOC_ReflN(0.0, UNPOLARIZED, lambda, layer);
+	if (sin_max > 1.0) return result;
+
+	for (nl=1; layer[nl-1].type != EOS; nl++) ;
+	nx = malloc(nl*nodes*sizeof(*nx));
+	ny = malloc(nl*nodes*sizeof(*ny));
+
+	GaussLegendre(nodes, x, w);
+	for (k=0; k<nodes; k++) {
+		rho = 0.5*(x[k]+1.0);										/* Map [-1,1] to [0,1] of the pupil */
+		theta[k] = asin(rho*sin_max)*180.0/pi;
+		lval[k]  = lambda;
+		pupil    = (cone->fill > 0) ? exp(-2.0*rho*rho/(cone->fill*cone->fill)) : 1.0;
+		w[k]    *= rho*pupil;
+		for (i=0; i<nl; i++) {
+			nx[i*nodes+k] = layer[i].n.x;
+			ny[i*nodes+k] = layer[i].n.y;
+		}
+	}
+
+	TFOC_ReflNBatch(nodes, theta, UNPOLARIZED, lval, layer, nx, ny, rval);
+
+	wsum = 0;
+	for (k=0; k<nodes; k++) {
+		result.R += w[k]*rval[k].R;
+		result.T += w[k]*rval[k].T;
+		wsum     += w[k];
+	}
+	result.R /= wsum;
+	result.T /= wsum;
+
+	free(nx); free(ny);
+	return result;
+}
+
+/* ===========================================================================
+-- Gauss-Legendre nodes and weights on [-1,1] by Newton iteration on P_n,
+-- starting from the usual cosine estimate of each root.
+=========================================================================== */
+static void GaussLegendre(int n, double x[], double w[]) {
+
+	double z, z1, p1, p2, p3, pp;
+	int i, j, it;
+
+	for (i=0; i<(n+1)/2; i++) {
+		z = cos(pi*(i+0.75)/(n+0.5));
+		for (it=0; it<100; it++) {
+			p1 = 1.0; p2 = 0.0;
+			for (j=1; j<=n; j++) {
+				p3 = p2; p2 = p1;
+				p1 = ((2.0*j-1.0)*z*p2-(j-1.0)*p3)/j;
+			}
+			pp = n*(z*p1-p2)/(z*z-1.0);
+			z1 = z; z = z1-p1/pp;
+			if (fabs(z-z1) < 1E-15) break;
+		}
+		x[i] = -z; x[n-1-i] = z;
+		w[i] = w[n-1-i] = 2.0/((1.0-z*z)*pp*pp);
+	}
+	return;
+}
+
+
+/* ===========================================================================
+-- Cached evaluation for sweeps where only a contiguous range of sample rows
+-- changes from point to point (-vt, -vn, -vk, -vfe, -vp0..2, ...).  The
+-- product of the stack in front of the rows (left) and behind the rows
+-- (right) is calculated once, so each point only has to rebuild the
+-- interfaces and gaps of the sublayers belonging to the varied rows and
+-- do two additional 2x2 multiplies.
+--
+-- Usage: TFOC_SWEEP *TFOC_SweepInit(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[],
+--                                   int first_row, int last_row);
+--        REFL TFOC_SweepRefl(TFOC_SWEEP *sweep, TFOC_LAYER layer[]);
+--        void TFOC_SweepFree(TFOC_SWEEP *sweep);
+--
+-- Inputs: theta, mode, lambda - as for TFOC_ReflN, fixed for the sweep
+--         layer     - current layer expansion (from TFOC_MakeLayers)
+--         first_row - first sample row that will be varied
+--         last_row  - last sample row that will be varied
+--         sweep     - cache returned by TFOC_SweepInit
+--
+-- Return: TFOC_SweepInit returns the cache, or NULL if the rows can not be
+--         handled (incident medium or substrate varied, or the stack has
+--         repeat blocks, incoherent or graded layers).  The caller should
+--         then just use TFOC_ReflN for each point.
+--         TFOC_SweepRefl returns the same result as TFOC_ReflN for the layers.
+--
+-- Notes: Only the sublayers of the varied rows may change between calls.
+--        Their number may change, but rows in front and behind the range
+--        must keep the same expansion, n,k and thickness.
+=========================================================================== */
+struct _TFOC_SWEEP {
+	int first_row, last_row;					/* Range of sample rows being varied		*/
+	int ifirst;										/* Index of first layer of first_row		*/
+	double S, lambda;								/* Snell constant and wavelength				*/
+	double factor;									/* Correction from |t|^2 to transmission	*/
+	POLARIZATION pol[2];							/* TE/TM or both for unpolarized				*/
+	int npol;
+	COMPLEX n_left,  cos_left;					/* Last medium in front of the rows			*/
+	COMPLEX n_right, cos_right;				/* First medium behind the rows				*/
+	M_ARRAY L[2], R[2];							/* Cached left and right products			*/
+};
+
+TFOC_SWEEP *TFOC_SweepInit(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[], int first_row, int last_row) {
+
+	TFOC_SWEEP *sweep;
+	COMPLEX ni, cos_i, cos_j;
+	M_ARRAY Cij, Ciz;
+	double sin_out;
+	int i, ifirst, ilast, ileft, iright, ipol;
+
+/* Locate the sublayers making up the rows, and the media on either side */
+	if (first_row <= 0 || last_row < first_row) return NULL;
+	if (HasRepeats(layer) || HasIncoherent(layer) || HasGraded(layer)) return NULL;
+	for (ifirst=1; layer[ifirst].type == SUBLAYER && layer[ifirst].layer < first_row; ifirst++) ;
+	if (layer[ifirst].type != SUBLAYER) return NULL;					/* Rows include the substrate */
+	for (ilast=ifirst; layer[ilast+1].type == SUBLAYER && layer[ilast+1].layer <= last_row; ilast++) ;
+	if (layer[ilast+1].type != SUBLAYER && layer[ilast+1].layer <= last_row) return NULL;
+	for (ileft=ifirst-1; ileft > 0 && layer[ileft].z <= 0.0; ileft--) ;
+	for (iright=ilast+1; layer[iright].type == SUBLAYER && layer[iright].z <= 0.0; iright++) ;
+
+	sweep = calloc(1, sizeof(*sweep));
+	sweep->first_row = first_row;
+	sweep->last_row  = last_row;
+	sweep->ifirst    = ifirst;
+	sweep->lambda    = lambda;
+	if (mode == UNPOLARIZED) {
+		sweep->pol[0] = TE; sweep->pol[1] = TM; sweep->npol = 2;
+	} else {
+		sweep->pol[0] = mode; sweep->npol = 1;
+	}
+	sweep->S = layer[0].n.x*sin(theta*pi/180.0f);
+
+/* Left product - everything up to and including the gap of the left medium */
+	sweep->L[0] = sweep->L[1] = IDENTITY_MATRIX();
+	ni    = layer[0].n;
+	cos_i = CosTheta(sweep->S, ni);
+	for (i=1; i<=ileft; i++) {
+		if (layer[i].z <= 0.0) continue;
+		cos_j = CosTheta(sweep->S, layer[i].n);
+		Ciz = CalcGap(layer[i].z, layer[i].n, cos_j, lambda);
+		for (ipol=0; ipol<sweep->npol; ipol++) {
+			Cij = CalcInterface(sweep->pol[ipol], ni, cos_i, layer[i].n, cos_j);
+			sweep->L[ipol] = MATMUL(&sweep->L[ipol], &Cij);
+			sweep->L[ipol] = MATMUL(&sweep->L[ipol], &Ciz);
+		}
+		ni = layer[i].n; cos_i = cos_j;
+	}
+	sweep->n_left = ni; sweep->cos_left = cos_i;
+
+/* Right product - gap of the right medium and everything behind it */
+	sweep->R[0] = sweep->R[1] = IDENTITY_MATRIX();
+	ni    = layer[iright].n;
+	cos_i = CosTheta(sweep->S, ni);
+	sweep->n_right = ni; sweep->cos_right = cos_i;
+	if (layer[iright].type == SUBLAYER) {
+		Ciz = CalcGap(layer[iright].z, ni, cos_i, lambda);
+		for (ipol=0; ipol<sweep->npol; ipol++) sweep->R[ipol] = Ciz;
+		for (i=iright+1; ; i++) {
+			if (layer[i].type == SUBLAYER && layer[i].z <= 0.0) continue;
+			cos_j = CosTheta(sweep->S, layer[i].n);
+			for (ipol=0; ipol<sweep->npol; ipol++) {
+				Cij = CalcInterface(sweep->pol[ipol], ni, cos_i, layer[i].n, cos_j);
+				sweep->R[ipol] = MATMUL(&sweep->R[ipol], &Cij);
+			}
+			if (layer[i].type != SUBLAYER) break;						/* That was the substrate */
+			Ciz = CalcGap(layer[i].z, layer[i].n, cos_j, lambda);
+			for (ipol=0; ipol<sweep->npol; ipol++) sweep->R[ipol] = MATMUL(&sweep->R[ipol], &Ciz);
+			ni = layer[i].n; cos_i = cos_j;
+		}
+	} else {
+		i = iright;
+	}
+
+/* Transmission correction from incident medium and substrate (layer i) */
+	sin_out = sweep->S/layer[i].n.x;
+	if (sin_out > 1.0 || sin_out < 0.0) {
+		sweep->factor = 0;
+	} else {
+		sweep->factor = layer[i].n.x / layer[0].n.x  *			/* Correct for index of substrate */
+							 sqrt(1.0-sin_out*sin_out) / cos(theta*pi/180.0f);	/* Angle correction */
+	}
+
+	return sweep;
+}
+
+REFL TFOC_SweepRefl(TFOC_SWEEP *sweep, TFOC_LAYER layer[]) {
+
+	M_ARRAY Ct[2], Cij, Ciz;
+	COMPLEX ni, cos_i, cos_j, one={1.0, 0.0};
+	REFL rc;
+	int i, ipol;
+
+/* Walk only the sublayers of the varied rows, starting from the left medium */
+	ni = sweep->n_left; cos_i = sweep->cos_left;
+	for (ipol=0; ipol<sweep->npol; ipol++) Ct[ipol] = sweep->L[ipol];
+	for (i=sweep->ifirst; layer[i].type == SUBLAYER && layer[i].layer <= sweep->last_row; i++) {
+		if (layer[i].z <= 0.0) continue;
+		cos_j = CosTheta(sweep->S, layer[i].n);
+		Ciz = CalcGap(layer[i].z, layer[i].n, cos_j, sweep->lambda);
+		for (ipol=0; ipol<sweep->npol; ipol++) {
+			Cij = CalcInterface(sweep->pol[ipol], ni, cos_i, layer[i].n, cos_j);
+			Ct[ipol] = MATMUL(&Ct[ipol], &Cij);
+			Ct[ipol] = MATMUL(&Ct[ipol], &Ciz);
+		}
+		ni = layer[i].n; cos_i = cos_j;
+	}
+
+/* Into the right medium and on through the cached product */
+	rc.R = rc.T = 0;
+	for (ipol=0; ipol<sweep->npol; ipol++) {
+		Cij = CalcInterface(sweep->pol[ipol], ni, cos_i, sweep->n_right, sweep->cos_right);
+		Ct[ipol] = MATMUL(&Ct[ipol], &Cij);
+		Ct[ipol] = MATMUL(&Ct[ipol], &sweep->R[ipol]);
+		rc.R += pow(CABS(CDIV(Ct[ipol].C,Ct[ipol].A)),2);
+		rc.T += pow(CABS(CDIV(one, Ct[ipol].A)),2) * sweep->factor;
+	}
+	rc.R /= sweep->npol;
+	rc.T /= sweep->npol;
+
+	return rc;
+}
+
+void TFOC_SweepFree(TFOC_SWEEP *sweep) {
+	free(sweep);
+	return;
+}
+
+
+/* ===========================================================================
+-- Dual number (value + derivative) helpers for TFOC_ReflNJacobian
+=========================================================================== */
+static DCOMPLEX DCMUL(DCOMPLEX a, DCOMPLEX b) {
+	DCOMPLEX r;
+	r.v = CMUL(a.v, b.v);
+	r.d = CADD(CMUL(a.d, b.v), CMUL(a.v, b.d));
+	return r;
+}
+
+static DCOMPLEX DCDIV(DCOMPLEX a, DCOMPLEX b) {
+	DCOMPLEX r;
+	r.v = CDIV(a.v, b.v);
+	r.d = CDIV(CSUB(a.d, CMUL(r.v, b.d)), b.v);
+	return r;
+}
+
+static DCOMPLEX DCADD(DCOMPLEX a, DCOMPLEX b) {
+	DCOMPLEX r;
+	r.v = CADD(a.v, b.v);
+	r.d = CADD(a.d, b.d);
+	return r;
+}
+
+static DCOMPLEX DCSUB(DCOMPLEX a, DCOMPLEX b) {
+	DCOMPLEX r;
+	r.v = CSUB(a.v, b.v);
+	r.d = CSUB(a.d, b.d);
+	return r;
+}
+
+/* Dual version of CosTheta - S and n may both carry a derivative */
+static DCOMPLEX DCosTheta(double S, double dS, DCOMPLEX n) {
+	DCOMPLEX c;
+	double n2, r, dr;
+
+	n2 = n.v.x*n.v.x+n.v.y*n.v.y;
+	r  = 1.0-S*S/n2;
+	dr = -2*S*dS/n2 + S*S*2*(n.v.x*n.d.x+n.v.y*n.d.y)/(n2*n2);
+	c.v = CSQRT(r);
+	c.d.x = (r > 0) ?  dr/(2*c.v.x) : 0;
+	c.d.y = (r < 0) ? -dr/(2*c.v.y) : 0;
+	return c;
+}
+
+/* Dual version of CalcInterface: A=D=1/t=b/c, B=C=r/t=a/c */
+static void DCalcInterface(POLARIZATION mode, DCOMPLEX ni, DCOMPLEX cos_i, DCOMPLEX nj, DCOMPLEX cos_j, M_ARRAY *V, M_ARRAY *D) {
+	DCOMPLEX pa, pb, c, A, B;
+	static DCOMPLEX two = {{2.0,0.0},{0.0,0.0}};
+
+	if (mode == TE) {
+		pa = DCMUL(ni, cos_i); pb = DCMUL(nj, cos_j);
+		c  = DCMUL(two, pa);
+	} else {
+		pa = DCMUL(ni, cos_j); pb = DCMUL(nj, cos_i);
+		c  = DCMUL(two, DCMUL(ni, cos_i));
+	}
+	A = DCDIV(DCADD(pa, pb), c);
+	B = DCDIV(DCSUB(pa, pb), c);
+	V->A = V->D = A.v; V->B = V->C = B.v;
+	D->A = D->D = A.d; D->B = D->C = B.d;
+	return;
+}
+
+/* Dual version of CalcGap: A=exp(i*phase), D=exp(-i*phase) */
+static void DCalcGap(double z, double dz, DCOMPLEX ni, DCOMPLEX cos_i, double lambda, M_ARRAY *V, M_ARRAY *D) {
+	DCOMPLEX phase;
+	COMPLEX dphase;
+
+	phase = DCDIV(ni, cos_i);
+	dphase.x = (phase.d.x*z + phase.v.x*dz)*(2*pi/lambda);
+	dphase.y = (phase.d.y*z + phase.v.y*dz)*(2*pi/lambda);
+	*V = CalcGap(z, ni.v, cos_i.v, lambda);
+	memset(D, 0, sizeof(*D));
+	D->A.x = -V->A.y*dphase.x - V->A.x*dphase.y;			/*  i*A*dphase */
+	D->A.y =  V->A.x*dphase.x - V->A.y*dphase.y;
+	D->D.x =  V->D.y*dphase.x + V->D.x*dphase.y;			/* -i*D*dphase */
+	D->D.y = -V->D.x*dphase.x + V->D.y*dphase.y;
+	return;
+}
+
+/* (V,D) = (V,D)*(Mv,Md) in dual arithmetic */
+static void DMATMUL(M_ARRAY *V, M_ARRAY *D, M_ARRAY *Mv, M_ARRAY *Md) {
+	M_ARRAY t1, t2;
+
+	t1 = MATMUL(D, Mv);
+	t2 = MATMUL(V, Md);
+	D->A = CADD(t1.A, t2.A); D->B = CADD(t1.B, t2.B);
+	D->C = CADD(t1.C, t2.C); D->D = CADD(t1.D, t2.D);
+	*V = MATMUL(V, Mv);
+	return;
+}
+
+/* ===========================================================================
+-- Dual product of the steps from medium istart through layers i0..i1 with
+-- the derivative seeded on every layer belonging to sample row "row".
+-- Zero thickness layers are skipped unless they belong to the row.
+=========================================================================== */
+static void DualProduct(POLARIZATION mode, double lambda, double S, double dS, TFOC_LAYER layer[],
+								int istart, int i0, int i1, int row, JAC_PARM parm, double zscale, M_ARRAY *V, M_ARRAY *D) {
+	DCOMPLEX ni, nj, cos_i, cos_j;
+	M_ARRAY Mv, Md;
+	int i;
+
+	*V = IDENTITY_MATRIX();
+	memset(D, 0, sizeof(*D));
+
+	ni.v = layer[istart].n; ni.d.x = ni.d.y = 0;
+	if (layer[istart].layer == row && parm == JAC_N) ni.d.x =  1;
+	if (layer[istart].layer == row && parm == JAC_K) ni.d.y = -1;		/* n-ik convention */
+	cos_i = DCosTheta(S, dS, ni);
+
+	for (i=i0; i<=i1; i++) {
+		if (layer[i].type == SUBLAYER && layer[i].z <= 0.0 && layer[i].layer != row) continue;
+		nj.v = layer[i].n; nj.d.x = nj.d.y = 0;
+		if (layer[i].layer == row && parm == JAC_N) nj.d.x =  1;
+		if (layer[i].layer == row && parm == JAC_K) nj.d.y = -1;
+		cos_j = DCosTheta(S, dS, nj);
+
+		DCalcInterface(mode, ni, cos_i, nj, cos_j, &Mv, &Md);
+		DMATMUL(V, D, &Mv, &Md);
+		if (layer[i].type == SUBLAYER) {
+			DCalcGap((layer[i].z > 0) ? layer[i].z : 0.0, (layer[i].layer == row && parm == JAC_Z) ? zscale : 0.0,
+						nj, cos_j, lambda, &Mv, &Md);
+			DMATMUL(V, D, &Mv, &Md);
+		}
+		ni = nj; cos_i = cos_j;
+	}
+	return;
+}
+
+/* Derivative of |X|^2 given dX */
+#define	DABS2(X,dX)		(2*((X).x*(dX).x+(X).y*(dX).y))
+
+/* ===========================================================================
+-- Analytic derivatives of R and T with respect to the thickness, n and k
+-- of every sample row.  The stack is split into steps (interface into a
+-- layer followed by its gap) and prefix / suffix products of the steps are
+-- formed once.  For each row, only the steps touched by the row are rebuilt
+-- with dual numbers (value + derivative) and the derivative of the full
+-- product is then prefix * d(segment) * suffix.  Total cost is O(N) in the
+-- number of layers rather than 2N+1 complete evaluations.
+--
+-- Usage: REFL TFOC_ReflNJacobian(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[],
+--                                int nrows, TFOC_JACOBIAN jac[]);
+--
+-- Inputs: theta, mode, lambda, layer - as for TFOC_ReflN
+--         nrows - number of entries in jac (number of sample rows)
+--
+-- Output: jac[row] - dR/dz, dT/dz (per nm), dR/dn, dT/dn, dR/dk, dT/dk for
+--                    each sample row (indexed by TFOC_LAYER.layer)
+--
+-- Return: R and T as from TFOC_ReflN
+--
+-- Notes: (1) Thickness of a row with sublayers is split equally among the
+--            sublayers.  The doping profile itself is held fixed.
+--        (2) Rows of zero thickness report the one-sided derivative for
+--            the layer just appearing.
+--        (3) Incident medium and substrate have no thickness derivative.
+--        (4) Rows in a repeat block change in every period.  These stacks
+--            are expanded and each row takes a full O(N) pass.
+--        (5) Intensities through incoherent layers are not analytic in the
+--            amplitudes, so stacks with them use central differences.  So
+--            do stacks with graded layers, whose profile moves with the
+--            layer's n,k and stretches with its thickness.
+=========================================================================== */
+REFL TFOC_ReflNJacobian(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[], int nrows, TFOC_JACOBIAN jac[]) {
+
+	static POLARIZATION te_tm[2] = {TE, TM};
+	static JAC_PARM parms[3] = {JAC_Z, JAC_N, JAC_K};
+	POLARIZATION *pol;
+	M_ARRAY *P, *Q, Ct, Cij, Ciz, V, D, dCt;
+	COMPLEX ni, cos_i, cos_j;
+	double S, dS, sin_out, cos_out, factor, dfactor, a2, c2, dR, dT, zscale;
+	int *sidx, nsteps, isub, ilay, s, sa, se, row, ipol, npol, ip, i0, i1, istart, nsub, k;
+	BOOL full, whole;
+	TFOC_LAYER *flat, *orig=layer;
+	REFL rc, *dst;
+
+	if (mode == UNPOLARIZED) {
+		pol = te_tm; npol = 2;
+	} else {
+		pol = &mode; npol = 1;
+	}
+	memset(jac, 0, nrows*sizeof(*jac));
+	if (HasIncoherent(layer) || HasGraded(layer)) return NumericJacobian(theta, mode, lambda, layer, nrows, jac);
+
+/* Repeat blocks are written out; rows then recur so each takes a full pass */
+	if ( (flat = ExpandRepeats(layer)) != NULL) layer = flat;
+	full = (flat != NULL);
+
+/* List of steps - layers actually present, then the substrate */
+	for (isub=1; layer[isub].type == SUBLAYER; isub++) ;
+	sidx = malloc((isub+1)*sizeof(*sidx));
+	P    = malloc((isub+1)*sizeof(*P));
+	Q    = malloc((isub+1)*sizeof(*Q));
+	for (nsteps=0,ilay=1; ilay<=isub; ilay++) {
+		if (layer[ilay].type == SUBLAYER && layer[ilay].z <= 0.0) continue;
+		sidx[nsteps++] = ilay;
+	}
+
+	S  = layer[0].n.x*sin(theta*pi/180.0f);
+	sin_out = S/layer[isub].n.x;
+	cos_out = (sin_out > 1.0 || sin_out < 0.0) ? 0 : sqrt(1.0-sin_out*sin_out);
+	factor  = layer[isub].n.x / layer[0].n.x * cos_out / cos(theta*pi/180.0f);
+
+	rc.R = rc.T = 0;
+	for (ipol=0; ipol<npol; ipol++) {
+
+/* Prefix products P[s] (steps before s) and the total */
+		Ct = IDENTITY_MATRIX();
+		ni = layer[0].n; cos_i = CosTheta(S, ni);
+		for (s=0; s<nsteps; s++) {
+			P[s] = Ct;
+			ilay  = sidx[s];
+			cos_j = CosTheta(S, layer[ilay].n);
+			Cij = CalcInterface(pol[ipol], ni, cos_i, layer[ilay].n, cos_j);
+			Ct  = MATMUL(&Ct, &Cij);
+			if (layer[ilay].type == SUBLAYER) {
+				Ciz = CalcGap(layer[ilay].z, layer[ilay].n, cos_j, lambda);
+				Ct  = MATMUL(&Ct, &Ciz);
+			}
+			ni = layer[ilay].n; cos_i = cos_j;
+		}
+
+/* Suffix products Q[s] (steps after s), built backwards */
+		Q[nsteps-1] = IDENTITY_MATRIX();
+		for (s=nsteps-1; s>0; s--) {
+			ilay  = sidx[s];
+			ni    = layer[sidx[s-1]].n;
+			cos_i = CosTheta(S, ni);
+			cos_j = CosTheta(S, layer[ilay].n);
+			Cij = CalcInterface(pol[ipol], ni, cos_i, layer[ilay].n, cos_j);
+			if (layer[ilay].type == SUBLAYER) {
+				Ciz = CalcGap(layer[ilay].z, layer[ilay].n, cos_j, lambda);
+				Cij = MATMUL(&Cij, &Ciz);
+			}
+			Q[s-1] = MATMUL(&Cij, &Q[s]);
+		}
+
+		a2 = Ct.A.x*Ct.A.x+Ct.A.y*Ct.A.y;
+		c2 = Ct.C.x*Ct.C.x+Ct.C.y*Ct.C.y;
+		rc.R += c2/a2;
+		rc.T += factor/a2;
+
+/* Now each row and parameter */
+		for (row=0; row<nrows; row++) {
+			for (i0=0; layer[i0].type != EOS && layer[i0].layer != row; i0++) ;
+			if (layer[i0].layer != row) continue;							/* Row not in the layers */
+			for (i1=i0; layer[i1].type != EOS && layer[i1+1].layer == row; i1++) ;
+			for (k=0; orig[k].type != EOS && orig[k].layer != row; k++) ;		/* Sublayers in one period */
+			for (nsub=1; orig[k].type != EOS && orig[k+1].layer == row; k++,nsub++) ;
+
+			for (sa=0; sa<nsteps-1 && layer[sidx[sa]].layer < row; sa++) ;
+			for (se=sa; se<nsteps-1 && layer[sidx[se]].layer <= row; se++) ;
+			istart = (sa > 0) ? sidx[sa-1] : 0;
+			zscale = 1.0/nsub;
+
+			for (ip=0; ip<3; ip++) {
+				if (parms[ip] == JAC_Z && (row == layer[0].layer || layer[i1].type == EOS)) continue;
+				dS = 0; dfactor = 0;
+				if (row == layer[0].layer && parms[ip] == JAC_N) dS = sin(theta*pi/180.0f);	/* Changes S everywhere */
+				if (row == layer[0].layer || full) {						/* Dual pass from the start */
+					whole = (full || dS != 0);
+					DualProduct(pol[ipol], lambda, S, dS, layer, 0, 1, whole ? isub : sidx[se], row, parms[ip], zscale, &V, &D);
+					dCt = whole ? D : MATMUL(&D, &Q[se]);
+				} else {
+					DualProduct(pol[ipol], lambda, S, dS, layer, istart, i0, sidx[se], row, parms[ip], zscale, &V, &D);
+					dCt = MATMUL(&P[sa], &D);
+					dCt = MATMUL(&dCt, &Q[se]);
+				}
+				if (row == layer[0].layer && parms[ip] == JAC_N && cos_out > 0) {
+					dfactor = -factor/layer[0].n.x + layer[isub].n.x/layer[0].n.x/cos(theta*pi/180.0f) *
+								 (-sin_out*(dS/layer[isub].n.x)/cos_out);
+				}
+				if (layer[i1].type == EOS && parms[ip] == JAC_N && cos_out > 0) {
+					dfactor = factor/layer[isub].n.x + layer[isub].n.x/layer[0].n.x/cos(theta*pi/180.0f) *
+								 (-sin_out*(-S/(layer[isub].n.x*layer[isub].n.x))/cos_out);
+				}
+				dR = DABS2(Ct.C, dCt.C)/a2 - c2*DABS2(Ct.A, dCt.A)/(a2*a2);
+				dT = dfactor/a2 - factor*DABS2(Ct.A, dCt.A)/(a2*a2);
+				dst = (parms[ip] == JAC_Z) ? &jac[row].dz : (parms[ip] == JAC_N) ? &jac[row].dn : &jac[row].dk;
+				dst->R += dR/npol;
+				dst->T += dT/npol;
+			}
+		}
+	}
+	rc.R /= npol;
+	rc.T /= npol;
+
+	free(sidx); free(P); free(Q);
+	if (flat != NULL) free(flat);
+	return rc;
+}
+
+
+/* ===========================================================================
+-- Central difference version of TFOC_ReflNJacobian for stacks that the
+-- analytic path does not cover (incoherent layers).
+=========================================================================== */
+#define	JAC_DZ	(1E-3)										/* Thickness step (nm)	*/
+#define	JAC_DN	(1E-6)										/* n and k step			*/
+
+static REFL NumericJacobian(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[], int nrows, TFOC_JACOBIAN jac[]) {
+
+	TFOC_LAYER *work;
+	REFL rc, rp, rm, *dst;
+	double h;
+	int i, nl, nsub, row, ip;
+	BOOL one_sided;
+
+	for (nl=1; layer[nl-1].type != EOS; nl++) ;
+	work = malloc(nl*sizeof(*work));
+	memcpy(work, layer, nl*sizeof(*work));
+	rc = my_TFOC_ReflN(theta, mode, lambda, layer);
+
+	for (row=0; row<nrows; row++) {
+		for (nsub=0,one_sided=FALSE,i=0; i<nl; i++) {
+			if (layer[i].layer != row) continue;
+			nsub++;
+			if (layer[i].z <= 0.0) one_sided = TRUE;
+		}
+		if (nsub == 0) continue;
+
+		for (ip=0; ip<3; ip++) {
+			if (ip == 0 && (row == layer[0].layer || layer[nl-1].layer == row)) continue;
+			h = (ip == 0) ? JAC_DZ : JAC_DN;
+			for (i=0; i<nl; i++) {
+				if (layer[i].layer != row) continue;
+				if (ip == 0) work[i].z   = layer[i].z + h/nsub;
+				if (ip == 1) work[i].n.x = layer[i].n.x + h;
+				if (ip == 2) work[i].n.y = layer[i].n.y - h;		/* n-ik convention */
+			}
+			rp = my_TFOC_ReflN(theta, mode, lambda, work);
+			if (ip == 0 && one_sided) {
+				rm = rc;
+			} else {
+				for (i=0; i<nl; i++) {
+					if (layer[i].layer != row) continue;
+					if (ip == 0) work[i].z   = layer[i].z - h/nsub;
+					if (ip == 1) work[i].n.x = layer[i].n.x - h;
+					if (ip == 2) work[i].n.y = layer[i].n.y + h;
+				}
+				rm = my_TFOC_ReflN(theta, mode, lambda, work);
+				h *= 2;
+			}
+			memcpy(work, layer, nl*sizeof(*work));
+			dst = (ip == 0) ? &jac[row].dz : (ip == 1) ? &jac[row].dn : &jac[row].dk;
+			dst->R = (rp.R-rm.R)/h;
+			dst->T = (rp.T-rm.T)/h;
+		}
+	}
+	free(work);
 	return rc;
 }
 
@@ -164,72 +1398,80 @@ static REFL my_TFOC_ReflN(double theta, POLARIZATION mode, double lambda, TFOC_L
 -- initial setup values and determines the reflectance coefficient.
 =========================================================================== */
 REFL TFOC_Refl(double theta, POLARIZATION mode, double lambda, COMPLEX n0, COMPLEX n1, COMPLEX ns, double z) {
-	REFL te={0.0,0.0},tm;
-
-	switch (mode) {
-		case TM:
-		case TE:
-			te = my_TFOC_Refl(theta, mode, lambda, n0, n1, ns, z);
-			break;
-		case UNPOLARIZED:
-			te = my_TFOC_Refl(theta, TE, lambda, n0, n1, ns, z);
-			tm = my_TFOC_Refl(theta, TM, lambda, n0, n1, ns, z);
-			te.R = 0.5*(te.R + tm.R);
-			te.T = 0.5*(te.T + tm.T);
-	}
-	return te;
+	return my_TFOC_Refl(theta, mode, lambda, n0, n1, ns, z);
 }
 
 static REFL my_TFOC_Refl(double theta, POLARIZATION mode, double lambda, COMPLEX n0, COMPLEX n1, COMPLEX ns, double z) {
 
-	double S, sin_out;
+	static POLARIZATION te_tm[2] = {TE, TM};
+	double S, sin_out, factor;
 	M_ARRAY C01, C1z, C12, Ct;
-	COMPLEX one={1.0, 0.0};
+	COMPLEX cos_0, cos_1, cos_s, one={1.0, 0.0};
+	POLARIZATION *pol;
 	REFL rc;
+	int ipol, npol;
 
-	S = sin(theta*pi/180.0f);								/* S factor */
-
-/* Calculate the front interface element first */
-	C01 = CalcInterface(S, mode, n0, n1);
-
-/* Calculate the Z phase */
-	C1z = CalcGap(z, S, n1, lambda);
+	if (mode == UNPOLARIZED) {								/* Both, then average */
+		pol = te_tm; npol = 2;
+	} else {
+		pol = &mode; npol = 1;
+	}
 
-/* Calculate the amorphous/crystalline now */
-	C12 = CalcInterface(S, mode, n1, ns);
+	S = sin(theta*pi/180.0f);								/* S factor */
+	cos_0 = CosTheta(S, n0);
+	cos_1 = CosTheta(S, n1);
+	cos_s = CosTheta(S, ns);
 
-/* And do the multiplications */
-	Ct = MATMUL(&C01, &C1z);
-	Ct = MATMUL(&Ct, &C12);
+/* Calculate the Z phase (independent of polarization) */
+	C1z = CalcGap(z, n1, cos_1, lambda);
 
-/* Calculate the reflectivity */
-	rc.R = pow(CABS(CDIV(Ct.C,Ct.A)),2);
 	sin_out = S/ns.x;
 	if (sin_out > 1.0 || sin_out < 0.0) {
-		rc.T = 0;
+		factor = 0;
 	} else {
-		rc.T = pow(CABS(CDIV(one, Ct.A)),2) *			/* Electric field term				 */
-				 ns.x / n0.x  *								/* Correct for index of substrate */
-				 sqrt(1.0-sin_out*sin_out) / cos(theta*pi/180.0f);	/* Angle correction */
+		factor = ns.x / n0.x  *									/* Correct for index of substrate */
+					sqrt(1.0-sin_out*sin_out) / cos(theta*pi/180.0f);	/* Angle correction */
+	}
+
+	rc.R = rc.T = 0;
+	for (ipol=0; ipol<npol; ipol++) {
+		C01 = CalcInterface(pol[ipol], n0, cos_0, n1, cos_1);	/* Front interface				*/
+		C12 = CalcInterface(pol[ipol], n1, cos_1, ns, cos_s);	/* Film to substrate interface */
+		Ct = MATMUL(&C01, &C1z);
+		Ct = MATMUL(&Ct, &C12);
+
+		rc.R += pow(CABS(CDIV(Ct.C,Ct.A)),2);
+		rc.T += pow(CABS(CDIV(one, Ct.A)),2) * factor;		/* Electric field term */
 	}
+	rc.R /= npol;
+	rc.T /= npol;
 
 	return rc;
 }
 
 /* ===========================================================================
--- Routine to return the matrix for a gap through material i
+-- Routine to return the cosine of the propagation angle in material i
 --
 -- Inputs: S - Snell constant of motion - n*sin(theta)
---         mode - TE or TM mode (s or p)
+--         ni - complex index of the material
 =========================================================================== */
-static M_ARRAY CalcGap(double z, double S, COMPLEX ni, double lambda) {
+static COMPLEX CosTheta(double S, COMPLEX ni) {
+	return CSQRT(1.0-S*S/(ni.x*ni.x+ni.y*ni.y));			/* If < 0 evanescent */
+/*	return CSQRT(1.0-pow(S/ni.x,2)); */
+}
+
+/* ===========================================================================
+-- Routine to return the matrix for a gap through material i
+--
+-- Inputs: z - thickness of the material (nm)
+--         ni - complex index of the material
+--         cos_theta_i - cosine of propagation angle (from CosTheta)
+--         lambda - wavelength (nm)
+=========================================================================== */
+static M_ARRAY CalcGap(double z, COMPLEX ni, COMPLEX cos_theta_i, double lambda) {
 
 	M_ARRAY Cij;
 	COMPLEX phase;
-	COMPLEX cos_theta_i;												/* cosine of angles	*/
-
-	cos_theta_i = CSQRT(1.0-S*S/(ni.x*ni.x+ni.y*ni.y));	/* If < 0 evanescent */
-/*	cos_theta_i = sqrt(1.0-pow(S/ni.x,2)); */
 
 /* --------------------------------------------------------------------
  * 2023.07.13 - Mike Thompson
@@ -251,18 +1493,192 @@ static M_ARRAY CalcGap(double z, double S, COMPLEX ni, double lambda) {
 }
 
 
+/* ===========================================================================
+-- Transfer matrix through a continuously graded layer.  In the tangential
+-- field basis (E,H) the gap of CalcGap is exp(z K) with
+--     K = i beta [ 0  1/p ]      beta = 2 pi/lambda n/cos (as CalcGap)
+--                [ p   0  ]      p    = n cos (TE) or n/cos (TM)
+-- and with n varying over depth the ordered product of such steps is
+-- integrated by the fourth order Magnus method (two Gauss points per step)
+--     Omega = h/2 (K1+K2) + sqrt(3)/12 h^2 [K1,K2]
+-- whose exponential is closed form since Omega is 2x2 and traceless.
+-- Steps are chosen by step doubling to keep the error in the product
+-- within GRADED_TOL over the layer.  A step is also limited to one e-fold
+-- of growth or decay, so the decaying wave is not lost next to the growing
+-- one, and is refused if n at its two ends is off the line through the
+-- Gauss points by different amounts (a kink, e.g. where the free carrier k
+-- saturates, that the samples of the step did not see).  After GRADED_STEPS
+-- refinements the rest of the layer is taken in steps limited only by the
+-- e-fold rule, so the loop always ends.  The product F is then written in
+-- the [E+,E-] basis of the entry and exit media, W0^-1 F Wd with
+-- W = [1 1; p -p], the same change of basis CalcInterface makes (TM
+-- carries an extra cos(exit)/cos(entry)).  For constant n this is CalcGap.
+--
+-- Usage: static void GradedGap(POLARIZATION pol[], int npol, double S, double lambda, TFOC_LAYER *lay, M_ARRAY Cg[]);
+--
+-- Inputs: pol, npol - polarizations wanted
+--         S         - Snell constant n sin(theta)
+--         lambda    - wavelength (nm)
+--         lay       - the graded layer (n at its front, lay->graded profile)
+--
+-- Output: Cg[ipol] - matrix following the interface into lay->n.  The
+--                    next interface starts from ExitIndex(lay).
+=========================================================================== */
+#define	GRADED_TOL		(1E-8)							/* Error allowed in the layer matrix */
+#define	GRADED_STEPS	(4096)							/* Give up refining after this many */
+#define	GAUSS_OFFSET	(0.28867513459481287)		/* Gauss points at 1/2 -+ sqrt(3)/6 */
+
+static COMPLEX ExitIndex(TFOC_LAYER *lay) {
+	return (lay->graded == NULL) ? lay->n : GradedN(lay, 1.0);
+}
+
+static COMPLEX GradedN(TFOC_LAYER *lay, double u) {
+	return CADD(lay->n, lay->graded->dn(lay->graded, u));
+}
+
+/* exp(Omega) for the step [u,u+h] of the layer (u,h fractions of its thickness) */
+static void MagnusStep(POLARIZATION pol[], int npol, double S, double k0, TFOC_LAYER *lay, double u, double h, M_ARRAY F[]) {
+	static double gauss[2] = {0.5-GAUSS_OFFSET, 0.5+GAUSS_OFFSET};
+	COMPLEX n[2], cs[2], ib[2], p, ag[2], bg[2], x, y, w, s2, s4, s, ep, em, ch, sh;
+	double dz;
+	int ig, ipol;
+
+	dz = h*lay->z;
+	for (ig=0; ig<2; ig++) {
+		n[ig]  = GradedN(lay, u+gauss[ig]*h);
+		cs[ig] = CosTheta(S, n[ig]);
+		x = CDIV(n[ig], cs[ig]);
+		ib[ig].x = -k0*x.y; ib[ig].y = k0*x.x;								/* i beta */
+	}
+	for (ipol=0; ipol<npol; ipol++) {
+		for (ig=0; ig<2; ig++) {
+			p = (pol[ipol] == TE) ? CMUL(n[ig], cs[ig]) : CDIV(n[ig], cs[ig]);
+			ag[ig] = CDIV(ib[ig], p);
+			bg[ig] = CMUL(ib[ig], p);
+		}
+		y = CADD(ag[0], ag[1]); y.x *= dz/2; y.y *= dz/2;
+		w = CADD(bg[0], bg[1]); w.x *= dz/2; w.y *= dz/2;
+		x = CSUB(CMUL(ag[0], bg[1]), CMUL(ag[1], bg[0]));
+		x.x *= 0.14433756729740643*dz*dz; x.y *= 0.14433756729740643*dz*dz;	/* sqrt(3)/12 */
+
+		s2 = CADD(CMUL(x, x), CMUL(y, w));										/* Omega^2 = s^2 I */
+		if (CABS(s2) < 1E-6) {														/* Series, even in s */
+			s4 = CMUL(s2, s2);
+			ch.x = 1 + s2.x/2 + s4.x/24;  ch.y = s2.y/2 + s4.y/24;
+			sh.x = 1 + s2.x/6 + s4.x/120; sh.y = s2.y/6 + s4.y/120;
+		} else {
+			s  = CCSQRT(s2);
+			ep = CEXP(s);
+			s.x = -s.x; s.y = -s.y; em = CEXP(s); s.x = -s.x; s.y = -s.y;
+			ch = CADD(ep, em); ch.x /= 2; ch.y /= 2;
+			sh = CSUB(ep, em); sh.x /= 2; sh.y /= 2;
+			sh = CDIV(sh, s);														/* sinh(s)/s */
+		}
+		F[ipol].A = CADD(ch, CMUL(sh, x));
+		F[ipol].D = CSUB(ch, CMUL(sh, x));
+		F[ipol].B = CMUL(sh, y);
+		F[ipol].C = CMUL(sh, w);
+	}
+	return;
+}
+
+static void GradedGap(POLARIZATION pol[], int npol, double S, double lambda, TFOC_LAYER *lay, M_ARRAY Cg[]) {
+	M_ARRAY F[2], E1[2], E2[2], Eh[2], T;
+	COMPLEX n0, nd, c0, cd, p0, pd, scale;
+	COMPLEX na, nb, n1, n2, mid, half, ea, eb;
+	double k0, u, h, err, e, big, grow, decay, off;
+	int ipol, nstep;
+
+	k0 = 2*pi/lambda;
+	for (ipol=0; ipol<npol; ipol++) F[ipol] = IDENTITY_MATRIX();
+
+	for (u=0.0,h=1.0,nstep=0; u < 1.0; ) {
+		if (h > 1.0-u) h = 1.0-u;
+		na = GradedN(lay, u);
+		nb = GradedN(lay, u+h);
+		decay = fabs(CDIV(na, CosTheta(S, na)).y);
+		e     = fabs(CDIV(nb, CosTheta(S, nb)).y);
+		if (e > decay) decay = e;
+		if (decay*k0*lay->z*h > 1.0) {											/* One e-fold at most */
+			h = 1.0/(decay*k0*lay->z);
+			continue;
+		}
+
+/* Line through the Gauss points misses both ends alike if n is smooth */
+		n1 = GradedN(lay, u+(0.5-GAUSS_OFFSET)*h);
+		n2 = GradedN(lay, u+(0.5+GAUSS_OFFSET)*h);
+		mid  = CADD(n1, n2); mid.x /= 2; mid.y /= 2;
+		half = CSUB(n2, n1); half.x *= 0.25/GAUSS_OFFSET; half.y *= 0.25/GAUSS_OFFSET;
+		ea = CSUB(na, CSUB(mid, half));
+		eb = CSUB(nb, CADD(mid, half));
+		off = CABS(CSUB(ea, eb));
+		if (off > 0.25*CABS(CADD(ea, eb)) && k0*lay->z*off > GRADED_TOL && ++nstep < GRADED_STEPS) {
+			h /= 2;
+			continue;
+		}
+		MagnusStep(pol, npol, S, k0, lay, u,     h,   E1);
+		MagnusStep(pol, npol, S, k0, lay, u,     h/2, E2);
+		MagnusStep(pol, npol, S, k0, lay, u+h/2, h/2, Eh);
+		err = 0;
+		for (ipol=0; ipol<npol; ipol++) {
+			E2[ipol] = MATMUL(&E2[ipol], &Eh[ipol]);
+			big = CABS(E2[ipol].A);
+			if (CABS(E2[ipol].B) > big) big = CABS(E2[ipol].B);
+			if (CABS(E2[ipol].C) > big) big = CABS(E2[ipol].C);
+			if (CABS(E2[ipol].D) > big) big = CABS(E2[ipol].D);
+			e = CABS(CSUB(E1[ipol].A, E2[ipol].A));
+			if (CABS(CSUB(E1[ipol].B, E2[ipol].B)) > e) e = CABS(CSUB(E1[ipol].B, E2[ipol].B));
+			if (CABS(CSUB(E1[ipol].C, E2[ipol].C)) > e) e = CABS(CSUB(E1[ipol].C, E2[ipol].C));
+			if (CABS(CSUB(E1[ipol].D, E2[ipol].D)) > e) e = CABS(CSUB(E1[ipol].D, E2[ipol].D));
+			e /= 15*big;																/* Error of E2 (Richardson) */
+			if (e > err) err = e;
+		}
+		grow = (err > 0) ? 0.9*pow(GRADED_TOL*h/err, 0.25) : 4.0;
+		if (err <= GRADED_TOL*h || ++nstep >= GRADED_STEPS) {		/* Accept the halved steps */
+			for (ipol=0; ipol<npol; ipol++) F[ipol] = MATMUL(&F[ipol], &E2[ipol]);
+			u += h;
+		}
+		if (nstep >= GRADED_STEPS) {
+			h = 1.0-u;																	/* Out of refinements - finish (e-folds only) */
+		} else {
+			h *= (grow > 4.0) ? 4.0 : (grow < 0.2) ? 0.2 : grow;
+		}
+	}
+
+/* To the wave basis of the entry and exit media */
+	n0 = lay->n;        c0 = CosTheta(S, n0);
+	nd = ExitIndex(lay); cd = CosTheta(S, nd);
+	for (ipol=0; ipol<npol; ipol++) {
+		p0 = (pol[ipol] == TE) ? CMUL(n0, c0) : CDIV(n0, c0);
+		pd = (pol[ipol] == TE) ? CMUL(nd, cd) : CDIV(nd, cd);
+		T.A = CADD(F[ipol].A, CMUL(F[ipol].B, pd));						/* F Wd */
+		T.B = CSUB(F[ipol].A, CMUL(F[ipol].B, pd));
+		T.C = CADD(F[ipol].C, CMUL(F[ipol].D, pd));
+		T.D = CSUB(F[ipol].C, CMUL(F[ipol].D, pd));
+		scale.x = 0.5; scale.y = 0;													/* 1/(2 p0), times cd/c0 for TM */
+		scale = (pol[ipol] == TE) ? CDIV(scale, p0) : CDIV(CMUL(scale, cd), CMUL(p0, c0));
+		Cg[ipol].A = CMUL(CADD(CMUL(p0, T.A), T.C), scale);
+		Cg[ipol].B = CMUL(CADD(CMUL(p0, T.B), T.D), scale);
+		Cg[ipol].C = CMUL(CSUB(CMUL(p0, T.A), T.C), scale);
+		Cg[ipol].D = CMUL(CSUB(CMUL(p0, T.B), T.D), scale);
+	}
+	return;
+}
+
+
 /* ===========================================================================
 -- Routine to return the matrix for an interface from i to j
 --
--- Inputs: S - Snell constant of motion - n*sin(theta)
---         mode - TE or TM mode (s or p)
+-- Inputs: mode - TE or TM mode (s or p)
+--         ni, nj - complex index on either side of the interface
+--         cos_theta_i, cos_theta_j - cosine of angles (from CosTheta)
 =========================================================================== */
-static M_ARRAY CalcInterface(double S, POLARIZATION mode, COMPLEX ni, COMPLEX nj) {
+static M_ARRAY CalcInterface(POLARIZATION mode, COMPLEX ni, COMPLEX cos_theta_i, COMPLEX nj, COMPLEX cos_theta_j) {
 
 	M_ARRAY Cij;
 	COMPLEX rij, tij, one={1.0, 0.0};
 
-	CalcFresnel(S, mode, ni, nj, &rij, &tij);
+	CalcFresnel(mode, ni, cos_theta_i, nj, cos_theta_j, &rij, &tij);
 
 	Cij.A = Cij.D = CDIV(one, tij);
 	Cij.B = Cij.C = CDIV(rij, tij);
@@ -272,23 +1688,17 @@ static M_ARRAY CalcInterface(double S, POLARIZATION mode, COMPLEX ni, COMPLEX nj
 /* ===========================================================================
 -- Routine to calculate the r,t Fresnel coefficient for an interface.
 --
--- Inputs: S - Snell constant of motion - n*sin(theta)
---         mode - TE or TM mode (s or p)
+-- Inputs: mode - TE or TM mode (s or p)
+--         ni, nj - complex index on either side of the interface
+--         cos_theta_i, cos_theta_j - cosine of angles (from CosTheta)
 =========================================================================== */
-static BOOL CalcFresnel(double S, POLARIZATION mode, COMPLEX ni, COMPLEX nj, COMPLEX *rij, COMPLEX *tij) {
+static BOOL CalcFresnel(POLARIZATION mode, COMPLEX ni, COMPLEX cos_theta_i, COMPLEX nj, COMPLEX cos_theta_j, COMPLEX *rij, COMPLEX *tij) {
 	
 	COMPLEX a,b;
-	COMPLEX cos_theta_i, cos_theta_j;				/* cosine of angles			*/
 
-#if 0																		/* How should k value be handled??? */
-	cos_theta_i = CSQRT(1.0-pow(S/ni.x,2));					/* If < 0 evanescent */
-	cos_theta_j = CSQRT(1.0-pow(S/nj.x,2));					/* If < 0 evanescent */
-#endif
-	cos_theta_i = CSQRT(1.0-S*S/(ni.x*ni.x+ni.y*ni.y));	/* If < 0 evanescent */
-	cos_theta_j = CSQRT(1.0-S*S/(nj.x*nj.x+nj.y*nj.y));	/* If < 0 evanescent */
-	if (TFOC_Debug_Flag & DEBUG_FRESNEL) {
+	if (TFOC_DEBUG(DEBUG_FRESNEL)) {
 		printf("Calculating Fresnel reflectance and transmission coefficients\n");
-		printf("  S: %g\tmode: %d\tni: %g%+gi\tnj: %g%+gi\n", S, mode, ni.x, ni.y, nj.x, nj.y);
+		printf("  mode: %d\tni: %g%+gi\tnj: %g%+gi\n", mode, ni.x, ni.y, nj.x, nj.y);
 		printf("  cos_theta_i: %g%+gi\tcos_theta_j: %g%+gi\n", cos_theta_i.x, cos_theta_i.y, cos_theta_j.x, cos_theta_j.y);
 	}
 
@@ -306,7 +1716,7 @@ static BOOL CalcFresnel(double S, POLARIZATION mode, COMPLEX ni, COMPLEX nj, COM
 		*tij = CDIV(a,b);												/* Transmission coefficient */
 	}
 
-	if (TFOC_Debug_Flag & DEBUG_FRESNEL) {
+	if (TFOC_DEBUG(DEBUG_FRESNEL)) {
 		printf("  rij: %g%+gi\ttij: %g%+gi\n\n", rij->x, rij->y, tij->x, tij->y);
 	}
 
@@ -330,87 +1740,21 @@ static M_ARRAY MATINV(M_ARRAY *a) {
 }
 #endif
 
-static M_ARRAY IDENTITY_MATRIX(void) {
+/* a^n by repeated squaring (n >= 0) */
+static M_ARRAY MATPOW(M_ARRAY *a, int n) {
 
-	M_ARRAY ab;
+	M_ARRAY ab, sq;
 
-	memset(&ab, 0, sizeof(ab));
-	ab.A.x = ab.D.x = 1.0;
-
-	return ab;
-}
-
-
-static M_ARRAY MATMUL(M_ARRAY *a, M_ARRAY *b) {
-
-	M_ARRAY ab;
-
-	ab.A = CADD(CMUL(a->A,b->A),CMUL(a->B,b->C));
-	ab.B = CADD(CMUL(a->A,b->B),CMUL(a->B,b->D));
-	ab.C = CADD(CMUL(a->C,b->A),CMUL(a->D,b->C));
-	ab.D = CADD(CMUL(a->C,b->B),CMUL(a->D,b->D));
+	ab = IDENTITY_MATRIX();
+	sq = *a;
+	while (n > 0) {
+		if (n & 1) ab = MATMUL(&ab, &sq);
+		if ( (n >>= 1) > 0) sq = MATMUL(&sq, &sq);
+	}
 	return ab;
 }
 
 
-COMPLEX CADD(COMPLEX a, COMPLEX b) {
-	COMPLEX result;
-	result.x = a.x+b.x;
-	result.y = a.y+b.y;
-	return result;
-}
-	
-COMPLEX CSUB(COMPLEX a, COMPLEX b) {
-	COMPLEX result;
-	result.x = a.x-b.x;
-	result.y = a.y-b.y;
-	return result;
-}
-	
-COMPLEX CMUL(COMPLEX a, COMPLEX b) {
-	COMPLEX result;
-	result.x = a.x*b.x - a.y*b.y;
-	result.y = a.x*b.y + a.y*b.x;
-	return result;
-}
-
-COMPLEX CDIV(COMPLEX a, COMPLEX b) {
-	COMPLEX result;
-	TMPREAL magn;
-	magn = b.x*b.x+b.y*b.y;
-	result.x =  ( a.x*b.x + a.y*b.y) / magn ;
-	result.y =  (-a.x*b.y + a.y*b.x) / magn ;
-	return result;
-}
-
-double CABS(COMPLEX a) {
-	return sqrt(a.x*a.x+a.y*a.y);
-}
-
-COMPLEX CSQRT(double r) {
-	COMPLEX c;
-	c.x = (r>0) ? sqrt(r)  : 0;
-	c.y = (r<0) ? sqrt(-r) : 0;
-
-	if (TFOC_Debug_Flag & DEBUG_COMPLEX_MATH) printf("CSQRT: %g %g %g\n", r, c.x, c.y);
-
-	return c;
-}
-
-COMPLEX CCSQRT(COMPLEX r) {
-	COMPLEX c;
-	double r0,theta;
-	if (r.y == 0) r.y = 0;
-	r0 = sqrt(r.x*r.x+r.y*r.y);
-	theta = atan2(r.y, r.x);
-	c.x = sqrt(r0)*cos(theta/2);
-	c.y = sqrt(r0)*sin(theta/2);
-
-	if (TFOC_Debug_Flag & DEBUG_COMPLEX_MATH) printf("CSQRT: %g %g = %g %g\n", r.x, r.y, c.x, c.y);
-
-	return c;
-}
-
 COMPLEX CPOW(COMPLEX r, double n) {
 	COMPLEX c;
 	double r0,theta;
@@ -420,7 +1764,7 @@ COMPLEX CPOW(COMPLEX r, double n) {
 	c.x = pow(r0,n)*cos(theta*n);
 	c.y = pow(r0,n)*sin(theta*n);
 
-	if (TFOC_Debug_Flag & DEBUG_COMPLEX_MATH) printf("CPOW: (%g %g)^%f = %g %g   %g %g\n", r.x, r.y, n, c.x, c.y, r0, theta);
+	if (TFOC_DEBUG(DEBUG_COMPLEX_MATH)) printf("CPOW: (%g %g)^%f = %g %g   %g %g\n", r.x, r.y, n, c.x, c.y, r0, theta);
 
 	return c;
 }
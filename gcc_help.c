@@ -267,5 +267,5 @@ int fopen_s(FILE **pFile, const char *filename, const char *mode) {
 	if (pFile == NULL || filename == NULL || mode == NULL) return EINVAL;
 
 	*pFile = fopen(filename, mode);
-	return errno;
+	return (*pFile == NULL) ? errno : 0;				/* errno is only meaningful on failure */
 }
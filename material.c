@@ -12,6 +12,20 @@
 #include <math.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+	#include <windows.h>
+	#include <io.h>
+	#include <process.h>
+#else
+	#include <unistd.h>
+	#include <dirent.h>
+	#include <pthread.h>
+	#include <sys/mman.h>
+#endif
 
 /* ------------------------------ */
 /* Local include files            */
@@ -29,31 +43,165 @@
 	#define	PATH_MAX	(260)
 #endif
 
+/* File names compare as the file system does - ignoring case only on Windows */
+#ifdef _WIN32
+	#define	FileNameCmp		_stricmp
+#else
+	#define	FileNameCmp		strcmp
+#endif
+
+/* ---------------------------------------------------------------------------
+-- A mixture tree is compiled into a flat program over its unique nodes in
+-- dependency order: each leaf material once, then each (sub-)mixture once
+-- from the slots of its components.  The last op is the mixture itself.
+--------------------------------------------------------------------------- */
+typedef struct _EMA_OP {
+	TFOC_MATERIAL *leaf;							/* Non-null ==> slot is n,k of this material */
+	EMA_MODEL model;
+	int nterms;
+	int arg[MAX_MIX_TERMS];						/* Slots of the components */
+	double fraction[MAX_MIX_TERMS];
+	COMPLEX warm;									/* Last Bruggeman solution (epsilon), 0 if none */
+} EMA_OP;
+
+typedef struct _EMA_PROGRAM {
+	int nops;
+	EMA_OP *op;
+} EMA_PROGRAM;
+
+#define	EMA_SLOTS_STACK	(64)					/* Programs up to this size need no malloc */
+
 struct _TFOC_MATERIAL_MIX {
 	EMA_MODEL EMA_Model;							/* What model for effective medium approximation */
 	double fraction[MAX_MIX_TERMS];
 	TFOC_MATERIAL *material[MAX_MIX_TERMS];
+	EMA_PROGRAM program;							/* Flattened tree */
 };
 
+/* ---------------------------------------------------------------------------
+-- Temperature dependent material: n,k(E,T) from ordinary materials (slices)
+-- at a set of temperatures.  The T interpolation is a cubic spline, which is
+-- linear in the slice values, so it is done with the cardinal splines
+-- (1 at T[j], 0 at the others) fit once at load.  For a given T the weights
+-- are kept in a small cache, and the slice values in another keyed on the
+-- wavelength (and T, if a slice itself depends on it), so each (lambda,T)
+-- point is just a weighted sum.
+--------------------------------------------------------------------------- */
+#define	THERMAL_MAX_T		(32)						/* Slices per material */
+#define	THERMAL_CACHE		(8)						/* Temperatures with cached weights */
+#define	THERMAL_NEST_MAX	(16)						/* Tables being resolved at once */
+
+typedef struct _TFOC_THERMAL {
+	int nt;
+	double T[THERMAL_MAX_T];						/* Slice temperatures (K) */
+	char *name[THERMAL_MAX_T];						/* Slice names until resolved */
+	TFOC_MATERIAL *slice[THERMAL_MAX_T];
+	void *weight[THERMAL_MAX_T];					/* Cardinal splines (nt >= 3) */
+	BOOL slice_T;										/* Some slice depends on T itself */
+	double lambda, nk_T;								/* Wavelength (and T) of nk[] (0 = none) */
+	COMPLEX nk[THERMAL_MAX_T];						/* Slice values at lambda */
+	struct {
+		double T;
+		double w[THERMAL_MAX_T];
+	} cache[THERMAL_CACHE];
+	int ncache, next;
+} TFOC_THERMAL;
+
+/* ---------------------------------------------------------------------------
+-- Optional uniform-grid copy of a tabulated material (TFOC_SetLookupGrid).
+-- The spline is resampled at load onto equal energy cells from the first
+-- knot to the next to last (the spline is constant past it); each cell holds
+-- the cubics for n and k in the local coordinate t = 0..1.  A lookup is an
+-- index computation and two polynomials with no search.
+--------------------------------------------------------------------------- */
+#define	GRID_MIN_CELLS		(64)
+#define	GRID_MAX_CELLS		(65536)				/* Give up (keep the spline) beyond this */
+
+typedef struct _NK_GRID {
+	double x0, xhi;									/* Energy range covered (eV) */
+	double inv_h;										/* Cells per eV */
+	int ncell;
+	double *cf;											/* 8 per cell: n a0..a3, k a0..a3 */
+} NK_GRID;
+
 struct _TFOC_MATERIAL {
 	char name[MATERIAL_NAME_LENGTH];			/* Material name		*/
 	void *n_spline, *k_spline;					/* Spline structures	*/
+	int npt;											/* Knots in each (same energies) */
+	int cursor;										/* Interval of the last lookup */
+	NK_GRID *grid;									/* Non-null ==> evaluate from the uniform grid */
 	TFOC_MATERIAL_MIX *mixed;					/* Non-null ==> mixed phase w/ effective medium */
+	TFOC_DISPERSION *model;						/* Non-null ==> analytic dispersion model */
+	TFOC_THERMAL *thermal;						/* Non-null ==> n,k(E,T) from slices */
+	unsigned int hash;							/* Hash of the name (case-insensitive) */
+	struct _TFOC_MATERIAL *hash_next;		/* Next entry in the same bucket */
 };
 
+/* ---------------------------------------------------------------------------
+-- Materials live in fixed size slabs that are never reallocated, so the
+-- TFOC_MATERIAL pointers handed out (sample rows, mixture components) stay
+-- valid for the life of the program.  A chained hash table over the names
+-- gives the lookup; growing it only relinks the chains.
+--------------------------------------------------------------------------- */
+#define	MATERIAL_SLAB_SIZE	(64)					/* Records per slab */
+#define	MATERIAL_HASH_INIT	(64)					/* Initial buckets (power of 2) */
+
+typedef struct _DB_INDEX_ENTRY {
+	char *name;										/* File name as found in the directory */
+	double size;									/* Bytes */
+	time_t mtime;									/* Last modification */
+} DB_INDEX_ENTRY;
+
+typedef struct _DB_INDEX {
+	char database[PATH_MAX];					/* Directory indexed */
+	int count;
+	DB_INDEX_ENTRY *entry;						/* Sorted by name (FileNameCmp) */
+} DB_INDEX;
+
+typedef struct _MATERIAL_SLAB {
+	struct _MATERIAL_SLAB *next;
+	int used;
+	TFOC_MATERIAL rec[MATERIAL_SLAB_SIZE];
+} MATERIAL_SLAB;
+
 /* ------------------------------- */
 /* My external function prototypes */
 /* ------------------------------- */
 TFOC_MATERIAL *TFOC_FindMaterial(char *name, char *database);
+char *TFOC_ReadLine(FILE *funit, char **buf, size_t *len);
 COMPLEX TFOC_FindNK(TFOC_MATERIAL *material, double lambda);
+COMPLEX TFOC_FindNKT(TFOC_MATERIAL *material, double lambda, double T);
+void TFOC_FindNKBatch(TFOC_MATERIAL *material, int npt, double lambda[], double T, COMPLEX nk[]);
+BOOL TFOC_HasTemperature(TFOC_MATERIAL *material);
 void TFOC_PrintMaterials(void);
+int TFOC_CompileDatabase(char *database);
+int TFOC_PrefetchMaterials(TFOC_SAMPLE *sample, char *database);
+void TFOC_SetDecimation(double tolerance);
+void TFOC_SetLookupGrid(double tolerance);
 
 /* ------------------------------- */
 /* My internal function prototypes */
 /* ------------------------------- */
-static TFOC_MATERIAL *materials=NULL;
-static int num_materials=0;
-static int dim_materials=0;
+static DB_INDEX *IndexDatabase(char *database);
+static DB_INDEX_ENTRY *FindIndex(DB_INDEX *index, char *name);
+static void DatabaseFilename(char *filename, size_t len, char *database, char *name);
+static int LoadNKFile(char *filename, TFOC_MATERIAL *rec, int *npt);
+static int Decimate(double *ev, double *n, double *k, int npt, double tol);
+static TFOC_THERMAL *ParseThermal(FILE *funit, char *header);
+static BOOL ResolveThermal(TFOC_MATERIAL *rec, char *database);
+static COMPLEX ThermalNK(TFOC_THERMAL *thermal, double lambda, double T);
+static COMPLEX BaseNK(TFOC_MATERIAL *material, double lambda, double T);
+static int CompileNode(EMA_PROGRAM *program, TFOC_MATERIAL **node, TFOC_MATERIAL *material, TFOC_MATERIAL_MIX *mixed);
+static void CompileMixture(TFOC_MATERIAL_MIX *mixed);
+static COMPLEX MixEMA(EMA_MODEL model, int nterms, double *fraction, COMPLEX *ni, COMPLEX *warm);
+static COMPLEX Bruggeman(int nterms, double *fraction, COMPLEX *ei, COMPLEX start, BOOL *ok);
+static BOOL FindCompiled(char *database, char *name, void **n_spline, void **k_spline, int *npt);
+static void *MapCompiled(char *fname, size_t *size);
+static unsigned int HashName(char *name);
+static TFOC_MATERIAL *LookupMaterial(char *name, unsigned int hash);
+static TFOC_MATERIAL *AddMaterial(TFOC_MATERIAL *rec);
+static NK_GRID *MakeGrid(TFOC_MATERIAL *rec);
+static COMPLEX GridNK(NK_GRID *grid, double E);
 
 /* ------------------------------- */
 /* My usage of other external fncs */
@@ -62,6 +210,12 @@ static int dim_materials=0;
 /* ------------------------------- */
 /* Locally defined global vars     */
 /* ------------------------------- */
+static MATERIAL_SLAB *slab_first=NULL, *slab_last=NULL;	/* Arena of material records */
+static TFOC_MATERIAL **hash_table=NULL;						/* Buckets of the name index */
+static unsigned int hash_size=0;									/* Number of buckets			*/
+static int num_materials=0;
+static double decimate_tol=0;											/* Thin tables to this n,k error */
+static double grid_tol=0;												/* Resample to a grid within this error */
 
 
 /* ===========================================================================
@@ -139,38 +293,30 @@ int TFOC_GetMaterialName(char *str, char *name, size_t namelen, char **endptr) {
 -- Return: Pointer to the material database structure for specified name.
 --         On error, return is NULL.
 =========================================================================== */
-#define	NPT_MAX	16384
 TFOC_MATERIAL *TFOC_FindMaterial(char *name, char *database) {
 
-	int i, rc;
-	double ev[NPT_MAX], n[NPT_MAX], k[NPT_MAX];
-	int npt=0;
-	char filename[PATH_MAX],line[256],*aptr;
-	FILE *funit;
-	TFOC_MATERIAL *now;
+	int rc, npt;
+	char filename[PATH_MAX],*aptr;
+	TFOC_MATERIAL rec, *now;
+	unsigned int hash;
 
 /* See if it already exists */
 	while (isspace(*name)) name++;
-	for (i=0; i<num_materials; i++) {
-		if (_stricmp(name, materials[i].name) == 0) return materials+i;
-	}
-
-/* ----- Make sure there will be space in the sample structure for this entry */
-	if (num_materials >= dim_materials) {
-		dim_materials += 10;
-		materials = realloc(materials, dim_materials*sizeof(*materials));
-	}
-	now = materials + num_materials;
-	num_materials++;
+	hash = HashName(name);
+	if ( (now = LookupMaterial(name, hash)) != NULL) return now;
 
-	memset(now, 0, sizeof(*materials));					/* Zero out the entry */
+/* Build the entry locally; only added to the list once fully loaded */
+	now = &rec;
+	memset(now, 0, sizeof(*now));							/* Zero out the entry */
 	strncpy_s(now->name, sizeof(now->name), name, sizeof(now->name));
+	now->hash = hash;
 
 /* ---------------------------------------------------------------------------
 -- Okay, not there.  Try to add instead.  Two options.  First is it is
 -- a simple name that we look for in the "database" subdirectory.
 -- Second is that it begins with a [ and indicates a mixed layer which
--- will be calculated via an effective medium approximation
+-- will be calculated via an effective medium approximation, or an
+-- inline dispersion model
 --------------------------------------------------------------------------- */
 	if (*name == '[') {					/* okay - manage as a mixture */
 		int rc,i,imix;
@@ -183,6 +329,11 @@ TFOC_MATERIAL *TFOC_FindMaterial(char *name, char *database) {
 		if (*aptr == ']') *(aptr--) = '\0';
 		while (isspace(*aptr) && aptr >= myname) *(aptr--) = '\0';
 
+		if (TFOC_IsDispersion(myname)) {					/* Inline model, [ cauchy 1.45 0.0036 ] */
+			if ( (now->model = TFOC_ParseDispersion(myname)) == NULL) return NULL;
+			return AddMaterial(now);
+		}
+
 		now->mixed = calloc(1, sizeof(TFOC_MATERIAL_MIX));
 		now->mixed->EMA_Model = SERIES;
 		imix = 0;							/* Working on first entry */
@@ -221,10 +372,10 @@ TFOC_MATERIAL *TFOC_FindMaterial(char *name, char *database) {
 		if (rc != 0 || imix == 0 || fsum == 0) {	/* Nothing or totally invalid */
 			fprintf(stderr, "ERROR: Parsing mixed-phase material: %s\n", now->name);
 			free(now->mixed);
-			num_materials--;
 			return NULL;
 		}
 		for (i=0; i<imix; i++) now->mixed->fraction[i] /= fsum;
+		CompileMixture(now->mixed);
 		
 /* ---------------------------------------------------------------------------
 -- Not a mixture.  So just look for a datafile (either in the "database"
@@ -233,46 +384,1129 @@ TFOC_MATERIAL *TFOC_FindMaterial(char *name, char *database) {
 -- fit, and the spline coefficient list maintained.
 --------------------------------------------------------------------------- */
 	} else {
-		strcpy_s(filename, sizeof(filename), database);				/* Start creating name */
-		if (*filename != '\0') {					/* If not blank */
-			aptr = filename + strlen(filename)-1;
-			if (*aptr != '/' && *aptr != '\\') strcat_s(filename, sizeof(filename), "/");
-		}
-		strcat_s(filename, sizeof(filename), name);
-		if ( (rc = fopen_s(&funit, filename, "r")) != 0) {
-			fprintf(stderr, "ERROR: Unable to open \"%s\" for material \"%s\" in the directory \"%s\" (rc=%d)\n", filename, name, database, rc);
-			num_materials--;
-			return NULL;
-		}
+		if (FindCompiled(database, name, &now->n_spline, &now->k_spline, &now->npt)) return AddMaterial(now);
 
-/* Read in all of the existing data */
-		while (npt < NPT_MAX && fgets(line, sizeof(line), funit) != NULL) {
-			while ( (aptr = strchr(line, '\n')) != NULL) *aptr = '\0';
-			aptr = line;
-			while (isspace(*aptr)) aptr++;
-			if (*aptr == '\0' || *aptr == '#') continue;			/* Comment */
-			if (strncmp(aptr, "/*", 2) == 0) continue;			/* Another comment */
-			ev[npt] = strtod(aptr, &aptr); 
-			if (ev[npt] <= 0) continue;								/* Ignore bad lines */
-			while (*aptr == ',' || isspace(*aptr)) aptr++;		/* Allows .csv which replace white space with , */
-			n[npt]  = strtod(aptr, &aptr); 
-			while (*aptr == ',' || isspace(*aptr)) aptr++;		/* Allows .csv which replace white space with , */
-			k[npt]  = fabs(strtod(aptr, &aptr));					/* Force to be positive */
-			npt++;
-		}
-		fclose(funit);
-
-/* Fit the spline and fill in the entry */
-		now->n_spline = GVFitSpline(NULL, ev, n, npt, 0);
-		now->k_spline = GVFitSpline(NULL, ev, k, npt, 0);
-
-		if (now->n_spline == NULL || now->k_spline == NULL) {
-			free(now->n_spline); free(now->k_spline);
-			num_materials--;
+		DatabaseFilename(filename, sizeof(filename), database, name);
+		if ( (rc = LoadNKFile(filename, now, &npt)) != 0) {
+			if (rc > 0) fprintf(stderr, "ERROR: Unable to open \"%s\" for material \"%s\" in the directory \"%s\" (rc=%d)\n", filename, name, database, rc);
 			return NULL;
 		}
+		if (now->thermal != NULL && ! ResolveThermal(now, database)) return NULL;
 	}
 	
+	return AddMaterial(now);
+}
+
+/* ===========================================================================
+-- Build the full filename of an entry in the database directory
+=========================================================================== */
+static void DatabaseFilename(char *filename, size_t len, char *database, char *name) {
+	char *aptr;
+
+	strcpy_s(filename, len, database);								/* Start creating name */
+	if (*filename != '\0') {											/* If not blank */
+		aptr = filename + strlen(filename)-1;
+		if (*aptr != '/' && *aptr != '\\') strcat_s(filename, len, "/");
+	}
+	strcat_s(filename, len, name);
+	return;
+}
+
+/* ===========================================================================
+-- Read the ev,n,k columns of a database file and spline fit n and k.
+-- A file whose first data line is a dispersion model ("model cauchy ...")
+-- is returned as the parsed model instead, with no splines, and one that
+-- starts with "temperature" as the (unresolved) table of slices.
+--
+-- Usage: int LoadNKFile(char *filename, TFOC_MATERIAL *rec, int *npt);
+--
+-- Output: rec->n_spline, k_spline - malloc'd spline tables (npt elements)
+--         rec->model              - analytic model, or NULL
+--         rec->thermal            - temperature table, or NULL
+--         *npt                    - number of data points
+--
+-- Return: 0 on success, errno value if the file can't be opened, or -1 if
+--         the contents can't be fit
+=========================================================================== */
+static int LoadNKFile(char *filename, TFOC_MATERIAL *rec, int *npt) {
+
+	double *ev=NULL, *n=NULL, *k=NULL;
+	char *line=NULL, *aptr;
+	size_t linelen=0;
+	int dim=0, ngood;
+	FILE *funit;
+	int rc;
+
+	*npt = 0;
+	rec->n_spline = rec->k_spline = NULL;
+	rec->model    = NULL;
+	rec->thermal  = NULL;
+	if ( (rc = fopen_s(&funit, filename, "r")) != 0) return rc;
+
+/* Read in all of the existing data, growing the arrays as needed */
+	rc = 0;
+	while (TFOC_ReadLine(funit, &line, &linelen) != NULL) {
+		aptr = line;
+		while (isspace(*aptr)) aptr++;
+		if (*aptr == '\0' || *aptr == '#') continue;				/* Comment */
+		if (strncmp(aptr, "/*", 2) == 0) continue;				/* Another comment */
+		if (*npt == 0 && TFOC_IsDispersion(aptr)) {				/* Parametric, not a table */
+			rc = ( (rec->model = TFOC_ParseDispersion(aptr)) != NULL) ? 0 : -1;
+			goto Done;
+		}
+		if (*npt == 0 && _strnicmp(aptr, "temperature", 11) == 0) {	/* Slices at several T */
+			rec->thermal = ParseThermal(funit, aptr+11);
+			rc = (rec->thermal != NULL) ? 0 : -1;
+			goto Done;
+		}
+		if (*npt >= dim) {
+			dim = (dim == 0) ? 1024 : 2*dim;
+			ev = realloc(ev, dim*sizeof(*ev));
+			n  = realloc(n,  dim*sizeof(*n));
+			k  = realloc(k,  dim*sizeof(*k));
+		}
+		ev[*npt] = strtod(aptr, &aptr); 
+		if (ev[*npt] <= 0) continue;									/* Ignore bad lines */
+		while (*aptr == ',' || isspace(*aptr)) aptr++;			/* Allows .csv which replace white space with , */
+		n[*npt]  = strtod(aptr, &aptr); 
+		while (*aptr == ',' || isspace(*aptr)) aptr++;			/* Allows .csv which replace white space with , */
+		k[*npt]  = fabs(strtod(aptr, &aptr));						/* Force to be positive */
+		(*npt)++;
+	}
+
+/* Thin to the tolerance if requested, then fit the spline */
+	ngood = *npt;
+	if (decimate_tol > 0 && *npt > 3) ngood = Decimate(ev, n, k, *npt, decimate_tol);
+	if (TFOC_DEBUG(DEBUG_DATABASE) && ngood != *npt) fprintf(stderr, "%s: %d points decimated to %d\n", filename, *npt, ngood);
+	*npt = ngood;
+
+	rec->n_spline = GVFitSpline(NULL, ev, n, *npt, 0);
+	rec->k_spline = GVFitSpline(NULL, ev, k, *npt, 0);
+	rec->npt = *npt;
+
+	if (rec->n_spline == NULL || rec->k_spline == NULL) {
+		free(rec->n_spline); free(rec->k_spline);
+		rec->n_spline = rec->k_spline = NULL;
+		rc = -1;
+	}
+
+Done:
+	fclose(funit);
+	free(line);
+	free(ev); free(n); free(k);
+	return rc;
+}
+
+/* ===========================================================================
+-- Read one line of any length into a growable buffer, dropping the newline
+--
+-- Usage: char *TFOC_ReadLine(FILE *funit, char **buf, size_t *len);
+--
+-- Inputs: funit - open file
+--         buf   - buffer from an earlier call, or NULL with *len == 0
+--         len   - its size
+--
+-- Output: *buf, *len - grown as needed; free(*buf) when done
+--
+-- Return: *buf, or NULL at end of file
+=========================================================================== */
+char *TFOC_ReadLine(FILE *funit, char **buf, size_t *len) {
+	size_t used;
+	char *aptr;
+
+	if (*len == 0) *buf = malloc(*len = 256);
+	used = 0;
+	while (fgets(*buf+used, (int) (*len-used), funit) != NULL) {
+		used += strlen(*buf+used);
+		if (used > 0 && (*buf)[used-1] == '\n') break;				/* Complete line */
+		if (used+1 < *len) break;										/* End of file without newline */
+		*buf = realloc(*buf, *len *= 2);
+	}
+	if (used == 0) return NULL;
+	while ( (aptr = strchr(*buf, '\n')) != NULL) *aptr = '\0';
+	if ( (aptr = strchr(*buf, '\r')) != NULL) *aptr = '\0';			/* DOS files */
+	return *buf;
+}
+
+/* ===========================================================================
+-- Thin ev,n,k data to the points needed to follow it within tol (in n and
+-- in k).  Douglas-Peucker gives the starting set: keep the end points, and
+-- recursively the point furthest from the chord whenever that is more than
+-- tol.  The chord says little about the cubic spline through the kept
+-- points (it overshoots near sharp features), so the spline is then fit to
+-- them and the worst dropped point between each pair of kept points is put
+-- back wherever it is off by more than tol, until every dropped point is
+-- within tol of the spline that will be used.  Data is first put in
+-- ascending energy.
+--
+-- Return: number of points kept (compacted to the front of the arrays)
+=========================================================================== */
+typedef struct _NK_POINT {
+	double ev, n, k;
+} NK_POINT;
+
+static int CompareNKPoint(const void *a, const void *b) {
+	double d = ((NK_POINT *) a)->ev - ((NK_POINT *) b)->ev;
+	return (d > 0) ? 1 : (d < 0) ? -1 : 0;
+}
+
+static int Decimate(double *ev, double *n, double *k, int npt, double tol) {
+
+	NK_POINT *pt;
+	char *keep;
+	int *stack, nstack, i, lo, hi, imax, nkeep, nadd, cursor;
+	double f, d, dmax, *x, *yn, *yk;
+	void *n_spline, *k_spline;
+
+/* Ascending energy (files are often written either way) */
+	pt = malloc(npt*sizeof(*pt));
+	for (i=0; i<npt; i++) { pt[i].ev = ev[i]; pt[i].n = n[i]; pt[i].k = k[i]; }
+	for (i=1; i<npt; i++) if (pt[i].ev < pt[i-1].ev) break;
+	if (i < npt) qsort(pt, npt, sizeof(*pt), CompareNKPoint);
+
+/* Explicit stack of [lo,hi] segments - recursion could be npt deep */
+	keep  = calloc(npt, sizeof(*keep));
+	stack = malloc(2*npt*sizeof(*stack));
+	keep[0] = keep[npt-1] = TRUE;
+	nstack = 0;
+	stack[nstack++] = 0; stack[nstack++] = npt-1;
+	while (nstack > 0) {
+		hi = stack[--nstack]; lo = stack[--nstack];
+		if (hi-lo < 2) continue;
+		dmax = 0; imax = lo;
+		for (i=lo+1; i<hi; i++) {
+			f = (pt[hi].ev > pt[lo].ev) ? (pt[i].ev-pt[lo].ev)/(pt[hi].ev-pt[lo].ev) : 0.5;
+			d = fabs(pt[i].n - (pt[lo].n + f*(pt[hi].n-pt[lo].n)));
+			if (d > dmax) { dmax = d; imax = i; }
+			d = fabs(pt[i].k - (pt[lo].k + f*(pt[hi].k-pt[lo].k)));
+			if (d > dmax) { dmax = d; imax = i; }
+		}
+		if (dmax <= tol) continue;
+		keep[imax] = TRUE;
+		stack[nstack++] = lo;   stack[nstack++] = imax;
+		stack[nstack++] = imax; stack[nstack++] = hi;
+	}
+
+/* Keep at least 3 for the spline */
+	for (nkeep=0,i=0; i<npt; i++) if (keep[i]) nkeep++;
+	if (nkeep < 3) keep[npt/2] = TRUE;
+
+/* Refine against the spline itself, one point per out-of-tolerance gap a pass */
+	x  = malloc(3*npt*sizeof(*x));
+	yn = x+npt; yk = yn+npt;
+	n_spline = malloc(GVSplineSize(npt));
+	k_spline = malloc(GVSplineSize(npt));
+	do {
+		for (nkeep=0,i=0; i<npt; i++) {
+			if (! keep[i]) continue;
+			x[nkeep] = pt[i].ev; yn[nkeep] = pt[i].n; yk[nkeep] = pt[i].k;
+			nkeep++;
+		}
+		GVFitSpline(n_spline, x, yn, nkeep, 0);
+		GVFitSpline(k_spline, x, yk, nkeep, 0);
+		cursor = 0; nadd = 0;
+		for (lo=0; lo<npt-1; lo=hi) {
+			for (hi=lo+1; ! keep[hi]; hi++) ;
+			dmax = tol; imax = -1;
+			for (i=lo+1; i<hi; i++) {
+				d = fabs(pt[i].n - GVEvalSplineAt(n_spline, nkeep, pt[i].ev, &cursor));
+				if (d > dmax) { dmax = d; imax = i; }
+				d = fabs(pt[i].k - GVEvalSplineAt(k_spline, nkeep, pt[i].ev, &cursor));
+				if (d > dmax) { dmax = d; imax = i; }
+			}
+			if (imax >= 0) { keep[imax] = TRUE; nadd++; }
+		}
+	} while (nadd > 0);
+
+	for (i=0; i<nkeep; i++) { ev[i] = x[i]; n[i] = yn[i]; k[i] = yk[i]; }
+	free(n_spline); free(k_spline); free(x);
+	free(pt); free(keep); free(stack);
+	return nkeep;
+}
+
+/* ===========================================================================
+-- Set the tolerance (in n and k) for thinning tabulated materials as they
+-- are read.  0 (default) keeps every point.
+--
+-- Usage: void TFOC_SetDecimation(double tolerance);
+=========================================================================== */
+void TFOC_SetDecimation(double tolerance) {
+	decimate_tol = (tolerance > 0) ? tolerance : 0;
+	return;
+}
+
+/* ===========================================================================
+-- Set the tolerance (in n and k) for resampling tabulated materials onto a
+-- uniform energy grid as they are loaded.  0 (default) evaluates the
+-- splines directly.
+--
+-- Usage: void TFOC_SetLookupGrid(double tolerance);
+=========================================================================== */
+void TFOC_SetLookupGrid(double tolerance) {
+	grid_tol = (tolerance > 0) ? tolerance : 0;
+	return;
+}
+
+/* ===========================================================================
+-- Resample the n,k splines of a tabulated material onto a uniform grid.
+-- Each cell cubic interpolates the spline at t = 0, 1/3, 2/3 and 1.  The
+-- cells are doubled from GRID_MIN_CELLS until the grid matches the splines
+-- within grid_tol midway between those points in every cell.
+--
+-- Return: the grid, or NULL if it would need more than GRID_MAX_CELLS
+=========================================================================== */
+static NK_GRID *MakeGrid(TFOC_MATERIAL *rec) {
+	NK_GRID *grid;
+	COMPLEX n;
+	double v[4], d1, d2, d3, x, h, err, *cf;
+	int ncell, i, j, m, cursor;
+	void *spl;
+
+/* Range is the first knot to the next to last */
+	if (rec->npt < 3) return NULL;
+	grid = calloc(1, sizeof(*grid));
+	grid->x0  = GVSplineKnot(rec->n_spline, 0);
+	grid->xhi = GVSplineKnot(rec->n_spline, rec->npt-2);
+
+	for (ncell=GRID_MIN_CELLS; ncell<=GRID_MAX_CELLS; ncell*=2) {
+		h = (grid->xhi-grid->x0)/ncell;
+		grid->cf    = realloc(grid->cf, 8*ncell*sizeof(*grid->cf));
+		grid->ncell = ncell;
+		grid->inv_h = ncell/(grid->xhi-grid->x0);
+
+/* Cubic through four spline values per cell (forward differences), as a power series in t */
+		for (m=0; m<2; m++) {
+			spl = (m == 0) ? rec->n_spline : rec->k_spline;
+			cursor = 0;
+			for (i=0; i<ncell; i++) {
+				for (j=0; j<4; j++) v[j] = GVEvalSplineAt(spl, rec->npt, grid->x0+(i+j/3.0)*h, &cursor);
+				d1 = v[1]-v[0];
+				d2 = v[2]-2*v[1]+v[0];
+				d3 = v[3]-3*v[2]+3*v[1]-v[0];
+				cf = grid->cf + 8*i + 4*m;
+				cf[0] = v[0];
+				cf[1] = 3*(d1 - d2/2 + d3/3);
+				cf[2] = 9*(d2 - d3)/2;
+				cf[3] = 27*d3/6;
+			}
+		}
+
+/* Check against the splines between the interpolation points */
+		err = 0;
+		cursor = 0;
+		for (i=0; i<ncell && err<=grid_tol; i++) {
+			for (j=0; j<3; j++) {
+				x = grid->x0 + (i+(2*j+1)/6.0)*h;
+				n = GridNK(grid, x);
+				d1 = fabs(n.x - GVEvalSplineAt(rec->n_spline, rec->npt, x, &cursor));
+				d2 = fabs(n.y + GVEvalSplineAt(rec->k_spline, rec->npt, x, &cursor));
+				if (d1 > err) err = d1;
+				if (d2 > err) err = d2;
+			}
+		}
+		if (err <= grid_tol) {
+			if (TFOC_DEBUG(DEBUG_DATABASE)) fprintf(stderr, "%s: %d knots resampled to %d cells (error %.2g)\n", rec->name, rec->npt, ncell, err);
+			return grid;
+		}
+	}
+
+	if (TFOC_DEBUG(DEBUG_DATABASE)) fprintf(stderr, "%s: no lookup grid within %g, using the spline\n", rec->name, grid_tol);
+	free(grid->cf); free(grid);
+	return NULL;
+}
+
+/* ===========================================================================
+-- n,k from the uniform grid at energy E (constant extension at the ends)
+=========================================================================== */
+static COMPLEX GridNK(NK_GRID *grid, double E) {
+	COMPLEX n;
+	double s, t, *cf;
+	int i;
+
+	E = (E < grid->x0) ? grid->x0 : (E > grid->xhi) ? grid->xhi : E;
+	s = (E-grid->x0)*grid->inv_h;
+	i = (int) s;
+	i = (i < grid->ncell) ? i : grid->ncell-1;
+	t = s-i;
+	cf = grid->cf + 8*i;
+	n.x =   ((cf[3]*t + cf[2])*t + cf[1])*t + cf[0];
+	n.y = -(((cf[7]*t + cf[6])*t + cf[5])*t + cf[4]);
+	return n;
+}
+
+/* ===========================================================================
+-- Read the rest of a temperature table file.  The header line is
+--    temperature [K | C]
+-- followed by one line per slice, "<T> <material>", where the material is
+-- any database name (or [ ] mixture/model).  Names are resolved later by
+-- ResolveThermal since loading them may recurse into TFOC_FindMaterial.
+=========================================================================== */
+static TFOC_THERMAL *ParseThermal(FILE *funit, char *header) {
+
+	TFOC_THERMAL *thermal;
+	char *line=NULL, name[MATERIAL_NAME_LENGTH], *aptr, *endptr;
+	size_t linelen=0;
+	double offset, T;
+	int i;
+
+	while (isspace(*header)) header++;
+	offset = (toupper(*header) == 'C') ? 273.15 : 0;			/* Celsius or Kelvin */
+
+	thermal = calloc(1, sizeof(*thermal));
+	while (TFOC_ReadLine(funit, &line, &linelen) != NULL) {
+		aptr = line;
+		while (isspace(*aptr)) aptr++;
+		if (*aptr == '\0' || *aptr == '#') continue;
+		if (strncmp(aptr, "/*", 2) == 0) continue;
+		T = strtod(aptr, &endptr);
+		if (endptr == aptr) continue;									/* Ignore bad lines */
+		TFOC_GetMaterialName(endptr, name, sizeof(name), NULL);
+		if (*name == '\0') continue;
+		if (thermal->nt >= THERMAL_MAX_T) {
+			fprintf(stderr, "ERROR: More than %d temperatures in a temperature table\n", THERMAL_MAX_T);
+			break;
+		}
+		thermal->T[thermal->nt] = T + offset;
+		thermal->name[thermal->nt] = malloc(strlen(name)+1);
+		strcpy_s(thermal->name[thermal->nt], strlen(name)+1, name);
+		thermal->nt++;
+	}
+	free(line);
+	if (thermal->nt > 0) return thermal;
+
+	for (i=0; i<thermal->nt; i++) free(thermal->name[i]);
+	free(thermal);
+	return NULL;
+}
+
+/* ===========================================================================
+-- Load the slices of a temperature table and fit the cardinal splines in T.
+-- A table is only registered once resolved, so one that reaches itself
+-- through its slices (directly, via another table or in a mixture) would
+-- load forever; the tables being resolved are kept on a stack to catch it.
+--
+-- Return: TRUE if all slices were found and the temperatures are distinct
+=========================================================================== */
+static char *thermal_active[THERMAL_NEST_MAX];
+static int thermal_depth = 0;
+
+static BOOL ResolveThermal(TFOC_MATERIAL *rec, char *database) {
+
+	TFOC_THERMAL *thermal;
+	double x[THERMAL_MAX_T+1], y[THERMAL_MAX_T+1], T;
+	char *name;
+	int i, j, nt;
+	BOOL ok;
+
+	for (i=0; i<thermal_depth; i++) {
+		if (_stricmp(thermal_active[i], rec->name) == 0) {
+			fprintf(stderr, "ERROR: Temperature table cycle - \"%s\" is reached from its own slices\n", rec->name);
+			return FALSE;
+		}
+	}
+	if (thermal_depth >= THERMAL_NEST_MAX) {
+		fprintf(stderr, "ERROR: Temperature tables nested more than %d deep at \"%s\"\n", THERMAL_NEST_MAX, rec->name);
+		return FALSE;
+	}
+
+	thermal = rec->thermal;
+	nt = thermal->nt;
+	for (i=1; i<nt; i++) {											/* Ascending temperature */
+		T = thermal->T[i]; name = thermal->name[i];
+		for (j=i; j>0 && thermal->T[j-1] > T; j--) { thermal->T[j] = thermal->T[j-1]; thermal->name[j] = thermal->name[j-1]; }
+		thermal->T[j] = T; thermal->name[j] = name;
+	}
+	thermal_active[thermal_depth++] = rec->name;
+	for (ok=TRUE,i=0; ok && i<nt; i++) {
+		if ( (thermal->slice[i] = TFOC_FindMaterial(thermal->name[i], database)) == NULL) {
+			fprintf(stderr, "ERROR: Unable to load \"%s\" (T=%g K) of temperature table \"%s\"\n", thermal->name[i], thermal->T[i], rec->name);
+			ok = FALSE;
+		} else if (i > 0 && thermal->T[i-1] == thermal->T[i]) {
+			fprintf(stderr, "ERROR: Temperature %g K repeated in temperature table \"%s\"\n", thermal->T[i], rec->name);
+			ok = FALSE;
+		} else if (TFOC_HasTemperature(thermal->slice[i])) {
+			thermal->slice_T = TRUE;
+		}
+	}
+	thermal_depth--;
+	if (! ok) return FALSE;
+
+/* GVEvalSpline holds the value of the next to last knot over the last
+   interval, so add a flat knot one interval past the end.  The interval
+   to the true last temperature is then a cubic, and above it constant. */
+	if (nt >= 3) {
+		for (i=0; i<nt; i++) x[i] = thermal->T[i];
+		x[nt] = 2*x[nt-1] - x[nt-2];
+		for (j=0; j<nt; j++) {
+			for (i=0; i<nt; i++) y[i] = (i == j) ? 1.0 : 0.0;
+			y[nt] = y[nt-1];
+			thermal->weight[j] = GVFitSpline(NULL, x, y, nt+1, 0);
+		}
+	}
+	for (i=0; i<thermal->nt; i++) { free(thermal->name[i]); thermal->name[i] = NULL; }
+	return TRUE;
+}
+
+/* ===========================================================================
+-- n,k of a temperature table at (lambda,T).  Constant extension beyond the
+-- tabulated temperatures; linear if there are only two.
+=========================================================================== */
+static COMPLEX ThermalNK(TFOC_THERMAL *thermal, double lambda, double T) {
+
+	COMPLEX n;
+	double *w, f;
+	int i;
+
+	if (thermal->lambda != lambda || (thermal->slice_T && thermal->nk_T != T)) {	/* New slice values */
+		for (i=0; i<thermal->nt; i++) thermal->nk[i] = TFOC_FindNKT(thermal->slice[i], lambda, T);
+		thermal->lambda = lambda;
+		thermal->nk_T   = T;
+	}
+
+	for (i=0; i<thermal->ncache; i++) if (thermal->cache[i].T == T) break;
+	if (i < thermal->ncache) {
+		w = thermal->cache[i].w;
+	} else {																	/* Compute into the oldest entry */
+		i = thermal->next;
+		thermal->next = (thermal->next+1) % THERMAL_CACHE;
+		if (thermal->ncache < THERMAL_CACHE) thermal->ncache++;
+		thermal->cache[i].T = T;
+		w = thermal->cache[i].w;
+		if (thermal->nt >= 3) {
+			for (i=0; i<thermal->nt; i++) w[i] = GVEvalSpline(thermal->weight[i], T);
+		} else if (thermal->nt == 2) {
+			f = (T - thermal->T[0]) / (thermal->T[1] - thermal->T[0]);
+			if (f < 0) f = 0;
+			if (f > 1) f = 1;
+			w[0] = 1-f; w[1] = f;
+		} else {
+			w[0] = 1;
+		}
+	}
+
+	n.x = n.y = 0;
+	for (i=0; i<thermal->nt; i++) {
+		n.x += w[i]*thermal->nk[i].x;
+		n.y += w[i]*thermal->nk[i].y;
+	}
+	return n;
+}
+
+/* ===========================================================================
+-- Compiled database.  TFOC_CompileDatabase reads every material file in a
+-- database directory and writes the fitted spline tables into one binary
+-- file (NKB_FILENAME) in the same directory.  At run time the file is
+-- mapped read-only and the material records point straight into it, so
+-- nothing is parsed or fit and the pages are shared by every process using
+-- the same database.  The text files are still used for any name not in
+-- the compiled file (or if there is no compiled file).  Each entry records
+-- the size and modification time of its text file, and an entry whose file
+-- has since changed (or gone) is ignored in favour of the text file until
+-- the database is recompiled.  The file is only valid on machines with the
+-- same byte order.
+--
+-- Layout:  NKB_HEADER
+--          NKB_ENTRY[count]       sorted by name (FileNameCmp)
+--          spline tables          8 byte aligned, as from GVFitSpline
+=========================================================================== */
+#define	NKB_FILENAME		"tfoc.nkb"
+#define	NKB_MAGIC			"TFOC-NKB"
+#define	NKB_VERSION			(3)
+#define	NKB_BYTE_ORDER		(0x01020304)
+#define	NKB_NAME_LENGTH	(64)
+
+typedef struct _NKB_HEADER {
+	char magic[8];									/* NKB_MAGIC				*/
+	int version;									/* NKB_VERSION				*/
+	int byte_order;								/* NKB_BYTE_ORDER			*/
+	int spline_size;								/* Bytes per spline element */
+	int count;										/* Number of materials	*/
+} NKB_HEADER;
+
+typedef struct _NKB_ENTRY {
+	char name[NKB_NAME_LENGTH];				/* Material (file) name	*/
+	int npt;											/* Elements in each spline table */
+	int pad;
+	double offset_n, offset_k;					/* Byte offsets of the tables (exact in a double) */
+	double size, mtime;							/* Of the text file when compiled */
+} NKB_ENTRY;
+
+static struct {
+	char database[PATH_MAX];					/* Directory the image belongs to */
+	NKB_HEADER *header;							/* NULL if none (or invalid) */
+	size_t size;
+	BOOL warned;									/* Stale entries reported */
+} compiled = {"", NULL, 0, FALSE};
+
+static int CompareEntry(const void *a, const void *b) {
+	return FileNameCmp(((NKB_ENTRY *) a)->name, ((NKB_ENTRY *) b)->name);
+}
+
+
+/* ===========================================================================
+-- Map the compiled file of a database directory.  The mapping is never
+-- released since material records keep pointing into it.
+=========================================================================== */
+static void *MapCompiled(char *fname, size_t *size) {
+	void *base = NULL;
+#ifdef _WIN32
+	HANDLE file, map;
+	LARGE_INTEGER len;
+
+	file = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return NULL;
+	if (GetFileSizeEx(file, &len) && len.QuadPart > 0) {
+		if ( (map = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL)) != NULL) {
+			base = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(map);											/* View keeps the mapping alive */
+			*size = (size_t) len.QuadPart;
+		}
+	}
+	CloseHandle(file);
+#else
+	struct stat info;
+	int fd;
+
+	if ( (fd = open(fname, O_RDONLY)) < 0) return NULL;
+	if (fstat(fd, &info) == 0 && info.st_size > 0) {
+		base = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (base == MAP_FAILED) base = NULL;
+		*size = (size_t) info.st_size;
+	}
+	close(fd);
+#endif
+	return base;
+}
+
+/* ===========================================================================
+-- Look for a material in the compiled image of the database directory
+--
+-- Return: TRUE and the spline tables (pointing into the mapping) and their
+--         knot count if found and the text file is unchanged since compiled
+=========================================================================== */
+static BOOL FindCompiled(char *database, char *name, void **n_spline, void **k_spline, int *npt) {
+	char fname[PATH_MAX];
+	NKB_HEADER *hdr;
+	NKB_ENTRY key, *entry;
+	DB_INDEX *index;
+	DB_INDEX_ENTRY *file;
+	size_t size = 0;
+
+	if (strcmp(database, compiled.database) != 0) {					/* First use of this directory */
+		strcpy_s(compiled.database, sizeof(compiled.database), database);
+		DatabaseFilename(fname, sizeof(fname), database, NKB_FILENAME);
+		compiled.header = NULL;
+		compiled.warned = FALSE;
+		if ( (hdr = MapCompiled(fname, &size)) != NULL) {
+			if (size < sizeof(*hdr) || memcmp(hdr->magic, NKB_MAGIC, sizeof(hdr->magic)) != 0 ||
+				 hdr->version != NKB_VERSION || hdr->byte_order != NKB_BYTE_ORDER ||
+				 hdr->spline_size != (int) GVSplineSize(1) ||
+				 size < sizeof(*hdr)+hdr->count*sizeof(NKB_ENTRY)) {
+				fprintf(stderr, "WARNING: Ignoring \"%s\" - not a compiled database for this version/machine\n", fname);
+			} else {
+				compiled.header = hdr;
+				compiled.size   = size;
+			}
+		}
+		if (TFOC_DEBUG(DEBUG_DATABASE)) fprintf(stderr, "Compiled database %s: %s\n", fname, (compiled.header != NULL) ? "mapped" : "not used");
+	}
+	if ( (hdr = compiled.header) == NULL || strlen(name) >= NKB_NAME_LENGTH) return FALSE;
+
+	strcpy_s(key.name, sizeof(key.name), name);
+	entry = bsearch(&key, hdr+1, hdr->count, sizeof(NKB_ENTRY), CompareEntry);
+	if (entry == NULL) return FALSE;
+
+/* Stale if the text file has been edited (or removed) since compiling */
+	if ( (index = IndexDatabase(database)) == NULL || (file = FindIndex(index, name)) == NULL ||
+		  file->size != entry->size || (double) file->mtime != entry->mtime) {
+		if (! compiled.warned) {
+			DatabaseFilename(fname, sizeof(fname), database, NKB_FILENAME);
+			fprintf(stderr, "WARNING: \"%s\" is out of date (first for \"%s\") - using the text files.  Rerun tfoc -compile\n", fname, name);
+			compiled.warned = TRUE;
+		}
+		if (TFOC_DEBUG(DEBUG_DATABASE)) fprintf(stderr, "Compiled entry for %s is stale\n", name);
+		return FALSE;
+	}
+
+	*n_spline = (char *) hdr + (size_t) entry->offset_n;
+	*k_spline = (char *) hdr + (size_t) entry->offset_k;
+	*npt      = entry->npt;
+	return TRUE;
+}
+
+/* ===========================================================================
+-- Compile all material files in a database directory into NKB_FILENAME
+--
+-- Usage: int TFOC_CompileDatabase(char *database);
+--
+-- Inputs: database - database directory
+--
+-- Output: Writes <database>/tfoc.nkb, listing each material to stdout
+--
+-- Return: Number of materials compiled, or -1 on error
+=========================================================================== */
+int TFOC_CompileDatabase(char *database) {
+
+	char fname[PATH_MAX];
+	int i, j, npt, count;
+	void **tables;									/* n and k spline table of each entry */
+	TFOC_MATERIAL rec;
+	size_t pad;
+	NKB_HEADER hdr;
+	NKB_ENTRY *entry;
+	DB_INDEX *index;
+	double offset;
+	FILE *funit;
+	static char zero[8] = {0};
+
+	if ( (index = IndexDatabase(database)) == NULL) return -1;
+
+/* Load and fit everything first, dropping files that are not ev,n,k tables */
+	entry  = calloc(index->count+1, sizeof(*entry));
+	tables = calloc(2*index->count+1, sizeof(*tables));
+	for (count=0,i=0; i<index->count; i++) {
+		if (strlen(index->entry[i].name) >= NKB_NAME_LENGTH || strcmp(index->entry[i].name, NKB_FILENAME) == 0) continue;
+		DatabaseFilename(fname, sizeof(fname), database, index->entry[i].name);
+		if (LoadNKFile(fname, &rec, &npt) != 0) {
+			printf("  %-24s skipped (not an ev,n,k table)\n", index->entry[i].name);
+			continue;
+		}
+		if (rec.model != NULL || rec.thermal != NULL) {			/* Nothing to compile, read from text */
+			printf("  %-24s skipped (%s)\n", index->entry[i].name, (rec.model != NULL) ? "dispersion model" : "temperature table");
+			TFOC_FreeDispersion(rec.model);
+			if (rec.thermal != NULL) for (j=0; j<rec.thermal->nt; j++) free(rec.thermal->name[j]);
+			free(rec.thermal);
+			continue;
+		}
+		tables[2*count]   = rec.n_spline;
+		tables[2*count+1] = rec.k_spline;
+		strcpy_s(entry[count].name, NKB_NAME_LENGTH, index->entry[i].name);
+		entry[count].npt   = npt;
+		entry[count].size  = index->entry[i].size;
+		entry[count].mtime = (double) index->entry[i].mtime;
+		printf("  %-24s %d points\n", index->entry[i].name, npt);
+		count++;
+	}
+
+/* Header, directory, then the tables on 8 byte boundaries */
+	offset = (double) (sizeof(hdr) + count*sizeof(*entry));
+	pad    = (8 - (size_t) offset % 8) % 8;
+	offset += pad;
+	for (i=0; i<count; i++) {
+		entry[i].offset_n = offset;
+		entry[i].offset_k = offset + GVSplineSize(entry[i].npt);
+		offset += 2*GVSplineSize(entry[i].npt);
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, NKB_MAGIC, sizeof(hdr.magic));
+	hdr.version     = NKB_VERSION;
+	hdr.byte_order  = NKB_BYTE_ORDER;
+	hdr.spline_size = (int) GVSplineSize(1);
+	hdr.count       = count;
+
+	DatabaseFilename(fname, sizeof(fname), database, NKB_FILENAME);
+	if (fopen_s(&funit, fname, "wb") != 0) {
+		fprintf(stderr, "ERROR: Unable to open \"%s\" for writing\n", fname);
+		count = -1;
+		goto Cleanup;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, funit);
+	fwrite(entry, sizeof(*entry), count, funit);
+	fwrite(zero, 1, pad, funit);
+	for (i=0; i<count; i++) {
+		fwrite(tables[2*i],   GVSplineSize(entry[i].npt), 1, funit);
+		fwrite(tables[2*i+1], GVSplineSize(entry[i].npt), 1, funit);
+	}
+	if (fclose(funit) != 0) {
+		fprintf(stderr, "ERROR: Failed writing \"%s\"\n", fname);
+		count = -1;
+	}
+
+Cleanup:
+	for (i=0; i<2*index->count; i++) free(tables[i]);
+	free(tables); free(entry);
+	return count;
+}
+
+/* ===========================================================================
+-- Index of a database directory: the regular files with their sizes and
+-- modification times, sorted by name.  Names match only as the file system
+-- would (FileNameCmp), so a material is found here exactly when opening its
+-- file would succeed, whichever path loads it.  Built once per directory
+-- with a single directory scan, which on network mounts is far cheaper
+-- than probing for each file with fopen.
+=========================================================================== */
+static int CompareIndex(const void *a, const void *b) {
+	return FileNameCmp(((DB_INDEX_ENTRY *) a)->name, ((DB_INDEX_ENTRY *) b)->name);
+}
+
+static DB_INDEX *IndexDatabase(char *database) {
+	static DB_INDEX index = {"", 0, NULL};
+	char fname[PATH_MAX];
+	DB_INDEX_ENTRY *now;
+	int i, dim=0;
+#ifdef _WIN32
+	struct _finddata_t info;
+	intptr_t handle;
+#else
+	DIR *dir;
+	struct dirent *ent;
+	struct stat info;
+#endif
+
+	if (index.entry != NULL && strcmp(index.database, database) == 0) return &index;
+
+	for (i=0; i<index.count; i++) free(index.entry[i].name);
+	free(index.entry);
+	index.entry = NULL; index.count = 0;
+	strcpy_s(index.database, sizeof(index.database), database);
+
+#ifdef _WIN32
+	DatabaseFilename(fname, sizeof(fname), database, "*");
+	if ( (handle = _findfirst(fname, &info)) == -1) {
+		fprintf(stderr, "ERROR: Unable to read the database directory \"%s\"\n", database);
+		return NULL;
+	}
+	do {
+		if (info.attrib & _A_SUBDIR) continue;
+		if (index.count >= dim) index.entry = realloc(index.entry, (dim += 64)*sizeof(*index.entry));
+		now = index.entry + index.count++;
+		now->name  = _strdup(info.name);
+		now->size  = (double) info.size;
+		now->mtime = info.time_write;
+	} while (_findnext(handle, &info) == 0);
+	_findclose(handle);
+#else
+	if ( (dir = opendir(database)) == NULL) {
+		fprintf(stderr, "ERROR: Unable to read the database directory \"%s\"\n", database);
+		return NULL;
+	}
+	while ( (ent = readdir(dir)) != NULL) {
+		DatabaseFilename(fname, sizeof(fname), database, ent->d_name);
+		if (stat(fname, &info) != 0 || ! S_ISREG(info.st_mode)) continue;
+		if (index.count >= dim) index.entry = realloc(index.entry, (dim += 64)*sizeof(*index.entry));
+		now = index.entry + index.count++;
+		now->name  = strdup(ent->d_name);
+		now->size  = (double) info.st_size;
+		now->mtime = info.st_mtime;
+	}
+	closedir(dir);
+#endif
+	if (index.entry == NULL) index.entry = malloc(sizeof(*index.entry));	/* Mark as built, even if empty */
+	qsort(index.entry, index.count, sizeof(*index.entry), CompareIndex);
+
+	if (TFOC_DEBUG(DEBUG_DATABASE)) fprintf(stderr, "Indexed %d files in %s\n", index.count, database);
+	return &index;
+}
+
+static DB_INDEX_ENTRY *FindIndex(DB_INDEX *index, char *name) {
+	DB_INDEX_ENTRY key;
+
+	key.name = name;
+	return bsearch(&key, index->entry, index->count, sizeof(*index->entry), CompareIndex);
+}
+
+/* ===========================================================================
+-- Load all of the materials a sample refers to, reading and spline fitting
+-- the files concurrently.  Mixtures are broken down to their components.
+-- Names that are already loaded, are in the compiled database, or are not
+-- in the directory index are left for TFOC_FindMaterial (which reports any
+-- error as usual).  The workers only read and fit; the records are added
+-- to the registry by the calling thread once all are done, so the rest of
+-- this module needs no locking.  Slices named by temperature tables are
+-- read in further rounds (a table already read is not queued again, so
+-- tables naming each other still end), then the tables are resolved.
+-- After this, TFOC_FindMaterial for each sample row only has to assemble
+-- the mixtures.
+--
+-- Usage: int TFOC_PrefetchMaterials(TFOC_SAMPLE *sample, char *database);
+--
+-- Inputs: sample   - sample description (terminated by EOS)
+--         database - database directory
+--
+-- Return: Number of materials loaded
+=========================================================================== */
+#define	PREFETCH_THREADS_MAX	(8)
+#define	PREFETCH_STACK			(256*1024)		/* Data is on the heap; K-K has a few k */
+
+typedef struct _PREFETCH_JOB {
+	char name[MATERIAL_NAME_LENGTH];				/* Name as referenced	*/
+	char filename[PATH_MAX];						/* File in database		*/
+	double size;										/* For ordering, largest first */
+	TFOC_MATERIAL rec;								/* Splines, model or temperature table */
+	int rc, npt;
+} PREFETCH_JOB;
+
+static struct {
+	PREFETCH_JOB *job;
+	int njobs, next;
+	TFOC_MATERIAL *pending;							/* Tables waiting for their slices */
+	int npending;
+#ifdef _WIN32
+	CRITICAL_SECTION lock;
+#else
+	pthread_mutex_t lock;
+#endif
+} prefetch;
+
+static int CompareJob(const void *a, const void *b) {
+	double d = ((PREFETCH_JOB *) b)->size - ((PREFETCH_JOB *) a)->size;
+	return (d > 0) ? 1 : (d < 0) ? -1 : 0;
+}
+
+#ifdef _WIN32
+static unsigned __stdcall PrefetchWorker(void *arg) {
+#else
+static void *PrefetchWorker(void *arg) {
+#endif
+	PREFETCH_JOB *job;
+	int i;
+
+	while (TRUE) {
+#ifdef _WIN32
+		EnterCriticalSection(&prefetch.lock);
+		i = prefetch.next++;
+		LeaveCriticalSection(&prefetch.lock);
+#else
+		pthread_mutex_lock(&prefetch.lock);
+		i = prefetch.next++;
+		pthread_mutex_unlock(&prefetch.lock);
+#endif
+		if (i >= prefetch.njobs) break;
+		job = prefetch.job+i;
+		job->rc = LoadNKFile(job->filename, &job->rec, &job->npt);
+	}
+	return 0;
+}
+
+/* Add a simple name, or the components of a mixture, to the job list */
+static void CollectNames(char *name, char *database, DB_INDEX *index, int *dim) {
+	char myname[MATERIAL_NAME_LENGTH], subname[MATERIAL_NAME_LENGTH], *aptr, *endptr;
+	DB_INDEX_ENTRY *file;
+	PREFETCH_JOB *job;
+	void *n_spline, *k_spline;
+	int i, npt;
+
+	while (isspace(*name)) name++;
+	if (*name == '[') {
+		strcpy_s(myname, sizeof(myname), name+1);
+		if ( (aptr = strrchr(myname, ']')) != NULL) *aptr = '\0';
+		aptr = myname;
+		while (isspace(*aptr)) aptr++;
+		if (TFOC_IsDispersion(aptr)) return;								/* Inline model, nothing to read */
+		if (isalpha(*aptr)) while (*aptr && ! isspace(*aptr)) aptr++;	/* EMA model keyword */
+		while (*aptr) {
+			strtod(aptr, &endptr);
+			if (endptr == aptr) break;
+			TFOC_GetMaterialName(endptr, subname, sizeof(subname), &aptr);
+			if (*subname == '\0') break;
+			CollectNames(subname, database, index, dim);
+		}
+		return;
+	}
+
+	if (LookupMaterial(name, HashName(name)) != NULL) return;				/* Already loaded */
+	if (FindCompiled(database, name, &n_spline, &k_spline, &npt)) return;		/* Free from the image */
+	if ( (file = FindIndex(index, name)) == NULL) return;					/* Let FindMaterial report it */
+	for (i=0; i<prefetch.njobs; i++) if (_stricmp(prefetch.job[i].name, name) == 0) return;
+	for (i=0; i<prefetch.npending; i++) if (_stricmp(prefetch.pending[i].name, name) == 0) return;	/* Read already */
+
+	if (prefetch.njobs >= *dim) prefetch.job = realloc(prefetch.job, (*dim += 16)*sizeof(*prefetch.job));
+	job = prefetch.job + prefetch.njobs++;
+	memset(job, 0, sizeof(*job));
+	strcpy_s(job->name, sizeof(job->name), name);
+	DatabaseFilename(job->filename, sizeof(job->filename), database, file->name);
+	job->size = file->size;
+	return;
+}
+
+/* Run the workers over the current job list; returns threads used */
+static int RunPrefetch(void) {
+	int i, nthreads;
+#ifdef _WIN32
+	HANDLE thread[PREFETCH_THREADS_MAX];
+	SYSTEM_INFO sysinfo;
+#else
+	pthread_t thread[PREFETCH_THREADS_MAX];
+	pthread_attr_t attr;
+#endif
+
+	qsort(prefetch.job, prefetch.njobs, sizeof(*prefetch.job), CompareJob);
+	prefetch.next = 0;
+
+/* One worker per processor, but no more than there are files */
+#ifdef _WIN32
+	GetSystemInfo(&sysinfo);
+	nthreads = (int) sysinfo.dwNumberOfProcessors;
+#else
+	nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (nthreads > PREFETCH_THREADS_MAX) nthreads = PREFETCH_THREADS_MAX;
+	if (nthreads > prefetch.njobs) nthreads = prefetch.njobs;
+
+/* The worker always takes the lock, so it exists for the serial case too */
+#ifdef _WIN32
+	InitializeCriticalSection(&prefetch.lock);
+#else
+	pthread_mutex_init(&prefetch.lock, NULL);
+#endif
+
+	if (nthreads <= 1) {
+		PrefetchWorker(NULL);
+	} else {
+#ifdef _WIN32
+		for (i=0; i<nthreads; i++) thread[i] = (HANDLE) _beginthreadex(NULL, PREFETCH_STACK, PrefetchWorker, NULL, 0, NULL);
+		for (i=0; i<nthreads; i++) {
+			if (thread[i] == 0) { PrefetchWorker(NULL); continue; }		/* Do the work here instead */
+			WaitForSingleObject(thread[i], INFINITE);
+			CloseHandle(thread[i]);
+		}
+#else
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, PREFETCH_STACK);
+		for (i=0; i<nthreads; i++) {
+			if (pthread_create(&thread[i], &attr, PrefetchWorker, NULL) != 0) { nthreads = i; break; }
+		}
+		PrefetchWorker(NULL);												/* Help out (and cover any failed create) */
+		for (i=0; i<nthreads; i++) pthread_join(thread[i], NULL);
+		pthread_attr_destroy(&attr);
+#endif
+	}
+
+#ifdef _WIN32
+	DeleteCriticalSection(&prefetch.lock);
+#else
+	pthread_mutex_destroy(&prefetch.lock);
+#endif
+	return nthreads;
+}
+
+int TFOC_PrefetchMaterials(TFOC_SAMPLE *sample, char *database) {
+
+	DB_INDEX *index;
+	TFOC_MATERIAL *rec, *pending;
+	int i, j, nthreads, count, dim, collected;
+
+	if ( (index = IndexDatabase(database)) == NULL) return 0;
+
+	prefetch.job = NULL; prefetch.njobs = 0; dim = 0;
+	prefetch.pending = NULL; prefetch.npending = 0;
+	for (i=0; sample[i].type != EOS; i++) {
+		if (sample[i].type == IGNORE_LAYER) continue;
+		CollectNames(sample[i].name, database, index, &dim);
+	}
+
+/* Register what loaded.  Failures are left for TFOC_FindMaterial to report */
+	count = nthreads = collected = 0;
+	while (prefetch.njobs > 0) {
+		nthreads = RunPrefetch();
+		for (i=0; i<prefetch.njobs; i++) {
+			if (prefetch.job[i].rc != 0) continue;
+			rec = &prefetch.job[i].rec;
+			strcpy_s(rec->name, sizeof(rec->name), prefetch.job[i].name);
+			rec->hash = HashName(rec->name);
+			if (rec->thermal != NULL) {										/* Needs its slices first */
+				prefetch.pending = realloc(prefetch.pending, (prefetch.npending+1)*sizeof(*prefetch.pending));
+				prefetch.pending[prefetch.npending++] = *rec;
+			} else {
+				AddMaterial(rec);
+				count++;
+			}
+		}
+		free(prefetch.job);
+		prefetch.job = NULL; prefetch.njobs = 0; dim = 0;
+		for (; collected<prefetch.npending; collected++) {
+			rec = prefetch.pending+collected;
+			for (j=0; j<rec->thermal->nt; j++) CollectNames(rec->thermal->name[j], database, index, &dim);
+		}
+	}
+	pending = prefetch.pending;
+
+/* Then the tables, innermost (last found) first.  Any with a slice not
+   loaded here are dropped and left to TFOC_FindMaterial to load and report */
+	for (i=prefetch.npending-1; i>=0; i--) {
+		for (j=0; j<pending[i].thermal->nt; j++) {
+			if (LookupMaterial(pending[i].thermal->name[j], HashName(pending[i].thermal->name[j])) == NULL) break;
+		}
+		if (j == pending[i].thermal->nt && ResolveThermal(&pending[i], database)) {
+			AddMaterial(&pending[i]);
+			count++;
+		} else {
+			for (j=0; j<pending[i].thermal->nt; j++) free(pending[i].thermal->name[j]);
+			free(pending[i].thermal);
+		}
+	}
+	free(pending);
+	prefetch.pending = NULL; prefetch.npending = 0;
+
+	if (TFOC_DEBUG(DEBUG_DATABASE)) fprintf(stderr, "Prefetched %d materials with %d threads\n", count, nthreads);
+	return count;
+}
+
+/* ===========================================================================
+-- Case-insensitive FNV-1a hash of a material name
+=========================================================================== */
+static unsigned int HashName(char *name) {
+	unsigned int hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (unsigned char) tolower(*(name++));
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* ===========================================================================
+-- Find an already loaded material by name, or NULL
+=========================================================================== */
+static TFOC_MATERIAL *LookupMaterial(char *name, unsigned int hash) {
+	TFOC_MATERIAL *now;
+
+	if (hash_table == NULL) return NULL;
+	for (now=hash_table[hash & (hash_size-1)]; now!=NULL; now=now->hash_next) {
+		if (now->hash == hash && _stricmp(name, now->name) == 0) return now;
+	}
+	return NULL;
+}
+
+/* ===========================================================================
+-- Copy a completed material record into the arena and index it.  Returns
+-- the permanent address of the record.
+=========================================================================== */
+static TFOC_MATERIAL *AddMaterial(TFOC_MATERIAL *rec) {
+	TFOC_MATERIAL *now, *next, **table;
+	MATERIAL_SLAB *slab;
+	unsigned int i, size;
+
+/* Room in the arena - add another slab when the last is full */
+	if (slab_last == NULL || slab_last->used >= MATERIAL_SLAB_SIZE) {
+		slab = calloc(1, sizeof(*slab));
+		if (slab_last == NULL) { slab_first = slab; } else { slab_last->next = slab; }
+		slab_last = slab;
+	}
+	now = slab_last->rec + slab_last->used++;
+	*now = *rec;
+	if (grid_tol > 0 && now->n_spline != NULL && now->mixed == NULL) now->grid = MakeGrid(now);
+
+/* Grow the index at a load factor of 3/4, relinking the existing chains */
+	if (4*(num_materials+1) > 3*(int) hash_size) {
+		size  = (hash_size == 0) ? MATERIAL_HASH_INIT : 2*hash_size;
+		table = calloc(size, sizeof(*table));
+		for (i=0; i<hash_size; i++) {
+			for (next=hash_table[i]; next!=NULL; ) {
+				rec = next; next = next->hash_next;
+				rec->hash_next = table[rec->hash & (size-1)];
+				table[rec->hash & (size-1)] = rec;
+			}
+		}
+		free(hash_table);
+		hash_table = table;
+		hash_size  = size;
+	}
+	now->hash_next = hash_table[now->hash & (hash_size-1)];
+	hash_table[now->hash & (hash_size-1)] = now;
+	num_materials++;
+
 	return now;
 }
 
@@ -281,9 +1515,12 @@ TFOC_MATERIAL *TFOC_FindMaterial(char *name, char *database) {
 -- Obtain the base n,k values from the material database
 --
 -- Usage: COMPLEX FindNK(MATERIAL *material, double lambda)
+--        COMPLEX FindNKT(MATERIAL *material, double lambda, double T)
 --
 -- Inputs: material - database for a given material
 --         lambda   - wavelength in nm
+--         T        - temperature (K) for temperature tables; FindNK
+--                    uses TFOC_ROOM_TEMPERATURE
 --
 -- Output: none
 --
@@ -291,91 +1528,30 @@ TFOC_MATERIAL *TFOC_FindMaterial(char *name, char *database) {
 --         database files
 =========================================================================== */
 COMPLEX TFOC_FindNK(TFOC_MATERIAL *material, double lambda) {
-	COMPLEX n, b, e1, e2, f, ni[MAX_MIX_TERMS];
-	static COMPLEX one={1.0,0.0}, two={2.0,0.0}, three={3.0,0.0}, four={4.0,0.0}, eight={8.0,0.0};
-	int i, first_term, last_term, num_terms;
-	EMA_MODEL model;
-	
+	return TFOC_FindNKT(material, lambda, TFOC_ROOM_TEMPERATURE);
+}
+
+COMPLEX TFOC_FindNKT(TFOC_MATERIAL *material, double lambda, double T) {
+	COMPLEX n, ni[MAX_MIX_TERMS], stack_slot[EMA_SLOTS_STACK], *slot;
+	EMA_PROGRAM *program;
+	EMA_OP *op;
+	int i, j;
+
 	if (material->mixed == NULL) {
-		n.x =  GVEvalSpline(material->n_spline, 1240.0/lambda);
-		n.y = -GVEvalSpline(material->k_spline, 1240.0/lambda);
-	} else {
-		model = material->mixed->EMA_Model;
-		num_terms = 0;
-		first_term = last_term = -1;
-		for (i=0; i<MAX_MIX_TERMS; i++) {
-			if (material->mixed->fraction[i] <= 0) continue;
-			num_terms++;
-			if (first_term < 0) first_term = i;
-			last_term = i;
-			ni[i] = TFOC_FindNK(material->mixed->material[i], lambda);
-		}
-		if (num_terms == 0) {
-			fprintf(stderr, "ERROR: No element has any fraction - returning air\n");
-			n.x = 1; n.y = 0;
-		/* Simple one component written in complex form */
-		} else if (num_terms == 1) {							/* Defined as mixture but only one there */
-			n = ni[first_term];
-		/* Series weighted average */
-		} else if (model == SERIES) {							/* Weighted fraction summation */
-			n.x = n.y = 0;
-			for (i=0; i<MAX_MIX_TERMS; i++) {
-				if (material->mixed->fraction[i] <= 0) continue;
-				e1 = ni[i];
-				e1 = CMUL(e1,e1);									/* Go to dielectric constant */
-				n.x += material->mixed->fraction[i]*e1.x;
-				n.y += material->mixed->fraction[i]*e1.y;
-			}
-			n = CCSQRT(n); if (n.x < 0) { n.x = -n.x; n.y = -n.y; }
-		/* Parallel weighted average */
-		} else if (model == PARALLEL) {
-			n.x = n.y = 0;
-			for (i=0; i<MAX_MIX_TERMS; i++) {
-				if (material->mixed->fraction[i] <= 0) continue;
-				f.x  = material->mixed->fraction[i]; f.y = 0;		/* Fraction */
-				n = CADD(n, CDIV(f, CMUL(ni[i],ni[i])));
-			}
-			n = CDIV(one, n);										/* Invert */
-			n = CCSQRT(n); if (n.x < 0) { n.x = -n.x; n.y = -n.y; }
-		/* Looyenga - H. Looyenga, "Dielectric constants of heterogeneous mixtures", Physica 31, 401-406 (1965) */
-		} else if (model == LOOYENGA) {
-			n.x = n.y = 0;
-			for (i=0; i<MAX_MIX_TERMS; i++) {
-				if (material->mixed->fraction[i] <= 0) continue;
-				f.x  = material->mixed->fraction[i]; f.y = 0;		/* Fraction */
-				n = CADD(n, CMUL(f, CPOW(ni[i],2.0/3.0)));			/* epsilon^(1/3) from n */
-			}
-			n = CPOW(n, 1.5);													/* sqrt(sum^3) */
-			if (n.x < 0) { n.x = -n.x; n.y = -n.y; }
-		/* Maxwell-Garnett mixing */
-		} else if (num_terms == 2 && model == MAXWELL_GARNETT) {
-			if (material->mixed->fraction[first_term] < material->mixed->fraction[last_term]) {
-				f.x = material->mixed->fraction[first_term]; f.y = 0;
-				e1  = ni[first_term]; 		/* Minority phase (inclusion) */
-				e2  = ni[last_term];			/* Majority phase (matrix) */
+		n = BaseNK(material, lambda, T);
+	} else {										/* Run the mixture program, each unique node once */
+		program = &material->mixed->program;
+		slot = (program->nops <= EMA_SLOTS_STACK) ? stack_slot : malloc(program->nops*sizeof(*slot));
+		for (op=program->op,i=0; i<program->nops; i++,op++) {
+			if (op->leaf != NULL) {
+				n = BaseNK(op->leaf, lambda, T);
 			} else {
-				f.x = material->mixed->fraction[last_term]; f.y = 0;
-				e1  = ni[last_term];			/* Minority phase (inclusion) */
-				e2  = ni[first_term];		/* Majority phase (matrix) */
+				for (j=0; j<op->nterms; j++) ni[j] = slot[op->arg[j]];
+				n = MixEMA(op->model, op->nterms, op->fraction, ni, &op->warm);
 			}
-			e1 = CMUL(e1,e1);	e2 = CMUL(e2,e2);				/* Go to dielectric constant */
-			n = CDIV ( CSUB(CMUL(e1,CADD(one,CMUL(two,f))),CMUL(e2,CSUB(CMUL(two,f),two))),
-						  CADD(CMUL(e2,CADD(two,f)),CMUL(e1,CSUB(one,f))) );
-			n = CMUL(e2, n);
-			n = CCSQRT(n); if (n.x < 0) { n.x = -n.x; n.y = -n.y; }
-		/* Bruggeman model */
-		} else if (num_terms == 2 && model == BRUGGEMAN) {
-			f.x = material->mixed->fraction[first_term]; f.y = 0;
-			e1 = ni[first_term]; e1 = CMUL(e1,e1);			/* Work in dielectric constant */
-			e2 = ni[last_term];	e2 = CMUL(e2,e2);			/* Work in dielectric constant */
-			b = CADD(CMUL(e1,CSUB(CMUL(three,f),one)), CMUL(e2,CSUB(two,CMUL(three,f))));	/* Actually -b in quadratic */
-			n = CCSQRT(CADD(CMUL(b,b),CMUL(eight,CMUL(e1,e2))));
-			n = CDIV(CADD(n,b),four);
-			n = CCSQRT(n); if (n.x < 0) { n.x = -n.x; n.y = -n.y; }
-		} else {
-			fprintf(stderr, "ERROR: Either two many terms for Effective Medium Approximation model or unimplemented model (%d)\n", model);
-			n.x = 1; n.y = 0;
+			slot[i] = n;								/* Last op is the mixture itself */
 		}
+		if (slot != stack_slot) free(slot);
 	}
 
 #ifdef DEBUG
@@ -384,6 +1560,294 @@ COMPLEX TFOC_FindNK(TFOC_MATERIAL *material, double lambda) {
 	return n;
 }
 
+/* ===========================================================================
+-- n,k of a material over a batch of wavelengths
+--
+-- Usage: void TFOC_FindNKBatch(TFOC_MATERIAL *material, int npt, double lambda[], double T, COMPLEX nk[]);
+--
+-- Inputs: material - database for a given material
+--         npt      - number of wavelengths
+--         lambda   - wavelengths in nm
+--         T        - temperature (K) for temperature tables
+--
+-- Output: nk[npt]  - as from TFOC_FindNKT at each wavelength
+--
+-- Return: void
+=========================================================================== */
+void TFOC_FindNKBatch(TFOC_MATERIAL *material, int npt, double lambda[], double T, COMPLEX nk[]) {
+	COMPLEX *slot, ni[MAX_MIX_TERMS];
+	EMA_PROGRAM *program;
+	EMA_OP *op;
+	int i, j, k;
+
+	if (material->mixed == NULL) {
+		for (k=0; k<npt; k++) nk[k] = BaseNK(material, lambda[k], T);
+		return;
+	}
+
+/* Op by op across the batch; slot i of wavelength k at [i*npt+k].  Within an
+-- op the wavelengths run in order, so an N-component Bruggeman op starts its
+-- iteration from the solution at the previous wavelength */
+	program = &material->mixed->program;
+	slot = malloc(program->nops*npt*sizeof(*slot));
+	for (op=program->op,i=0; i<program->nops; i++,op++) {
+		if (op->leaf != NULL) {
+			for (k=0; k<npt; k++) slot[i*npt+k] = BaseNK(op->leaf, lambda[k], T);
+		} else {
+			for (k=0; k<npt; k++) {
+				for (j=0; j<op->nterms; j++) ni[j] = slot[op->arg[j]*npt+k];
+				slot[i*npt+k] = MixEMA(op->model, op->nterms, op->fraction, ni, &op->warm);
+			}
+		}
+	}
+	memcpy(nk, slot+(program->nops-1)*npt, npt*sizeof(*nk));
+	free(slot);
+	return;
+}
+
+/* ===========================================================================
+-- n,k of anything but a mixture
+=========================================================================== */
+static COMPLEX BaseNK(TFOC_MATERIAL *material, double lambda, double T) {
+	COMPLEX n;
+
+	if (material->model != NULL) {
+		n = TFOC_EvalDispersion(material->model, lambda);
+	} else if (material->thermal != NULL) {
+		n = ThermalNK(material->thermal, lambda, T);
+	} else if (material->grid != NULL) {
+		n = GridNK(material->grid, 1240.0/lambda);
+	} else {
+		n.x =  GVEvalSplineAt(material->n_spline, material->npt, 1240.0/lambda, &material->cursor);
+		n.y = -GVEvalSplineAt(material->k_spline, material->npt, 1240.0/lambda, &material->cursor);
+	}
+	return n;
+}
+
+/* ===========================================================================
+-- Flatten a mixture tree into its program.  Nodes already in the program
+-- (same material record, so the same name) are referenced, not repeated.
+=========================================================================== */
+static void CompileMixture(TFOC_MATERIAL_MIX *mixed) {
+	TFOC_MATERIAL *node[EMA_SLOTS_STACK], **nodes;
+	int n, i, nmax;
+
+/* Upper bound on the node count is the size of the full tree */
+	nmax = 1;
+	for (i=0; i<MAX_MIX_TERMS; i++) {
+		if (mixed->fraction[i] <= 0) continue;
+		nmax += (mixed->material[i]->mixed == NULL) ? 1 : mixed->material[i]->mixed->program.nops;
+	}
+	nodes = (nmax <= EMA_SLOTS_STACK) ? node : malloc(nmax*sizeof(*nodes));
+	mixed->program.nops = 0;
+	mixed->program.op   = calloc(nmax, sizeof(*mixed->program.op));
+	n = CompileNode(&mixed->program, nodes, NULL, mixed);
+	if (TFOC_DEBUG(DEBUG_DATABASE)) fprintf(stderr, "Mixture compiled to %d ops (tree bound %d)\n", n+1, nmax);
+	if (nodes != node) free(nodes);
+	return;
+}
+
+/* Add material (or the top level mixture if material is NULL); returns its slot */
+static int CompileNode(EMA_PROGRAM *program, TFOC_MATERIAL **node, TFOC_MATERIAL *material, TFOC_MATERIAL_MIX *mixed) {
+	EMA_OP op;
+	int i;
+
+	if (material != NULL) {
+		for (i=0; i<program->nops; i++) if (node[i] == material) return i;
+		mixed = material->mixed;
+	}
+
+	memset(&op, 0, sizeof(op));
+	if (mixed == NULL) {
+		op.leaf = material;
+	} else {
+		op.model = mixed->EMA_Model;
+		for (i=0; i<MAX_MIX_TERMS; i++) {
+			if (mixed->fraction[i] <= 0) continue;
+			op.fraction[op.nterms] = mixed->fraction[i];
+			op.arg[op.nterms++]    = CompileNode(program, node, mixed->material[i], NULL);
+		}
+	}
+	node[program->nops] = material;
+	program->op[program->nops] = op;
+	return program->nops++;
+}
+
+/* ===========================================================================
+-- Effective medium combination of the nterms components with non-zero
+-- fraction (in their original order)
+--
+-- warm is the dielectric constant found by the previous N-component
+-- Bruggeman solution of this op (0 if none), used as the starting point
+-- and updated.  Successive calls in a sweep differ only slightly in
+-- wavelength or temperature, so Newton converges in a few steps.
+=========================================================================== */
+static COMPLEX MixEMA(EMA_MODEL model, int nterms, double *fraction, COMPLEX *ni, COMPLEX *warm) {
+	COMPLEX n, b, e1, e2, f, ei[MAX_MIX_TERMS];
+	static COMPLEX one={1.0,0.0}, two={2.0,0.0}, three={3.0,0.0}, four={4.0,0.0}, eight={8.0,0.0};
+	int i, first_term, last_term, host;
+	BOOL ok;
+
+	first_term = 0; last_term = nterms-1;
+	if (nterms == 0) {
+		fprintf(stderr, "ERROR: No element has any fraction - returning air\n");
+		n.x = 1; n.y = 0;
+	/* Simple one component written in complex form */
+	} else if (nterms == 1) {								/* Defined as mixture but only one there */
+		n = ni[first_term];
+	/* Series weighted average */
+	} else if (model == SERIES) {							/* Weighted fraction summation */
+		n.x = n.y = 0;
+		for (i=0; i<nterms; i++) {
+			e1 = ni[i];
+			e1 = CMUL(e1,e1);									/* Go to dielectric constant */
+			n.x += fraction[i]*e1.x;
+			n.y += fraction[i]*e1.y;
+		}
+		n = CCSQRT(n); if (n.x < 0) { n.x = -n.x; n.y = -n.y; }
+	/* Parallel weighted average */
+	} else if (model == PARALLEL) {
+		n.x = n.y = 0;
+		for (i=0; i<nterms; i++) {
+			f.x  = fraction[i]; f.y = 0;						/* Fraction */
+			n = CADD(n, CDIV(f, CMUL(ni[i],ni[i])));
+		}
+		n = CDIV(one, n);										/* Invert */
+		n = CCSQRT(n); if (n.x < 0) { n.x = -n.x; n.y = -n.y; }
+	/* Looyenga - H. Looyenga, "Dielectric constants of heterogeneous mixtures", Physica 31, 401-406 (1965) */
+	} else if (model == LOOYENGA) {
+		n.x = n.y = 0;
+		for (i=0; i<nterms; i++) {
+			f.x  = fraction[i]; f.y = 0;						/* Fraction */
+			n = CADD(n, CMUL(f, CPOW(ni[i],2.0/3.0)));			/* epsilon^(1/3) from n */
+		}
+		n = CPOW(n, 1.5);													/* sqrt(sum^3) */
+		if (n.x < 0) { n.x = -n.x; n.y = -n.y; }
+	/* Maxwell-Garnett mixing */
+	} else if (nterms == 2 && model == MAXWELL_GARNETT) {
+		if (fraction[first_term] < fraction[last_term]) {
+			f.x = fraction[first_term]; f.y = 0;
+			e1  = ni[first_term]; 		/* Minority phase (inclusion) */
+			e2  = ni[last_term];			/* Majority phase (matrix) */
+		} else {
+			f.x = fraction[last_term]; f.y = 0;
+			e1  = ni[last_term];			/* Minority phase (inclusion) */
+			e2  = ni[first_term];		/* Majority phase (matrix) */
+		}
+		e1 = CMUL(e1,e1);	e2 = CMUL(e2,e2);				/* Go to dielectric constant */
+		n = CDIV ( CSUB(CMUL(e1,CADD(one,CMUL(two,f))),CMUL(e2,CSUB(CMUL(two,f),two))),
+					  CADD(CMUL(e2,CADD(two,f)),CMUL(e1,CSUB(one,f))) );
+		n = CMUL(e2, n);
+		n = CCSQRT(n); if (n.x < 0) { n.x = -n.x; n.y = -n.y; }
+	/* Maxwell-Garnett with several inclusion phases in the majority host
+	--   (e-eh)/(e+2eh) = sum_i f_i (ei-eh)/(ei+2eh) = S  ==> e = eh (1+2S)/(1-S) */
+	} else if (model == MAXWELL_GARNETT) {
+		host = 0;
+		for (i=1; i<nterms; i++) if (fraction[i] > fraction[host]) host = i;
+		e2 = CMUL(ni[host],ni[host]);
+		b.x = b.y = 0;
+		for (i=0; i<nterms; i++) {
+			if (i == host) continue;
+			f.x = fraction[i]; f.y = 0;
+			e1 = CMUL(ni[i],ni[i]);
+			b = CADD(b, CMUL(f, CDIV(CSUB(e1,e2), CADD(e1,CMUL(two,e2)))));
+		}
+		n = CMUL(e2, CDIV(CADD(one,CMUL(two,b)), CSUB(one,b)));
+		n = CCSQRT(n); if (n.x < 0) { n.x = -n.x; n.y = -n.y; }
+	/* Bruggeman model */
+	} else if (nterms == 2 && model == BRUGGEMAN) {
+		f.x = fraction[first_term]; f.y = 0;
+		e1 = ni[first_term]; e1 = CMUL(e1,e1);			/* Work in dielectric constant */
+		e2 = ni[last_term];	e2 = CMUL(e2,e2);			/* Work in dielectric constant */
+		b = CADD(CMUL(e1,CSUB(CMUL(three,f),one)), CMUL(e2,CSUB(two,CMUL(three,f))));	/* Actually -b in quadratic */
+		n = CCSQRT(CADD(CMUL(b,b),CMUL(eight,CMUL(e1,e2))));
+		f = CDIV(CSUB(b,n),four);									/* Other root */
+		n = CDIV(CADD(n,b),four);
+		if (n.y > 0 && e1.y <= 0 && e2.y <= 0) n = f;			/* Lossy components give a lossy mix */
+		n = CCSQRT(n); if (n.x < 0) { n.x = -n.x; n.y = -n.y; }
+	/* Bruggeman, N components: no closed form, so iterate from the last solution */
+	} else if (model == BRUGGEMAN) {
+		for (i=0; i<nterms; i++) ei[i] = CMUL(ni[i],ni[i]);
+		ok = FALSE;
+		if (warm->x != 0 || warm->y != 0) n = Bruggeman(nterms, fraction, ei, *warm, &ok);
+		if (! ok) {													/* Cold start from Looyenga */
+			n.x = n.y = 0;
+			for (i=0; i<nterms; i++) {
+				f.x = fraction[i]; f.y = 0;
+				n = CADD(n, CMUL(f, CPOW(ni[i],2.0/3.0)));
+			}
+			n = CPOW(n, 3.0);
+			n = Bruggeman(nterms, fraction, ei, n, &ok);
+			if (! ok) fprintf(stderr, "WARNING: Bruggeman EMA did not converge (epsilon %g %g)\n", n.x, n.y);
+		}
+		*warm = n;
+		n = CCSQRT(n); if (n.x < 0) { n.x = -n.x; n.y = -n.y; }
+	} else {
+		fprintf(stderr, "ERROR: Unimplemented Effective Medium Approximation model (%d)\n", model);
+		n.x = 1; n.y = 0;
+	}
+	return n;
+}
+
+/* ===========================================================================
+-- Newton solution of the Bruggeman self-consistency condition
+--     F(e) = sum_i f_i (ei-e)/(ei+2e) = 0,  F'(e) = -3 sum_i f_i ei/(ei+2e)^2
+--
+-- Inputs: nterms, fraction - components with non-zero fraction
+--         ei               - component dielectric constants
+--         start            - starting estimate of e
+--
+-- Output: *ok - TRUE if converged to the physical root, which (n-ik
+--               convention) has Im(e) <= 0 when every Im(ei) <= 0
+--
+-- Return: e
+=========================================================================== */
+static COMPLEX Bruggeman(int nterms, double *fraction, COMPLEX *ei, COMPLEX start, BOOL *ok) {
+	COMPLEX e, d, t, F, dF;
+	static COMPLEX three={3.0,0.0};
+	double ymax;
+	int i, iter;
+
+	e = start;
+	*ok = FALSE;
+	for (iter=0; iter<50; iter++) {
+		F.x = F.y = dF.x = dF.y = 0;
+		for (i=0; i<nterms; i++) {
+			d = CADD(ei[i], CADD(e,e));							/* ei + 2e */
+			t = CDIV(CSUB(ei[i],e), d);
+			F.x  += fraction[i]*t.x; F.y += fraction[i]*t.y;
+			t = CDIV(ei[i], CMUL(d,d));
+			dF.x += fraction[i]*t.x; dF.y += fraction[i]*t.y;
+		}
+		dF = CMUL(three, dF);									/* -F' */
+		if (dF.x == 0 && dF.y == 0) return e;
+		d = CDIV(F, dF);
+		e = CADD(e, d);
+		if (CABS(d) <= 1E-13*CABS(e)) { *ok = TRUE; break; }
+	}
+	if (! *ok) return e;
+
+/* Reject the unphysical (gain) root */
+	ymax = ei[0].y;
+	for (i=1; i<nterms; i++) if (ei[i].y > ymax) ymax = ei[i].y;
+	if (ymax <= 0 && e.y > 1E-10*CABS(e)) *ok = FALSE;
+	return e;
+}
+
+/* ===========================================================================
+-- Does n,k of the material (or any mixture component) depend on temperature
+=========================================================================== */
+BOOL TFOC_HasTemperature(TFOC_MATERIAL *material) {
+	int i;
+
+	if (material->thermal != NULL) return TRUE;
+	if (material->mixed == NULL) return FALSE;
+	for (i=0; i<MAX_MIX_TERMS; i++) {
+		if (material->mixed->fraction[i] > 0 && TFOC_HasTemperature(material->mixed->material[i])) return TRUE;
+	}
+	return FALSE;
+}
+
 /* ===========================================================================
 -- Print the values at common wavelengths
 --
@@ -399,14 +1863,19 @@ void TFOC_PrintMaterials(void) {
 
 	int i;
 	COMPLEX n;
+	MATERIAL_SLAB *slab;
+	TFOC_MATERIAL *now;
 
-	for (i=0; i<num_materials; i++) {
-		fprintf(stderr, "%-10s:", materials[i].name);
-		n = TFOC_FindNK(materials+i, 1064.0); fprintf(stderr, "  %f %f", n.x, n.y);
-		n = TFOC_FindNK(materials+i,  632.0); fprintf(stderr, "  %f %f", n.x, n.y);
-		n = TFOC_FindNK(materials+i,  532.0); fprintf(stderr, "  %f %f", n.x, n.y);
-		n = TFOC_FindNK(materials+i,  308.0); fprintf(stderr, "  %f %f", n.x, n.y);
-		fprintf(stderr, "\n");
+	for (slab=slab_first; slab!=NULL; slab=slab->next) {
+		for (i=0; i<slab->used; i++) {
+			now = slab->rec+i;
+			fprintf(stderr, "%-10s:", now->name);
+			n = TFOC_FindNK(now, 1064.0); fprintf(stderr, "  %f %f", n.x, n.y);
+			n = TFOC_FindNK(now,  632.0); fprintf(stderr, "  %f %f", n.x, n.y);
+			n = TFOC_FindNK(now,  532.0); fprintf(stderr, "  %f %f", n.x, n.y);
+			n = TFOC_FindNK(now,  308.0); fprintf(stderr, "  %f %f", n.x, n.y);
+			fprintf(stderr, "\n");
+		}
 	}
 	return;
 }
@@ -27,16 +27,89 @@
 /* ------------------------------- */
 #define	panic			SysPanic(__FILE__, __LINE__)
 
+#ifndef PATH_MAX
+	#define	PATH_MAX	(260)
+#endif
+
+/* ---------------------------------------------------------------------------
+-- A tabulated depth profile (profile <file>) is read once and shared by all
+-- rows naming the file.  Each column is interpolated with a monotone cubic
+-- (PCHIP, Fritsch-Carlson slopes).  Unlike a spline it never leaves the
+-- range of the two data points of an interval, so step-like SIMS or TCAD
+-- data cannot ring through zero and change the carrier type.  The cubic is
+-- integrated exactly, and the running integral at each data point makes
+-- the mean over any depth range (one sublayer) O(1).
+--------------------------------------------------------------------------- */
+#define	PROFILE_DOPING			(0)					/* Columns after the depth */
+#define	PROFILE_TEMPERATURE	(1)
+
+struct _TFOC_PROFILE {
+	TFOC_PROFILE *next;								/* Other files loaded */
+	char *fname;										/* Path as opened */
+	int npt, ncol;										/* Data points, columns after depth */
+	double *z;											/* Depths (nm), increasing */
+	double *y[2], *d[2];								/* Doping, temperature and slopes */
+	double *sum[2];									/* Integral from z[0] to each z[i] */
+	int cursor;											/* Interval of the last lookup */
+};
+
+/* ---------------------------------------------------------------------------
+-- TFOC_MakeLayers remembers what each sample row looked like when it was
+-- last expanded (and, for doped rows, the temperature, wavelength and
+-- activation limits used for the free carrier k), and where its sublayers
+-- went.  A row that is unchanged, and still expands to the same place, is
+-- left as it is in layers[].  A copy of the previous layers[] gives the
+-- count of entries that differ, which callers use to skip a point outright
+-- when nothing moved (the matrices themselves are always recomputed).
+--
+-- A graded row is one layer whose profile is evaluated from the snapshot
+-- of the row by GradedIndex (the GRADED_ROW, base first, is the
+-- TFOC_GRADED its layer points at).
+--------------------------------------------------------------------------- */
+typedef struct _GRADED_ROW {
+	TFOC_GRADED base;									/* Must be first (callback pointer) */
+	TFOC_SAMPLE *sam;									/* Row snapshot below */
+	double T, lambda;									/* For the free carrier k */
+	FC_MODE fc_mode;
+	double k0;											/* Free carrier k at the front */
+	COMPLEX dgrade;									/* n(grade) - n at lambda */
+} GRADED_ROW;
+
+typedef struct _ROW_STATE {
+	TFOC_SAMPLE sam;									/* Row as last expanded */
+	double T, lambda, cpmax, cnmax, tol;		/* Globals used (doped rows only) */
+	int first, count;									/* Sublayers produced */
+	double lref;										/* Wavelength step of the plan below */
+	int nsub, ngroup, dim_group, *group;		/* Adaptive count, merged run lengths */
+	GRADED_ROW grade;									/* Profile of a graded row */
+	int rebuilt;										/* Expanded on this call */
+} ROW_STATE;
+
 /* ------------------------------- */
 /* My external function prototypes */
 /* ------------------------------- */
 TFOC_SAMPLE *TFOC_LoadSample(char *fname);
-void TFOC_MakeLayers(TFOC_SAMPLE *sample, TFOC_LAYER *layers, double T, double lambda);
+int TFOC_MakeLayers(TFOC_SAMPLE *sample, TFOC_LAYER *layers, double T, double lambda);
+int TFOC_CountLayers(TFOC_SAMPLE *sample);
+void TFOC_SetSublayerTolerance(double tolerance);
 void TFOC_PrintDetail(TFOC_SAMPLE *sample, TFOC_LAYER *layers);
 
 /* ------------------------------- */
 /* My internal function prototypes */
 /* ------------------------------- */
+static int Sublayers(TFOC_SAMPLE *sam, double T, double lambda, FC_MODE fc_mode);
+static TFOC_LAYER *MergeSublayers(TFOC_LAYER *first, TFOC_LAYER *end, double eps, double T, double lambda, FC_MODE fc_mode, ROW_STATE *row);
+static double ProfileDoping(TFOC_SAMPLE *sam, double u);
+static BOOL IsGraded(TFOC_SAMPLE *sam);
+static COMPLEX GradedIndex(TFOC_GRADED *graded, double u);
+static double KVariation(TFOC_SAMPLE *sam, double T, double lambda, FC_MODE fc_mode);
+static TFOC_PROFILE *LoadProfile(char *fname, char *sample_fname);
+static double ProfileValue(TFOC_PROFILE *prof, int col, double depth);
+static double ProfileMean(TFOC_PROFILE *prof, int col, double a, double b);
+static double ProfileIntegral(TFOC_PROFILE *prof, int col, double depth);
+static int ProfileInterval(TFOC_PROFILE *prof, double depth);
+static void ProfileSlopes(int npt, double *x, double *y, double *d);
+static double ProfileEndSlope(double h0, double h1, double s0, double s1);
 
 /* ------------------------------- */
 /* My usage of other external fncs */
@@ -45,6 +118,19 @@ void TFOC_PrintDetail(TFOC_SAMPLE *sample, TFOC_LAYER *layers);
 /* ------------------------------- */
 /* Locally defined global vars     */
 /* ------------------------------- */
+static struct {
+	TFOC_SAMPLE *sample;								/* Arrays the state refers to */
+	TFOC_LAYER *layers;
+	ROW_STATE *row;
+	int nrows;
+	TFOC_LAYER *prev;									/* layers[] after the last call */
+	int nprev, dim_prev;
+} made = { NULL };
+
+static double sub_tol=0;										/* Adaptive sublayers if > 0 */
+static TFOC_PROFILE *profiles = NULL;						/* Depth profiles loaded */
+#define	SUBLAYER_STEPS	(8)									/* Design wavelengths per octave */
+#define	SUBLAYER_LOW	(0.9170040432046712)				/* 2^(-1/SUBLAYER_STEPS), bottom of a step */
 
 /* ------------------------------- */
 /* My share of global vars         */
@@ -57,22 +143,121 @@ double cpmax = 1E20, cnmax=3E20;				/* Maximum activated concentrations n and p
 -- Convert the high level sample description into a number of fundamental
 -- layers to run in Fresnel.  The layers need only n and z, but also include
 -- the material name for debugging.  Expand the doping profiles in this routine.
+--
+-- Usage: int TFOC_MakeLayers(TFOC_SAMPLE *sample, TFOC_LAYER *layers, double T, double lambda);
+--
+-- Inputs: sample - sample rows, with the n,k of each at lambda already set
+--         layers - space for the expansion (same array from call to call
+--                  to benefit from the incremental update)
+--         T      - temperature (K) for rows without their own
+--         lambda - wavelength (nm)
+--
+-- Output: layers[] - expansion.  Rows not changed since the last call with
+--                    the same arrays are not re-expanded.
+--
+-- Return: Number of layers[] entries whose n, z or structure differs from
+--         the previous call (all of them on the first).  0 means a result
+--         at the same angle and wavelength can be reused as is.
 =========================================================================== */
-void TFOC_MakeLayers(TFOC_SAMPLE *sample, TFOC_LAYER *layers, double T, double lambda) {
-	double a,b,peak,posn,doping, dz, w, temperature;
-	int i;
-	TFOC_LAYER *lay;
+int TFOC_MakeLayers(TFOC_SAMPLE *sample, TFOC_LAYER *layers, double T, double lambda) {
+	double a,b,peak,posn,doping, dz, w, temperature, lref=0;
+	int i, nsub, nrows, nlay, nchanged;
+	TFOC_LAYER *lay, *lay0, *blk=NULL;
 	TFOC_SAMPLE *sam;
+	ROW_STATE *row;
 	FC_MODE fc_mode = KLAASSEN_MU;
 
-	int ilay;
+	int ilay, blk_last=0, blk_n=0;
+
+/* State is only valid for the same arrays and number of rows */
+	for (nrows=0; sample[nrows].type!=EOS; nrows++) ;
+	if (sample != made.sample || layers != made.layers || nrows != made.nrows) {
+		for (i=0; i<made.nrows; i++) free(made.row[i].group);
+		free(made.row);
+		made.row    = calloc(nrows+1, sizeof(*made.row));
+		made.sample = sample;
+		made.layers = layers;
+		made.nrows  = nrows;
+		made.nprev  = 0;
+		for (i=0; i<nrows; i++) made.row[i].count = -1;		/* Never expanded */
+	}
 
 	for (ilay=0,sam=sample,lay=layers; sam->type!=EOS; ilay++,sam++) {
 
-		if (sam->type == IGNORE_LAYER) continue;
+/* Periodic blocks are expanded once, with the count kept on the first layer */
+		if (blk != NULL && ilay > blk_last) {
+			if (lay > blk) { blk->repeat = blk_n; blk->repeat_layers = (int) (lay-blk); }
+			blk = NULL;
+		}
+		if (sam->repeat > 1) {
+			blk = lay; blk_last = ilay+sam->repeat_rows-1; blk_n = sam->repeat;
+		}
+
+		row = made.row+ilay;
+		row->rebuilt = FALSE;
+		if (sam->type == IGNORE_LAYER) { row->count = -1; continue; }
 		temperature = (sam->temperature <= 0) ? T : sam->temperature;
+		lay0 = lay;
 
-		switch (sam->doping_profile) {
+/* Unchanged row (inputs, globals if doped, position) - sublayers still valid */
+		if (row->count >= 0 && row->first == (int) (lay-layers) &&
+			 (row->count == 0 || lay->name == sam->name) &&
+			 memcmp(&row->sam, sam, sizeof(*sam)) == 0 &&
+			 (sam->doping_profile == NO_DOPING ||
+			  (row->T == temperature && row->lambda == lambda && row->cpmax == cpmax && row->cnmax == cnmax &&
+				row->tol == sub_tol)) ) {
+			for (i=0; i<row->count; i++,lay++) {			/* May have been the end marker */
+				lay->type   = SUBLAYER;
+				lay->repeat = lay->repeat_layers = 0;
+			}
+			continue;
+		}
+
+/* Adaptive count and merging are planned once per wavelength step */
+		nsub = sam->doping_layers;
+		if (sub_tol > 0 && sam->doping_profile != NO_DOPING && ! IsGraded(sam)) {
+			lref = pow(2.0, ceil(SUBLAYER_STEPS*log(lambda)/log(2.0)-1E-9)/SUBLAYER_STEPS);
+			if (! (row->count >= 0 && row->lref == lref && row->T == temperature && row->tol == sub_tol &&
+					 row->cpmax == cpmax && row->cnmax == cnmax && row->sam.z == sam->z &&
+					 row->sam.doping_profile == sam->doping_profile && row->sam.doping_layers == sam->doping_layers &&
+					 memcmp(row->sam.doping_parms, sam->doping_parms, sizeof(sam->doping_parms)) == 0) ) {
+				row->lref   = lref;
+				row->nsub   = Sublayers(sam, temperature, lref, fc_mode);
+				row->ngroup = 0;										/* Merging not yet decided */
+			}
+			nsub = row->nsub;
+		}
+		memcpy(&row->sam, sam, sizeof(*sam));
+		row->T = temperature; row->lambda = lambda; row->cpmax = cpmax; row->cnmax = cnmax; row->tol = sub_tol;
+		row->first = (int) (lay-layers);
+		row->rebuilt = TRUE;
+
+/* Graded row is one layer, n at the front and the profile from there */
+		if (IsGraded(sam)) {
+			row->grade.base.dn = GradedIndex;
+			row->grade.sam     = &row->sam;
+			row->grade.T       = temperature;
+			row->grade.lambda  = lambda;
+			row->grade.fc_mode = fc_mode;
+			row->grade.dgrade.x = row->grade.dgrade.y = 0;
+			if (sam->grade_material != NULL) row->grade.dgrade = CSUB(sam->n_grade, sam->n);
+			lay->layer  = ilay;
+			lay->type   = SUBLAYER;
+			lay->n      = sam->n;
+			lay->z      = sam->z;
+			lay->name   = sam->name;
+			lay->doping = 0;
+			row->grade.k0 = 0;
+			if (sam->doping_profile != NO_DOPING) {
+				lay->doping = LIMIT_DOPING(ProfileDoping(sam, 0.0));
+				w = temperature;
+				if (sam->doping_profile == TABULATED && sam->profile->ncol > 1)
+					w = ProfileValue(sam->profile, PROFILE_TEMPERATURE, sam->doping_parms[1]);
+				row->grade.k0 = fc_k(lay->doping, 0, w, lambda/1000.0, fc_mode);
+				lay->n.y += -row->grade.k0;
+			}
+			lay++;
+		} else switch (sam->doping_profile) {
 			case NO_DOPING:
 				lay->layer  = ilay;									/* Defining layer	*/
 				lay->type   = SUBLAYER;								/* Type of layer	*/
@@ -93,11 +278,11 @@ void TFOC_MakeLayers(TFOC_SAMPLE *sample, TFOC_LAYER *layers, double T, double l
 				lay++;
 				break;
 			case LINEAR:
-				dz   = sam->z / sam->doping_layers;				/* Width of each layer	*/
+				dz   = sam->z / nsub;									/* Width of each layer	*/
 				a    = sam->doping_parms[0];						/* Front level (/cm^3)	*/
 				b    = sam->doping_parms[1];						/* Back  level (/cm^3)	*/
-				for (i=0; i<sam->doping_layers; i++) {
-					posn = (i+0.5)/sam->doping_layers;			/* Relative position [0,1] */
+				for (i=0; i<nsub; i++) {
+					posn = (i+0.5)/nsub;								/* Relative position [0,1] */
 					doping = a*(1-posn) + b*posn;
 					lay->layer  = ilay;
 					lay->type   = SUBLAYER;
@@ -110,13 +295,13 @@ void TFOC_MakeLayers(TFOC_SAMPLE *sample, TFOC_LAYER *layers, double T, double l
 				}
 				break;
 			case LINEAR_IMPLANT:
-				dz   = sam->z / sam->doping_layers;				/* Width of each layer	*/
+				dz   = sam->z / nsub;									/* Width of each layer	*/
 				a    = sam->doping_parms[1];						/* Front level (a.u.)	*/
 				b    = sam->doping_parms[2];						/* Back  level (a.u.)	*/
 				peak = 2*sam->doping_parms[0]/(sam->z*1E-7) / (a+b);		/* To cm^3	*/
 				a = a*peak; b = b*peak;								/* Front/back conc		*/
-				for (i=0; i<sam->doping_layers; i++) {
-					posn = (i+0.5)/sam->doping_layers;			/* Relative position [0,1] */
+				for (i=0; i<nsub; i++) {
+					posn = (i+0.5)/nsub;								/* Relative position [0,1] */
 					doping = a*(1-posn) + b*posn;
 					lay->layer  = ilay; 
 					lay->type   = SUBLAYER;
@@ -128,12 +313,29 @@ void TFOC_MakeLayers(TFOC_SAMPLE *sample, TFOC_LAYER *layers, double T, double l
 					lay++;
 				}
 				break;
+			case TABULATED:											/* Mean of the file over each sublayer */
+				dz   = sam->z / nsub;									/* Width of each layer	*/
+				for (i=0; i<nsub; i++) {
+					a = sam->doping_parms[1] + i*dz;				/* Depth range in the file */
+					b = sam->doping_parms[1] + (i+1)*dz;
+					doping = sam->doping_parms[0] * ProfileMean(sam->profile, PROFILE_DOPING, a, b);
+					lay->layer  = ilay;
+					lay->type   = SUBLAYER;
+					lay->n      = sam->n;
+					lay->z      = dz;
+					lay->name   = sam->name;
+					lay->doping = LIMIT_DOPING(doping);
+					w = (sam->profile->ncol > 1) ? ProfileMean(sam->profile, PROFILE_TEMPERATURE, a, b) : temperature;
+					lay->n.y += -fc_k(lay->doping, 0, w, lambda/1000.0, fc_mode);
+					lay++;
+				}
+				break;
 			case EXPONENTIAL:											/* Properly handles integral of exponential */
-				dz   = sam->z / sam->doping_layers;				/* Width of each layer	*/
+				dz   = sam->z / nsub;									/* Width of each layer	*/
 				w    = sam->doping_parms[1];						/* 1/e width				*/
 				peak = (sam->doping_parms[0] * (1-exp(-dz/w)) / (1-exp(-sam->z/w))) / (dz*1E-7);
-				for (i=0; i<sam->doping_layers; i++) {
-					posn = (i*sam->z)/sam->doping_layers;		/* Start position of layer */
+				for (i=0; i<nsub; i++) {
+					posn = (i*sam->z)/nsub;							/* Start position of layer */
 					doping = peak*exp(-posn/w);
 					lay->layer  = ilay; 
 					lay->type   = SUBLAYER;
@@ -149,21 +351,532 @@ void TFOC_MakeLayers(TFOC_SAMPLE *sample, TFOC_LAYER *layers, double T, double l
 				fprintf(stderr, "ERROR: Unrecognized case (%d) in doping_profile (layer=%d)\n", sam->doping_profile, ilay);
 				break;
 		}
+		if (sub_tol > 0 && sam->doping_profile != NO_DOPING && sam->z > 0 && ! IsGraded(sam) &&
+			 (sam->doping_profile != TABULATED || sam->profile->ncol == 1))		/* Merge recomputes k at the row T */
+			lay = MergeSublayers(lay0, lay, SUBLAYER_LOW*lref*sub_tol/(pi*sam->z), temperature, lref, fc_mode, row);
+		row->count = (int) (lay-lay0);
+		for (; lay0<lay; lay0++) {
+			lay0->repeat = lay0->repeat_layers = 0;
+			lay0->incoherent = sam->incoherent;
+			lay0->graded = IsGraded(sam) ? &row->grade.base : NULL;
+		}
 	}
 
 /* Identify the first and last elements */
 	layers[0].type = INCIDENT;											/* First will be the incident medium	*/
 	(--lay)->type = EOS;													/* Last will be the exit substrate		*/
 
+/* Count what differs from the last call, and keep this one for the next */
+	nlay = (int) (lay-layers)+1;
+	nchanged = 0;
+	for (i=0; i<nlay; i++) {
+		lay = layers+i;
+		if (i >= made.nprev || lay->type != made.prev[i].type || lay->z != made.prev[i].z ||
+			 lay->n.x != made.prev[i].n.x || lay->n.y != made.prev[i].n.y ||
+			 lay->incoherent != made.prev[i].incoherent ||
+			 lay->graded != made.prev[i].graded || (lay->graded != NULL && made.row[lay->layer].rebuilt) ||
+			 lay->repeat != made.prev[i].repeat || lay->repeat_layers != made.prev[i].repeat_layers) nchanged++;
+	}
+	if (nlay > made.dim_prev) {
+		made.dim_prev = nlay;
+		made.prev = realloc(made.prev, nlay*sizeof(*made.prev));
+	}
+	memcpy(made.prev, layers, nlay*sizeof(*layers));
+	made.nprev = nlay;
+
 #ifdef DEBUG
 	for (i=0,lay=layers; ; i++,lay++) {
 		printf("%d.%d\tz=%g\tn.x=%.5f\tn.y=%.5f\ttype=%d\tdoping=%g\n", lay->layer, i, lay->z, lay->n.x, lay->n.y, lay->type, lay->doping);
 		if (lay->type == EOS) break;
 	}
 #endif
+	return nchanged;
+}
+
+/* ===========================================================================
+-- Set the target error for choosing the number of sublayers of graded
+-- (linear, linear_implant, exponential) doping profiles.  0 (default) uses
+-- the count from the sample file (or its default) as is.
+--
+-- Usage: void TFOC_SetSublayerTolerance(double tolerance);
+--
+-- Inputs: tolerance - approximate error in the reflection amplitude allowed
+--                     for each graded layer
+--
+-- Notes: With a tolerance, the count from the sample file is the maximum.
+--        A staircase of N steps over a layer of thickness z whose index
+--        changes by dn in total reflects each step (dn/N)/2n with an error
+--        of about half its optical phase 2 pi n (z/N)/lambda, so
+--           error ~ pi z |dn| / (2 lambda N)
+--        and N is the smallest count (from a 4/3 ladder) meeting the
+--        tolerance.  Neighboring sublayers are then merged while their k
+--        stays within lambda*tol/(pi z) of the first of the group, which
+--        adds at most half the tolerance again.  Both are decided over a
+--        step of wavelengths, lambda rounded up to one of SUBLAYER_STEPS per
+--        octave and the step below, using the worse end (k(N) saturates at
+--        a doping that depends on lambda).  The expansion so only changes at
+--        those steps in a spectral sweep, and is the same point by point as
+--        batched.
+=========================================================================== */
+void TFOC_SetSublayerTolerance(double tolerance) {
+	sub_tol = (tolerance > 0) ? tolerance : 0;
 	return;
 }
 
+/* ===========================================================================
+-- Number of sublayers for a graded row over the wavelength step ending at
+-- lambda, from the total change in k across it (KVariation).  Tabulated
+-- profiles with a temperature column keep the given count.
+--
+-- Usage: static int Sublayers(TFOC_SAMPLE *sam, double T, double lambda, FC_MODE fc_mode);
+--
+-- Return: Count between 1 and sam->doping_layers
+=========================================================================== */
+static int Sublayers(TFOC_SAMPLE *sam, double T, double lambda, FC_MODE fc_mode) {
+	double dk, n;
+	int i;
+
+	if (sub_tol <= 0 || sam->doping_layers <= 1) return sam->doping_layers;
+	if (sam->doping_profile != LINEAR && sam->doping_profile != LINEAR_IMPLANT && sam->doping_profile != EXPONENTIAL &&
+		 (sam->doping_profile != TABULATED || sam->profile->ncol > 1)) return sam->doping_layers;
+	dk = KVariation(sam, T, lambda, fc_mode);
+	n  = pi*sam->z*dk / (2*lambda*sub_tol);
+	lambda *= SUBLAYER_LOW;
+	dk = KVariation(sam, T, lambda, fc_mode);
+	if (pi*sam->z*dk / (2*lambda*sub_tol) > n) n = pi*sam->z*dk / (2*lambda*sub_tol);
+	if (! (n < sam->doping_layers)) return sam->doping_layers;		/* Also catches NaN */
+	for (i=1; i<n; i+=(i+2)/3) ;												/* 1,2,3,4,6,8,11,15,20,27,... */
+	return (i < sam->doping_layers) ? i : sam->doping_layers;
+}
+
+/* ===========================================================================
+-- Total change in the free carrier k through a graded row.  The analytic
+-- profiles are monotonic, so it is that between the front and back
+-- concentrations.  A tabulated profile is followed through the means of
+-- its doping_layers cells (peaks and junctions count on both sides).
+--
+-- Usage: static double KVariation(TFOC_SAMPLE *sam, double T, double lambda, FC_MODE fc_mode);
+=========================================================================== */
+static double KVariation(TFOC_SAMPLE *sam, double T, double lambda, FC_MODE fc_mode) {
+	double front, back, dz, k, klast, dk;
+	int i;
+
+	if (sam->doping_profile != TABULATED) {
+		front = LIMIT_DOPING(ProfileDoping(sam, 0.0));
+		back  = LIMIT_DOPING(ProfileDoping(sam, 1.0));
+		return fabs(fc_k(front, 0, T, lambda/1000.0, fc_mode) - fc_k(back, 0, T, lambda/1000.0, fc_mode));
+	}
+	dz = sam->z / sam->doping_layers;
+	for (dk=klast=0,i=0; i<sam->doping_layers; i++) {
+		front = sam->doping_parms[1] + i*dz;
+		k = fc_k(LIMIT_DOPING(sam->doping_parms[0]*ProfileMean(sam->profile, PROFILE_DOPING, front, front+dz)), 0, T, lambda/1000.0, fc_mode);
+		if (i > 0) dk += fabs(k-klast);
+		klast = k;
+	}
+	return dk;
+}
+
+/* ===========================================================================
+-- Merge runs of neighboring sublayers whose free carrier k at both ends of
+-- the wavelength step ending at lambda stays within eps of the first of the
+-- run into one layer with the thickness weighted n,k.  The run lengths are
+-- kept in the row state and reused until the plan is reset.
+--
+-- Usage: static TFOC_LAYER *MergeSublayers(TFOC_LAYER *first, TFOC_LAYER *end, double eps,
+--                                          double T, double lambda, FC_MODE fc_mode, ROW_STATE *row);
+--
+-- Inputs: first, end - sublayers of one row [first,end)
+--         eps        - allowed difference in k
+--         T, lambda  - temperature (K) and top of the wavelength step (nm)
+--         fc_mode    - free carrier model
+--         row        - state of the row (ngroup == 0 to decide the runs)
+--
+-- Return: New end of the row's sublayers
+=========================================================================== */
+static TFOC_LAYER *MergeSublayers(TFOC_LAYER *first, TFOC_LAYER *end, double eps, double T, double lambda, FC_MODE fc_mode, ROW_STATE *row) {
+	TFOC_LAYER *src, *dst;
+	double k0, k1, k, kl, z, low;
+	int i, n;
+
+	if (end-first < 2) return end;
+
+/* Runs already decided for this step */
+	if (row->ngroup > 0) {
+		for (dst=src=first,i=0; i<row->ngroup; i++,dst++) {
+			*dst = *(src++);
+			for (n=1; n<row->group[i]; n++,src++) {
+				z = dst->z + src->z;
+				dst->n.x    = (dst->n.x*dst->z + src->n.x*src->z) / z;
+				dst->n.y    = (dst->n.y*dst->z + src->n.y*src->z) / z;
+				dst->doping = (dst->doping*dst->z + src->doping*src->z) / z;
+				dst->z = z;
+			}
+		}
+		return dst;
+	}
+
+	if (row->dim_group < end-first) {
+		row->dim_group = (int) (end-first);
+		row->group = realloc(row->group, row->dim_group*sizeof(*row->group));
+	}
+	row->group[0] = 1;
+	lambda /= 1000.0;
+	low = SUBLAYER_LOW*lambda;
+	dst = first;
+	k0 = fc_k(first->doping, 0, T, lambda, fc_mode);
+	k1 = fc_k(first->doping, 0, T, low, fc_mode);
+	for (src=first+1; src<end; src++) {
+		k  = fc_k(src->doping, 0, T, lambda, fc_mode);
+		kl = fc_k(src->doping, 0, T, low, fc_mode);
+		if (fabs(k-k0) < eps && fabs(kl-k1) < eps) {
+			row->group[dst-first]++;
+			z = dst->z + src->z;
+			dst->n.x    = (dst->n.x*dst->z + src->n.x*src->z) / z;
+			dst->n.y    = (dst->n.y*dst->z + src->n.y*src->z) / z;
+			dst->doping = (dst->doping*dst->z + src->doping*src->z) / z;
+			dst->z = z;
+		} else {
+			*(++dst) = *src;
+			row->group[dst-first] = 1;
+			k0 = k; k1 = kl;
+		}
+	}
+	row->ngroup = (int) (dst-first)+1;
+	return dst+1;
+}
+
+/* ===========================================================================
+-- Concentration of a row's doping profile at fractional depth u (0 front,
+-- 1 back) before the activation limits.  The staircases of TFOC_MakeLayers
+-- average this over each sublayer.
+--
+-- Usage: static double ProfileDoping(TFOC_SAMPLE *sam, double u);
+--
+-- Return: Doping (/cm^3), 0 if the row is undoped
+=========================================================================== */
+static double ProfileDoping(TFOC_SAMPLE *sam, double u) {
+	double peak, w;
+
+	switch (sam->doping_profile) {
+		case CONSTANT:
+			return sam->doping_parms[0];
+		case LINEAR:
+			return sam->doping_parms[0]*(1-u) + sam->doping_parms[1]*u;
+		case LINEAR_IMPLANT:
+			peak = 2*sam->doping_parms[0]/(sam->z*1E-7) / (sam->doping_parms[1]+sam->doping_parms[2]);
+			return peak*(sam->doping_parms[1]*(1-u) + sam->doping_parms[2]*u);
+		case EXPONENTIAL:
+			w = sam->doping_parms[1];
+			peak = sam->doping_parms[0] / (1-exp(-sam->z/w)) / (w*1E-7);
+			return peak*exp(-u*sam->z/w);
+		case TABULATED:
+			return sam->doping_parms[0] * ProfileValue(sam->profile, PROFILE_DOPING, sam->doping_parms[1]+u*sam->z);
+		default:
+			return 0;
+	}
+}
+
+/* ===========================================================================
+-- Is the row expanded as one continuously graded layer?  Needs the graded
+-- option, a thickness, and something to grade (a back material or a doping
+-- profile that varies with depth).
+--
+-- Usage: static BOOL IsGraded(TFOC_SAMPLE *sam);
+=========================================================================== */
+static BOOL IsGraded(TFOC_SAMPLE *sam) {
+	if (! sam->graded || sam->incoherent || sam->z <= 0) return FALSE;
+	return sam->grade_material != NULL || sam->doping_profile == LINEAR ||
+			 sam->doping_profile == LINEAR_IMPLANT || sam->doping_profile == EXPONENTIAL || sam->doping_profile == TABULATED;
+}
+
+/* ===========================================================================
+-- Profile callback for graded layers (TFOC_GRADED dn).  The composition
+-- varies linearly in n,k from the row material to the grade material, and
+-- the free carrier k follows the doping profile (and the temperature of a
+-- tabulated profile that has one).
+--
+-- Usage: static COMPLEX GradedIndex(TFOC_GRADED *graded, double u);
+--
+-- Inputs: graded - &row->grade.base of the layer's row
+--         u      - fractional depth in the layer [0,1]
+--
+-- Return: n(u)-n(0)
+=========================================================================== */
+static COMPLEX GradedIndex(TFOC_GRADED *graded, double u) {
+	GRADED_ROW *grade = (GRADED_ROW *) graded;
+	TFOC_SAMPLE *sam = grade->sam;
+	COMPLEX dn;
+	double doping, T;
+
+	dn.x = grade->dgrade.x*u;
+	dn.y = grade->dgrade.y*u;
+	if (sam->doping_profile != NO_DOPING) {
+		doping = LIMIT_DOPING(ProfileDoping(sam, u));
+		T = grade->T;
+		if (sam->doping_profile == TABULATED && sam->profile->ncol > 1)
+			T = ProfileValue(sam->profile, PROFILE_TEMPERATURE, sam->doping_parms[1]+u*sam->z);
+		dn.y -= fc_k(doping, 0, T, grade->lambda/1000.0, grade->fc_mode) - grade->k0;
+	}
+	return dn;
+}
+
+/* ===========================================================================
+-- Load a depth profile file (profile <file>), or find it already loaded.
+-- Lines not starting with a number are comments.  Each data line is
+--    <depth> [units]  <doping>  [<temperature>]
+-- with depth as for layer thicknesses (default nm), doping in /cm^3
+-- (negative for n-type) and temperature in K.  Commas may separate values.
+--
+-- Usage: static TFOC_PROFILE *LoadProfile(char *fname, char *sample_fname);
+--
+-- Inputs: fname        - profile file name
+--         sample_fname - sample file, whose directory is also searched for
+--                        a relative fname (may be NULL)
+--
+-- Return: Pointer to the shared profile, or NULL on error (message given)
+--
+-- Notes: Profiles are shared by the path actually opened, so the same name
+--        in samples from different directories can be different files.
+=========================================================================== */
+static TFOC_PROFILE *LoadProfile(char *fname, char *sample_fname) {
+	TFOC_PROFILE *prof;
+	FILE *funit = NULL;
+	char *line=NULL, path[PATH_MAX], *aptr, *bptr;
+	double *x=NULL, *y[2]={NULL,NULL}, v[2], z;
+	size_t linelen=0;
+	int i, n, ncol, dim=0, npt=0, rc;
+
+/* Open as given, else relative to the sample file */
+	strcpy_s(path, sizeof(path), fname);
+	rc = fopen_s(&funit, path, "r");
+	if (rc != 0 && sample_fname != NULL && strchr("/\\", *fname) == NULL) {
+		strcpy_s(path, sizeof(path), sample_fname);
+		aptr = strrchr(path, '/');
+		if ( (bptr = strrchr(path, '\\')) != NULL && (aptr == NULL || bptr > aptr)) aptr = bptr;
+		if (aptr != NULL) {
+			aptr[1] = '\0';
+			if (strcat_s(path, sizeof(path), fname) == 0) rc = fopen_s(&funit, path, "r");
+		}
+	}
+	if (rc != 0) {
+		fprintf(stderr, "ERROR: Depth profile file \"%s\" does not exist (rc = %d)\n", fname, rc);
+		return NULL;
+	}
+
+	for (prof=profiles; prof!=NULL; prof=prof->next) {
+		if (strcmp(prof->fname, path) == 0) { fclose(funit); return prof; }
+	}
+
+	ncol = 0;
+	while (TFOC_ReadLine(funit, &line, &linelen) != NULL) {
+		for (aptr=line; *aptr; aptr++) if (*aptr == ',') *aptr = ' ';
+		aptr = line; while (isspace(*aptr)) aptr++;
+		if (*aptr == '\0' || strchr("0123456789.+-", *aptr) == NULL) continue;
+
+		z = get_nm_value(aptr, &aptr, 0.0);
+		for (n=0; n<2; n++) {
+			v[n] = strtod(aptr, &bptr);
+			if (bptr == aptr) break;
+			aptr = bptr;
+		}
+		if (n == 0 || (ncol != 0 && n != ncol) || (npt > 0 && z <= x[npt-1])) {
+			fprintf(stderr, "ERROR: Depth profile \"%s\" needs increasing depths with the same number of values on each line\n\t\"%s\"\n", fname, line);
+			goto BadProfile;
+		}
+		ncol = n;
+		if (npt >= dim) {
+			dim += 256;
+			x    = realloc(x,    dim*sizeof(*x));
+			y[0] = realloc(y[0], dim*sizeof(*y[0]));
+			y[1] = realloc(y[1], dim*sizeof(*y[1]));
+		}
+		x[npt] = z;
+		for (n=0; n<ncol; n++) y[n][npt] = v[n];
+		npt++;
+	}
+	if (npt < 2) {
+		fprintf(stderr, "ERROR: Depth profile \"%s\" needs at least two depths\n", fname);
+		goto BadProfile;
+	}
+	fclose(funit); funit = NULL;
+	free(line);
+
+	prof = calloc(1, sizeof(*prof));
+	prof->fname = malloc(strlen(path)+1);
+	strcpy_s(prof->fname, strlen(path)+1, path);
+	prof->npt   = npt;
+	prof->ncol  = ncol;
+	prof->z     = x;
+	for (n=0; n<ncol; n++) {
+		prof->y[n]   = y[n];
+		prof->d[n]   = malloc(npt*sizeof(*prof->d[n]));
+		prof->sum[n] = malloc(npt*sizeof(*prof->sum[n]));
+		ProfileSlopes(npt, x, y[n], prof->d[n]);
+		for (prof->sum[n][0]=0,i=1; i<npt; i++) {				/* Exact integral of each cubic */
+			z = x[i]-x[i-1];
+			prof->sum[n][i] = prof->sum[n][i-1] + z*(y[n][i-1]+y[n][i])/2 + z*z*(prof->d[n][i-1]-prof->d[n][i])/12;
+		}
+	}
+	if (ncol < 2) free(y[1]);
+
+	prof->next = profiles;
+	profiles = prof;
+	return prof;
+
+BadProfile:
+	if (funit != NULL) fclose(funit);
+	free(line);
+	free(x); free(y[0]); free(y[1]);
+	return NULL;
+}
+
+/* ===========================================================================
+-- Value of a depth profile column, held constant beyond the data
+--
+-- Usage: static double ProfileValue(TFOC_PROFILE *prof, int col, double depth);
+--
+-- Inputs: prof  - profile from LoadProfile
+--         col   - PROFILE_DOPING or PROFILE_TEMPERATURE
+--         depth - depth in the file (nm)
+--
+-- Return: Interpolated value at depth
+=========================================================================== */
+static double ProfileValue(TFOC_PROFILE *prof, int col, double depth) {
+	double h, t, *y, *d;
+	int i;
+
+	if (depth <= prof->z[0]) return prof->y[col][0];
+	if (depth >= prof->z[prof->npt-1]) return prof->y[col][prof->npt-1];
+	i = ProfileInterval(prof, depth);
+	y = prof->y[col]+i; d = prof->d[col]+i;
+	h = prof->z[i+1]-prof->z[i];
+	t = (depth-prof->z[i]) / h;
+	return (1-t)*(1-t)*((1+2*t)*y[0] + t*h*d[0]) + t*t*((3-2*t)*y[1] - (1-t)*h*d[1]);
+}
+
+/* ===========================================================================
+-- Mean of a depth profile column over [a,b] from its running integral
+--
+-- Usage: static double ProfileMean(TFOC_PROFILE *prof, int col, double a, double b);
+--
+-- Inputs: prof - profile from LoadProfile
+--         col  - PROFILE_DOPING or PROFILE_TEMPERATURE
+--         a,b  - depth range in the file (nm), a <= b
+--
+-- Return: Mean value over the range (the value at a if a == b)
+=========================================================================== */
+static double ProfileMean(TFOC_PROFILE *prof, int col, double a, double b) {
+	if (b <= a) return ProfileValue(prof, col, a);
+	return (ProfileIntegral(prof, col, b) - ProfileIntegral(prof, col, a)) / (b-a);
+}
+
+/* ===========================================================================
+-- Integral of a profile column from its first depth: the running sum to
+-- the start of the interval plus the cubic integrated over the part of it,
+-- extended with the end values beyond the data
+=========================================================================== */
+static double ProfileIntegral(TFOC_PROFILE *prof, int col, double depth) {
+	double h, t, t2, *y, *d;
+	int i, n = prof->npt;
+
+	if (depth <= prof->z[0]) return (depth-prof->z[0])*prof->y[col][0];
+	if (depth >= prof->z[n-1]) return prof->sum[col][n-1] + (depth-prof->z[n-1])*prof->y[col][n-1];
+	i = ProfileInterval(prof, depth);
+	y = prof->y[col]+i; d = prof->d[col]+i;
+	h = prof->z[i+1]-prof->z[i];
+	t = (depth-prof->z[i]) / h; t2 = t*t;
+	return prof->sum[col][i] + h*( y[0]*(t - t2*t + t2*t2/2) + y[1]*(t2*t - t2*t2/2) +
+											 h*d[0]*(t2/2 - 2*t2*t/3 + t2*t2/4) + h*d[1]*(t2*t2/4 - t2*t/3) );
+}
+
+/* ===========================================================================
+-- Interval i of a profile with z[i] <= depth < z[i+1] (z[0] < depth <
+-- z[npt-1]).  Sublayers walk through the profile in order, so the last
+-- interval or its neighbour is tried before bisecting.
+=========================================================================== */
+static int ProfileInterval(TFOC_PROFILE *prof, double depth) {
+	int lo, hi, mid;
+
+	lo = prof->cursor;
+	if (lo < prof->npt-1 && prof->z[lo] <= depth) {
+		if (depth < prof->z[lo+1]) return lo;
+		if (lo+2 < prof->npt && depth < prof->z[lo+2]) return (prof->cursor = lo+1);
+	}
+	lo = 0; hi = prof->npt-1;
+	while (hi-lo > 1) {
+		mid = (lo+hi)/2;
+		if (prof->z[mid] <= depth) { lo = mid; } else { hi = mid; }
+	}
+	return (prof->cursor = lo);
+}
+
+/* ===========================================================================
+-- Slopes for a monotone piecewise cubic Hermite interpolant (PCHIP).  The
+-- slope is zero at a local extremum of the data and otherwise the weighted
+-- harmonic mean of the neighbouring secants, which keeps each interval
+-- between its end values.  The ends use the shape preserving three point
+-- formula.
+=========================================================================== */
+static void ProfileSlopes(int npt, double *x, double *y, double *d) {
+	double h0, h1, s0, s1, w0, w1;
+	int i;
+
+	if (npt == 2) {
+		d[0] = d[1] = (y[1]-y[0]) / (x[1]-x[0]);
+		return;
+	}
+	for (i=1; i<npt-1; i++) {
+		h0 = x[i]-x[i-1];     h1 = x[i+1]-x[i];
+		s0 = (y[i]-y[i-1])/h0; s1 = (y[i+1]-y[i])/h1;
+		if (s0*s1 <= 0) {
+			d[i] = 0;
+		} else {
+			w0 = 2*h1+h0; w1 = h1+2*h0;
+			d[i] = (w0+w1) / (w0/s0 + w1/s1);
+		}
+	}
+	d[0]     = ProfileEndSlope(x[1]-x[0], x[2]-x[1], (y[1]-y[0])/(x[1]-x[0]), (y[2]-y[1])/(x[2]-x[1]));
+	d[npt-1] = ProfileEndSlope(x[npt-1]-x[npt-2], x[npt-2]-x[npt-3],
+										(y[npt-1]-y[npt-2])/(x[npt-1]-x[npt-2]), (y[npt-2]-y[npt-3])/(x[npt-2]-x[npt-3]));
+	return;
+}
+
+static double ProfileEndSlope(double h0, double h1, double s0, double s1) {
+	double d;
+
+	d = ((2*h0+h1)*s0 - h0*s1) / (h0+h1);
+	if (d*s0 <= 0) return 0;
+	if (s0*s1 <= 0 && fabs(d) > fabs(3*s0)) return 3*s0;
+	return d;
+}
+
+/* ===========================================================================
+-- Size of the layers[] array needed by TFOC_MakeLayers for a sample
+--
+-- Usage: int TFOC_CountLayers(TFOC_SAMPLE *sample);
+--
+-- Return: Maximum number of entries TFOC_MakeLayers can fill (graded rows
+--         at their full sublayer count)
+=========================================================================== */
+int TFOC_CountLayers(TFOC_SAMPLE *sample) {
+	int nlayers;
+
+	for (nlayers=0; sample->type != EOS; sample++) {
+		switch (sample->doping_profile) {
+			case NO_DOPING:
+			case CONSTANT:
+				nlayers++;
+				break;
+			case EXPONENTIAL:
+			case LINEAR_IMPLANT:
+			case LINEAR:
+			case TABULATED:
+				nlayers += sample->doping_layers;
+		}
+	}
+	return nlayers;
+}
+
 /* ===========================================================================
 -- Routine to just jump over optional blank space and = signs
 =========================================================================== */
@@ -200,7 +913,10 @@ TFOC_SAMPLE *TFOC_LoadSample(char *fname) {
 	int dim_layers = 0;
 
 	FILE *funit;
-	char line[256], *name, *aptr;
+	char line[256], *name, *aptr, *next, *cptr;
+	int ibrace;
+	int blk_first=-1, blk_n=0, blk_end=-1;				/* Current and last repeat block */
+	BOOL blk_close=FALSE;
 
 	if (fname == NULL) {
 		funit = stdin;
@@ -238,84 +954,184 @@ TFOC_SAMPLE *TFOC_LoadSample(char *fname) {
 			continue;
 		}
 
-		/* Create a slot in the sample structure */
-		if (num_layers+1 >= dim_layers) {							/* Create space if needed! */
-			dim_layers += 20;
-			sample = realloc(sample, dim_layers*sizeof(*sample));
+/* Remove trailing comments (outside any [ ] mixture) */
+		for (ibrace=0,cptr=aptr; *cptr; cptr++) {
+			if (*cptr == '[') ibrace++;
+			if (*cptr == ']') ibrace--;
+			if (ibrace <= 0 && (*cptr == '#' || *cptr == '%' || strncmp(cptr, "/*", 2) == 0 || strncmp(cptr, "//", 2) == 0)) {
+				*cptr = '\0'; break;
+			}
 		}
-		sam = sample+num_layers;										/* This layer					*/
-		memset(sam, 0, sizeof(*sam));									/* Zero out all parameters	*/
 
-		/* Fill in the database for the layer - starting with the material name */
-		TFOC_GetMaterialName(aptr, sam->name, sizeof(sam->name), &aptr);
+/* A line may hold several rows separated by ; and open or close a repeat block */
+		next = aptr;
+		while ( (aptr = next) != NULL) {
+			if ( (next = strchr(aptr, ';')) != NULL) *(next++) = '\0';
+			while (isspace(*aptr)) aptr++;
 
-		sam->material = NULL;											/* No database loaded		*/
-		sam->type     = (num_layers==0)?INCIDENT:SUBLAYER;
+			if (blk_close) {												/* Previous row ended a block */
+				if (num_layers-blk_first > 0 && blk_n > 1) {
+					sample[blk_first].repeat      = blk_n;
+					sample[blk_first].repeat_rows = num_layers-blk_first;
+					blk_end = num_layers-1;
+				}
+				blk_first = -1; blk_close = FALSE;
+			}
 
-		/* Doping profile information */
-		sam->doping_profile  = NO_DOPING;							/* No doping at first		*/
-		sam->doping_layers   = 1;										/* No sublayers				*/
-		sam->temperature     = -1;										/* Temperature undefined	*/
-		for (i=0; i<NPARMS_DOPING; i++) sam->doping_parms[i] = 0;
+			if (_strnicmp(aptr, "repeat", 6) == 0 && (isspace(aptr[6]) || aptr[6] == '=')) {
+				if (blk_first >= 0) { fprintf(stderr, "ERROR: Nested repeat blocks are not supported\n"); goto BadRepeat; }
+				if (num_layers == 0) { fprintf(stderr, "ERROR: Incident medium can not be part of a repeat block\n"); goto BadRepeat; }
+				if ( (aptr = SkipOptEq(aptr+6)) == NULL) goto BadRepeat;
+				blk_n = strtol(aptr, &aptr, 10);
+				while (isspace(*aptr)) aptr++;
+				if (*aptr != '{' || blk_n < 1) { fprintf(stderr, "ERROR: Expected \"repeat <count> {\"\n"); goto BadRepeat; }
+				aptr++;
+				while (isspace(*aptr)) aptr++;
+				blk_first = num_layers;
+			}
+			if ( (cptr = strchr(aptr, '}')) != NULL) {
+				if (blk_first < 0) { fprintf(stderr, "ERROR: Unmatched } in sample structure\n"); goto BadRepeat; }
+				*(cptr++) = '\0';
+				while (isspace(*cptr)) cptr++;
+				if (*cptr != '\0') { fprintf(stderr, "ERROR: Unexpected text following }\n\t\"%s\"\n", cptr); goto BadRepeat; }
+				blk_close = TRUE;
+				if (next == NULL) next = cptr;							/* Close is handled with next row */
+			}
+			if (*aptr == '\0') continue;								/* Nothing else on this row */
+
+			/* Create a slot in the sample structure */
+			if (num_layers+1 >= dim_layers) {							/* Create space if needed! */
+				dim_layers += 20;
+				sample = realloc(sample, dim_layers*sizeof(*sample));
+			}
+			sam = sample+num_layers;										/* This layer					*/
+			memset(sam, 0, sizeof(*sam));									/* Zero out all parameters	*/
 
-		/* Next value is the thickness in nm (or other units if specified) */
-		sam->z = get_nm_value(aptr, &aptr, 0.0);				/* Get the thickness */
+			/* Fill in the database for the layer - starting with the material name */
+			TFOC_GetMaterialName(aptr, sam->name, sizeof(sam->name), &aptr);
+
+			sam->material = NULL;											/* No database loaded		*/
+			sam->type     = (num_layers==0)?INCIDENT:SUBLAYER;
+
+			/* Doping profile information */
+			sam->doping_profile  = NO_DOPING;							/* No doping at first		*/
+			sam->doping_layers   = 1;										/* No sublayers				*/
+			sam->temperature     = -1;										/* Temperature undefined	*/
+			for (i=0; i<NPARMS_DOPING; i++) sam->doping_parms[i] = 0;
+
+			/* Next value is the thickness in nm (or other units if specified) */
+			sam->z = get_nm_value(aptr, &aptr, 0.0);				/* Get the thickness */
 
 /* Check for complex doping profiles */
-		while (*aptr != '\0' && *aptr != '\n' && *aptr != '#' && *aptr != '%' && _strnicmp(aptr, "/*", 2) != 0 && _strnicmp(aptr, "//",2) != 0) {
+			while (*aptr != '\0' && *aptr != '\n' && *aptr != '#' && *aptr != '%' && _strnicmp(aptr, "/*", 2) != 0 && _strnicmp(aptr, "//",2) != 0) {
 			
-			if (_strnicmp(aptr, "temperature", 11) == 0) {			/* Layer temperature */
-				if ( (aptr = SkipOptEq(aptr+11)) == NULL) return NULL;
-				sam->temperature = strtod(aptr, &aptr);
-			} else if (_strnicmp(aptr, "temp", 4) == 0) {				/* Layer temperature */
-				if ( (aptr = SkipOptEq(aptr+4)) == NULL) return NULL;
-				sam->temperature = strtod(aptr, &aptr);
-			} else if (_strnicmp(aptr, "t", 1) == 0) {					/* Layer temperature */
-				if ( (aptr = SkipOptEq(aptr+1)) == NULL) return NULL;
-				sam->temperature = strtod(aptr, &aptr);
-
-			} else if (_strnicmp(aptr, "doping",6) == 0) {			/* Simple doping spec		*/
-				if ( (aptr = SkipOptEq(aptr+6)) == NULL) return NULL;
-				sam->doping_profile  = CONSTANT;
-				sam->doping_parms[0] = strtod(aptr, &aptr);			/* Doping level (/cm^3)		*/
-
-			} else if (_strnicmp(aptr, "linear_implant",14)==0) {	/* Linear implant profile	*/
-				if ( (aptr = SkipOptEq(aptr+14)) == NULL) return NULL;
-				sam->doping_profile  = LINEAR_IMPLANT;
-				sam->doping_parms[0] = strtod(aptr, &aptr);			/* Dose (/cm^2)				*/
-				sam->doping_parms[1] = strtod(aptr, &aptr);			/* Front level					*/
-				sam->doping_parms[2] = strtod(aptr, &aptr);			/* Back level					*/
-				sam->doping_layers   = strtol(aptr, &aptr, 10);		/* # sublayers					*/
-				if (sam->doping_layers <= 1) sam->doping_layers = 10;
-
-			} else if (_strnicmp(aptr, "linear",6)==0) {				/* Linear profile				*/
-				if ( (aptr = SkipOptEq(aptr+6)) == NULL) return NULL;
-				sam->doping_profile  = LINEAR;
-				sam->doping_parms[0] = strtod(aptr, &aptr);			/* Front concentration		*/
-				sam->doping_parms[1] = strtod(aptr, &aptr);			/* Back concentration		*/
-				sam->doping_layers   = strtol(aptr, &aptr, 10);		/* # sublayers					*/
-				if (sam->doping_layers <= 1) sam->doping_layers = 10;
-
-			} else if (_strnicmp(aptr, "exponential", 11) == 0) {	/* Exponential profile */
-				if ( (aptr = SkipOptEq(aptr+11)) == NULL) return NULL;
-				sam->doping_profile  = EXPONENTIAL;
-				sam->doping_parms[0] = strtod(aptr, &aptr);			/* Dose (/cm^2)				*/
-				sam->doping_parms[1] = strtod(aptr, &aptr);			/* 1/e width				 	*/
-				sam->doping_layers   = strtol(aptr, &aptr, 10);		/* # sublayers					*/
-				if (sam->doping_layers <= 1) sam->doping_layers = (int) (5*sam->z/sam->doping_parms[1]+1);
+				if (_strnicmp(aptr, "incoherent", 10) == 0) {				/* Thick layer - no interference */
+					aptr += 10;
+					sam->incoherent = TRUE;
 
-			} else {
-				fprintf(stderr, "ERROR: Unrecognized text following layer definition\n\t\"%s\"\n", aptr);
-				if (funit != stdin) fclose(funit);
-				if (sample != NULL) { free(sample); sample = NULL; }
-				return NULL;
+				} else if (_strnicmp(aptr, "graded", 6) == 0) {			/* Continuous profile, no sublayers */
+					aptr += 6;
+					sam->graded = TRUE;
+
+				} else if (_strnicmp(aptr, "grade", 5) == 0 && (isspace(aptr[5]) || aptr[5] == '=')) {	/* Material at the back */
+					aptr = aptr+5; while (isspace(*aptr)) aptr++;
+					if (*aptr == '=') aptr++;
+					while (isspace(*aptr)) aptr++;
+					TFOC_GetMaterialName(aptr, sam->grade_name, sizeof(sam->grade_name), &aptr);
+					if (*sam->grade_name == '\0') {
+						fprintf(stderr, "ERROR: Expected a material following grade\n");
+						if (funit != stdin) fclose(funit);
+						if (sample != NULL) { free(sample); sample = NULL; }
+						return NULL;
+					}
+					sam->graded = TRUE;
+
+				} else if (_strnicmp(aptr, "temperature", 11) == 0) {	/* Layer temperature */
+					if ( (aptr = SkipOptEq(aptr+11)) == NULL) return NULL;
+					sam->temperature = strtod(aptr, &aptr);
+				} else if (_strnicmp(aptr, "temp", 4) == 0) {				/* Layer temperature */
+					if ( (aptr = SkipOptEq(aptr+4)) == NULL) return NULL;
+					sam->temperature = strtod(aptr, &aptr);
+				} else if (_strnicmp(aptr, "t", 1) == 0) {					/* Layer temperature */
+					if ( (aptr = SkipOptEq(aptr+1)) == NULL) return NULL;
+					sam->temperature = strtod(aptr, &aptr);
+
+				} else if (_strnicmp(aptr, "doping",6) == 0) {			/* Simple doping spec		*/
+					if ( (aptr = SkipOptEq(aptr+6)) == NULL) return NULL;
+					sam->doping_profile  = CONSTANT;
+					sam->doping_parms[0] = strtod(aptr, &aptr);			/* Doping level (/cm^3)		*/
+
+				} else if (_strnicmp(aptr, "linear_implant",14)==0) {	/* Linear implant profile	*/
+					if ( (aptr = SkipOptEq(aptr+14)) == NULL) return NULL;
+					sam->doping_profile  = LINEAR_IMPLANT;
+					sam->doping_parms[0] = strtod(aptr, &aptr);			/* Dose (/cm^2)				*/
+					sam->doping_parms[1] = strtod(aptr, &aptr);			/* Front level					*/
+					sam->doping_parms[2] = strtod(aptr, &aptr);			/* Back level					*/
+					sam->doping_layers   = strtol(aptr, &aptr, 10);		/* # sublayers					*/
+					if (sam->doping_layers <= 1) sam->doping_layers = 10;
+
+				} else if (_strnicmp(aptr, "linear",6)==0) {				/* Linear profile				*/
+					if ( (aptr = SkipOptEq(aptr+6)) == NULL) return NULL;
+					sam->doping_profile  = LINEAR;
+					sam->doping_parms[0] = strtod(aptr, &aptr);			/* Front concentration		*/
+					sam->doping_parms[1] = strtod(aptr, &aptr);			/* Back concentration		*/
+					sam->doping_layers   = strtol(aptr, &aptr, 10);		/* # sublayers					*/
+					if (sam->doping_layers <= 1) sam->doping_layers = 10;
+
+				} else if (_strnicmp(aptr, "exponential", 11) == 0) {	/* Exponential profile */
+					if ( (aptr = SkipOptEq(aptr+11)) == NULL) return NULL;
+					sam->doping_profile  = EXPONENTIAL;
+					sam->doping_parms[0] = strtod(aptr, &aptr);			/* Dose (/cm^2)				*/
+					sam->doping_parms[1] = strtod(aptr, &aptr);			/* 1/e width				 	*/
+					sam->doping_layers   = strtol(aptr, &aptr, 10);		/* # sublayers					*/
+					if (sam->doping_layers <= 1) sam->doping_layers = (int) (5*sam->z/sam->doping_parms[1]+1);
+
+				} else if (_strnicmp(aptr, "profile", 7) == 0 && (isspace(aptr[7]) || aptr[7] == '=' || aptr[7] == '\0')) {	/* Tabulated profile */
+					aptr += 7; while (isspace(*aptr)) aptr++;
+					if (*aptr == '=') aptr++;
+					while (isspace(*aptr)) aptr++;
+					for (i=0; *aptr != '\0' && ! isspace(*aptr) && i < (int) sizeof(sam->profile_name)-1; i++) sam->profile_name[i] = *(aptr++);
+					sam->profile_name[i] = '\0';
+					if (*sam->profile_name == '\0' || (sam->profile = LoadProfile(sam->profile_name, fname)) == NULL) {
+						if (*sam->profile_name == '\0') fprintf(stderr, "ERROR: Expected a file name following profile\n");
+						if (funit != stdin) fclose(funit);
+						if (sample != NULL) { free(sample); sample = NULL; }
+						return NULL;
+					}
+					sam->doping_profile  = TABULATED;
+					sam->doping_parms[0] = strtod(aptr, &cptr);			/* Scale on the doping		*/
+					if (cptr == aptr) sam->doping_parms[0] = 1.0;
+					sam->doping_parms[1] = get_nm_value(cptr, &aptr, 0.0);	/* Depth of the front (nm)	*/
+					sam->doping_layers   = strtol(aptr, &aptr, 10);		/* # sublayers					*/
+					if (sam->doping_layers <= 1) {							/* About the data spacing	*/
+						sam->doping_layers = (int) ceil(sam->z*(sam->profile->npt-1) / (sam->profile->z[sam->profile->npt-1]-sam->profile->z[0]));
+						if (sam->doping_layers < 10)   sam->doping_layers = 10;
+						if (sam->doping_layers > 1000) sam->doping_layers = 1000;
+					}
+
+				} else {
+					fprintf(stderr, "ERROR: Unrecognized text following layer definition\n\t\"%s\"\n", aptr);
+					if (funit != stdin) fclose(funit);
+					if (sample != NULL) { free(sample); sample = NULL; }
+					return NULL;
+				}
+
+				while (isspace(*aptr)) aptr++;								/* Skip any spaces now */
 			}
 
-			while (isspace(*aptr)) aptr++;								/* Skip any spaces now */
+			num_layers++;
 		}
-
-		num_layers++;
 	}
+	if (blk_close) {
+		if (num_layers-blk_first > 0 && blk_n > 1) {
+			sample[blk_first].repeat      = blk_n;
+			sample[blk_first].repeat_rows = num_layers-blk_first;
+			blk_end = num_layers-1;
+		}
+		blk_first = -1;
+	}
+	if (blk_first >= 0) { fprintf(stderr, "ERROR: Repeat block not terminated by }\n"); goto BadRepeat; }
+	if (blk_end >= 0 && blk_end == num_layers-1) { fprintf(stderr, "ERROR: Substrate can not be part of a repeat block\n"); goto BadRepeat; }
 
 	if (num_layers == 0 || sample == NULL) {
 		fprintf(stderr, "ERROR: Empty sample structure\n");
@@ -327,6 +1143,11 @@ TFOC_SAMPLE *TFOC_LoadSample(char *fname) {
 
 	if (funit != stdin) fclose(funit);
 	return sample;
+
+BadRepeat:
+	if (funit != stdin) fclose(funit);
+	if (sample != NULL) free(sample);
+	return NULL;
 }
 
 
@@ -238,6 +238,23 @@ void *GVFitSpline(void *work, double *x, double *y, int npt, int opts) {
 }
 
 
+/* ============================================================================
+-- Bytes in the table returned by GVFitSpline for npt points (so the table
+-- can be copied or stored without knowing the element layout)
+============================================================================ */
+size_t GVSplineSize(int npt) {
+	return npt*sizeof(SPLINE);
+}
+
+
+/* ============================================================================
+-- X coordinate of knot i (0 <= i < npt-1; the last is replaced by REAL_MAX)
+============================================================================ */
+double GVSplineKnot(void *work, int i) {
+	return ((SPLINE *) work)[i].x;
+}
+
+
 /* ============================================================================
 -- Evaluate a spline function
 --
@@ -263,3 +280,58 @@ double GVEvalSpline(void *work, double x) {
 	x = x - spl->x;								/* Distance from knot */
 	return ( ((spl->cf[2]*x + spl->cf[1])*x + spl->cf[0])*x + spl->y );
 }
+
+
+/* ============================================================================
+-- Evaluate a spline function with the knot count known, so the interval is
+-- found by search rather than by walking from the first knot
+--
+-- Usage: double GVEvalSplineAt(void *work, int npt, double x, int *cursor);
+--
+-- Inputs: work   - pointer to workspace with spline data and coefficients
+--         npt    - number of knots the spline was fit with
+--         x      - x value to evaluate spline
+--         cursor - if not NULL, interval of the previous call on this
+--                  spline (start at 0).  The search gallops outward from
+--                  it, so a monotone sweep costs O(1) per point; without
+--                  it the search is O(log npt).
+--
+-- Output: *cursor - interval containing x
+--
+-- Return: Returns value of spline at specified point (identical to
+--         GVEvalSpline)
+============================================================================ */
+double GVEvalSplineAt(void *work, int npt, double x, int *cursor) {
+
+	SPLINE *spl;
+	int i, lo, hi, mid, step;
+
+	spl = (SPLINE *) work;						/* Just rename it		 */
+	if (x <= spl[0].x || npt < 2) return spl[0].y;		/* Constant extension */
+
+/* Looking for interval i with spl[i].x < x <= spl[i+1].x, as GVEvalSpline */
+	i = (cursor != NULL) ? *cursor : 0;
+	if (i < 0 || i > npt-2) i = 0;
+	if (x > spl[i+1].x) {						/* Gallop up, spl[lo].x < x */
+		lo = i+1; hi = lo+1; step = 1;
+		while (hi < npt-1 && x > spl[hi].x) { lo = hi; step *= 2; hi = lo+step; }
+		if (hi > npt-1) hi = npt-1;
+	} else if (x <= spl[i].x) {				/* Gallop down, x <= spl[hi].x */
+		hi = i; lo = hi-1; step = 1;
+		while (lo > 0 && x <= spl[lo].x) { hi = lo; step *= 2; lo = hi-step; }
+		if (lo < 0) lo = 0;
+	} else {
+		lo = i; hi = i+1;
+	}
+	while (hi-lo > 1) {							/* Bisect */
+		mid = (lo+hi)/2;
+		if (x > spl[mid].x) { lo = mid; } else { hi = mid; }
+	}
+	if (cursor != NULL) *cursor = lo;
+
+	spl += lo;
+	if (spl[1].x == REAL_MAX) return spl[0].y;
+
+	x = x - spl->x;								/* Distance from knot */
+	return ( ((spl->cf[2]*x + spl->cf[1])*x + spl->cf[0])*x + spl->y );
+}
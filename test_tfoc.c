@@ -2,14 +2,114 @@
   Simple test of subroutine-oriented TFOC
 =========================================================================== */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
 /* ------------------------------ */
 /* Local include files            */
 /* ------------------------------ */
 #include "tfoc.h"
 
+#define	DECIMATE_DATABASE	"database.nk"
+#define	DECIMATE_TOL		(1E-3)
+
+/* ===========================================================================
+-- -decimate must leave every point of the table within tol of the fit.  The
+-- material is loaded whole and thinned (through its path, so the two are
+-- cached under different names) and compared at each tabulated energy,
+-- where the whole table's spline passes through the data (TFOC_FindNK
+-- takes E = 1240/lambda).
+--
+-- Return: 0 if within tolerance, 1 otherwise
+=========================================================================== */
+static int TestDecimate(char *name, double tol) {
+	TFOC_MATERIAL *full, *thin;
+	COMPLEX a, b;
+	char path[256], line[256];
+	double ev, err, maxerr=0;
+	FILE *funit;
+
+	TFOC_SetDecimation(0);
+	full = TFOC_FindMaterial(name, DECIMATE_DATABASE);
+	sprintf(path, "%s/%s", DECIMATE_DATABASE, name);
+	TFOC_SetDecimation(tol);
+	thin = TFOC_FindMaterial(path, "");
+	TFOC_SetDecimation(0);
+	if (full == NULL || thin == NULL || (funit = fopen(path, "r")) == NULL) {
+		printf("decimate %-8s: unable to load\n", name);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), funit) != NULL) {
+		if ( (ev = strtod(line, NULL)) <= 0) continue;
+		a = TFOC_FindNK(full, 1240.0/ev);
+		b = TFOC_FindNK(thin, 1240.0/ev);
+		err = fabs(a.x-b.x) > fabs(a.y-b.y) ? fabs(a.x-b.x) : fabs(a.y-b.y);
+		if (err > maxerr) maxerr = err;
+	}
+	fclose(funit);
+
+	printf("decimate %-8s: max error %.3g (tol %g) %s\n", name, maxerr, tol, (maxerr <= tol*(1+1E-9)) ? "ok" : "FAILED");
+	return (maxerr <= tol*(1+1E-9)) ? 0 : 1;
+}
+
+/* ===========================================================================
+-- A tabulated profile with a step (1E20 to 100 nm, 1E16 beyond, all p-type)
+-- must not overshoot between the data points.  Every sublayer stays within
+-- the data range, those past the step are the background exactly, and a
+-- graded row is flat there too.
+--
+-- Return: 0 if the profile is followed, 1 otherwise
+=========================================================================== */
+static int TestStepProfile(void) {
+	TFOC_SAMPLE *sample;
+	TFOC_LAYER *layers, *lay;
+	COMPLEX dn, dn_back;
+	FILE *funit;
+	double depth, u;
+	int i, bad=0;
+
+	if ( (funit = fopen("step_profile.tmp", "w")) == NULL) return 1;
+	for (i=0; i<=40; i++) fprintf(funit, "%d %g\n", 10*i, (i <= 10) ? 1E20 : 1E16);
+	fclose(funit);
+	if ( (funit = fopen("step_sample.tmp", "w")) == NULL) return 1;
+	fprintf(funit, "air\nc-Si 400 profile step_profile.tmp 1 0 40\nc-Si 400 profile step_profile.tmp graded\nc-Si\n");
+	fclose(funit);
+
+	sample = TFOC_LoadSample("step_sample.tmp");
+	remove("step_sample.tmp"); remove("step_profile.tmp");
+	if (sample == NULL) { printf("step profile    : unable to load\n"); return 1; }
+	layers = calloc(TFOC_CountLayers(sample)+1, sizeof(*layers));
+	TFOC_MakeLayers(sample, layers, 300.0, 10000.0);
+
+	for (depth=0,lay=layers+1; lay->layer == 1; lay++) {
+		if (lay->doping < 1E16*(1-1E-9) || lay->doping > 1E20*(1+1E-9)) bad++;
+		if (depth >= 110 && fabs(lay->doping-1E16) > 1E16*1E-9) bad++;
+		depth += lay->z;
+	}
+	dn_back = lay->graded->dn(lay->graded, 1.0);
+	for (i=0; i<=290; i++) {
+		u  = (110+i)/400.0;
+		dn = lay->graded->dn(lay->graded, u);
+		if (fabs(dn.y-dn_back.y) > 1E-12) bad++;
+	}
+	free(layers); free(sample);
+
+	printf("step profile    : %s\n", (bad == 0) ? "ok" : "FAILED");
+	return (bad == 0) ? 0 : 1;
+}
+
 int main(int argc, char *argv[]) {
 
-	printf("%f", TFOC_GetRefl("a.sam", 10600, 75, TE, 300.0).R);
-	return 0;
+	int rc = 0;
+
+	printf("%f\n", TFOC_GetRefl("a.sam", 10600, 75, TE, 300.0).R);
+
+	rc |= TestDecimate("sio2", DECIMATE_TOL);
+	rc |= TestDecimate("c-Si", DECIMATE_TOL);
+	rc |= TestDecimate("NiSi", DECIMATE_TOL);
+	rc |= TestDecimate("au",   10*DECIMATE_TOL);
+	rc |= TestStepProfile();
+	return rc;
 }
@@ -35,6 +35,7 @@
 #include <math.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -68,6 +69,9 @@ typedef struct _NKMOD {						/* Enable ability to change n or k of a layer */
 /* ------------------------------- */
 static void PrintDetails(void);
 static void PrintUsage(void);
+static void SampleNK(TFOC_SAMPLE *sample, double lambda, double temperature, BOOL thermal_only);
+static void SpectralSweep(FILE *funit, TFOC_SAMPLE *sample, TFOC_LAYER *layers, int nlayers, BOOL energy,
+								  double xmin, double dx, int npt, double theta, POLARIZATION mode, double temperature);
 
 /* ------------------------------- */
 /* My usage of other external fncs */
@@ -94,6 +98,7 @@ int main(int argc, char *argv[]) {
 	double theta=0.0;									/* Incident angle (deg)		*/
 	double temperature = 300.0;					/* Temperature (K)			*/			
 	POLARIZATION mode=TE;							/* Polarization				*/
+	BOOL mode_given=FALSE;							/* Polarization on command line? */
 	TFOC_SAMPLE *sample=NULL;						/* Sample description		*/
 	char *samplefilename=NULL;						/* Sample filename			*/
 	char database[PATH_MAX]="",					/* Directory for database	*/
@@ -101,8 +106,22 @@ int main(int argc, char *argv[]) {
 	FILE *funit=NULL;									/* Output filehandle			*/
 	BOOL terse=FALSE;									/* Terse output mode?		*/
 	BOOL detail=FALSE;								/* Output layer information? */
+	BOOL jacobian=FALSE;								/* Output dR,dT per row?	  */
+	BOOL compile_db=FALSE;							/* Compile the database and exit */
+	int benchmark=0;									/* Timed repeats of TFOC_ReflN */
+	BOOL absorb=FALSE;								/* Output absorbed fraction per layer? */
+	BOOL graded;										/* Any continuously graded rows? */
+	int field_npt=0;									/* Points in |E|^2 depth profile */
+	double field_dz=1.0;								/* Spacing of |E|^2 profile (nm) */
+	double *efield;
+	clock_t t0;
 	NKMOD *tmp, *tmp2;
-	REFL result;
+	REFL result={0.0, 0.0};
+	TFOC_SWEEP *sweep=NULL;							/* Cached products for row sweeps */
+	TFOC_JACOBIAN *jac;								/* Derivatives for -jacobian		 */
+	int first_row=0, last_row=-1;					/* Rows varied in the sweep		 */
+	double last_theta=0, last_lambda=0;			/* Point of the last result		 */
+	TFOC_CONE cone={0.0, 0.0, 0, 0.0};			/* Cone of incidence (-na, -cone) */
 
 	/* For determining the database directory */
 	struct _stat info;
@@ -152,6 +171,55 @@ int main(int argc, char *argv[]) {
 		} else if (_stricmp(aptr, "detail") == 0) {
 			detail = TRUE;
 			
+		} else if (_stricmp(aptr, "compile") == 0) {
+			compile_db = TRUE;
+			
+		} else if (_stricmp(aptr, "decimate") == 0) {		/* Thin large n,k tables */
+			if (argc < 1) goto TooFewArgs;
+			TFOC_SetDecimation(atof(*argv));
+			argc--; argv++;
+			
+		} else if (_stricmp(aptr, "grid") == 0) {			/* Uniform grid n,k lookup */
+			if (argc < 1) goto TooFewArgs;
+			TFOC_SetLookupGrid(atof(*argv));
+			argc--; argv++;
+			
+		} else if (_stricmp(aptr, "sublayers") == 0) {		/* Adaptive graded layer discretization */
+			if (argc < 1) goto TooFewArgs;
+			TFOC_SetSublayerTolerance(atof(*argv));
+			argc--; argv++;
+			
+		} else if (_stricmp(aptr, "jacobian") == 0) {
+			jacobian = TRUE;
+			
+		} else if (_stricmp(aptr, "absorb") == 0) {
+			absorb = TRUE;
+			
+		} else if (_stricmp(aptr, "field") == 0) {			/* |E|^2 depth profile */
+			if (argc < 2) goto TooFewArgs;
+			field_dz  = get_nm_value(*argv, &endptr, 0.0);	if (*endptr != '\0') goto TrailingGarbage;	argc--; argv++;
+			field_npt = atoi(*argv); argc--; argv++;
+
+		} else if (_stricmp(aptr, "benchmark") == 0) {		/* Time repeated evaluations */
+			if (argc < 1) goto TooFewArgs;
+			benchmark = atoi(*argv); argc--; argv++;
+			
+		} else if (_stricmp(aptr, "na") == 0 || _stricmp(aptr, "cone") == 0) {	/* Average over objective cone */
+			if (argc < 1) goto TooFewArgs;
+			if (_stricmp(aptr, "na") == 0) {
+				cone.na = atof(*argv);
+			} else {
+				cone.half_angle = atof(*argv);
+			}
+			argc--; argv++;
+			if (argc > 0 && (strtol(*argv, &endptr, 10), *endptr == '\0')) {		/* Optional node count */
+				cone.nodes = atoi(*argv); argc--; argv++;
+			}
+
+		} else if (_stricmp(aptr, "pupil") == 0) {			/* Gaussian pupil fill factor */
+			if (argc < 1) goto TooFewArgs;
+			cone.fill = atof(*argv); argc--; argv++;
+
 		} else if (_stricmp(aptr, "cmax") == 0) {			/* Set the maximum n/p-type doping */
 			if (argc < 1) goto TooFewArgs;
 			cnmax = cpmax = fabs(atof(*argv)); argc--; argv++;
@@ -164,6 +232,9 @@ int main(int argc, char *argv[]) {
 			if (argc < 1) goto TooFewArgs;
 			cnmax = fabs(atof(*argv)); argc--; argv++;
 
+		} else if (_stricmp(aptr, "fcexact") == 0) {		/* Direct free carrier model, no table */
+			fc_use_table(0);
+
 		} else if (_stricmp(aptr, "vn") == 0) {				/* Vary n value of material */
 			if (argc < 4) goto TooFewArgs;
 			vary.type = N;
@@ -300,17 +371,17 @@ int main(int argc, char *argv[]) {
 			argc--; argv++; 
 
 		} else if (_stricmp(aptr, "TM") == 0) {
-			mode = TM;
+			mode = TM; mode_given = TRUE;
 		} else if (_stricmp(aptr, "TE") == 0) {
-			mode = TE;
+			mode = TE; mode_given = TRUE;
 		} else if (_stricmp(aptr, "random") == 0 || _strnicmp(aptr, "unpolarized", 5) == 0) {
 			mode = UNPOLARIZED;
 		} else if (_strnicmp(aptr, "polarization", 5) == 0) {
 			if (argc < 1) goto TooFewArgs;
 			if (_stricmp(*argv, "s") == 0 || _stricmp(*argv, "TE") == 0) {
-				mode = TE;
+				mode = TE; mode_given = TRUE;
 			} else if (_stricmp(*argv, "p") == 0 || _stricmp(*argv, "TM") == 0) {
-				mode = TM;
+				mode = TM; mode_given = TRUE;
 			} else if (_strnicmp(*argv, "unpolarized",3) == 0 || _stricmp(*argv, "random") == 0) {
 				mode = UNPOLARIZED;
 			} else {
@@ -390,11 +461,23 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	if (cone.na > 0 || cone.half_angle > 0) {
+		if (theta != 0.0 || vary.type == ANGLE) {
+			fprintf(stderr, "ERROR: The -na and -cone options integrate over a cone about the normal; -a and -va cannot be used\n");
+			fatal_error = TRUE;
+		}
+		if (mode_given) {
+			fprintf(stderr, "ERROR: The -na and -cone options average over the full azimuth and are unpolarized; -TE and -TM cannot be used\n");
+			fatal_error = TRUE;
+		}
+		mode = UNPOLARIZED;
+	}
+
 	/* Abort out on fatal errors (after looking for all) */
 	if (fatal_error) return 3;
 
 /* If no sample descriptor file yet, take next command line arg or default */
-	if (sample == NULL) {
+	if (sample == NULL && ! compile_db) {
 		if (argc > 0) {
 			samplefilename = *argv;	argc--; argv++;
 		} else {
@@ -438,21 +521,33 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	strcat_s(database, sizeof(database), "/");														/* Append trailing path delimiter */
-	if (TFOC_Debug_Flag & DEBUG_DATABASE) fprintf(stderr, "tfoc database set as: \"%s\"\n\n", database); fflush(stderr);
+	if (TFOC_DEBUG(DEBUG_DATABASE)) fprintf(stderr, "tfoc database set as: \"%s\"\n\n", database); fflush(stderr);
+
+	if (compile_db) {
+		printf("Compiling materials in %s\n", database);
+		if ( (i = TFOC_CompileDatabase(database)) < 0) return 4;
+		printf("%d materials written to %stfoc.nkb\n", i, database);
+		return 0;
+	}
 	
 /* --------------------------------------------------------------------------------
 -- Okay, look up the materials and fill in n,k values for each layer directly from
--- the database.  Although we have temperature data, no ability to modify the n,k
--- values based on this information currently.  Only used with the free carrier
+-- the database.  Temperature tables are evaluated at the layer temperature (or the
+-- global one); the temperature is otherwise only used with the free carrier
 -- modification for IR absorption.
 -------------------------------------------------------------------------------- */
+	TFOC_PrefetchMaterials(sample, database);					/* Read all files in parallel first */
 	for (i=0; sample[i].type != EOS; i++) {
 		if ( (sample[i].material = TFOC_FindMaterial(sample[i].name, database)) == NULL) {
 			fprintf(stderr, "ERROR: Unable to locate \"%s\" in the materials database directory\n", sample[i].name);
 			return -1;
 		}
-		sample[i].n = TFOC_FindNK(sample[i].material, lambda);
+		if (*sample[i].grade_name != '\0' && (sample[i].grade_material = TFOC_FindMaterial(sample[i].grade_name, database)) == NULL) {
+			fprintf(stderr, "ERROR: Unable to locate \"%s\" in the materials database directory\n", sample[i].grade_name);
+			return -1;
+		}
 	}
+	SampleNK(sample, lambda, temperature, FALSE);
 
 /* --------------------------------------------------------------------------------
 -- At this point, we've looked up the database N,K -- now possibly modify the values 
@@ -486,23 +581,21 @@ int main(int argc, char *argv[]) {
 		free(tmp);
 	}
 
+/* A cone must fit in the incident medium, else TFOC_ReflNCone has nothing to average */
+	if (cone.half_angle >= 90.0) {
+		fprintf(stderr, "ERROR: The -cone half-angle (%g deg) must be less than 90 deg\n", cone.half_angle);
+		return 3;
+	}
+	if (cone.half_angle <= 0 && cone.na > 0 && cone.na >= sample[0].n.x) {
+		fprintf(stderr, "ERROR: The -na value (%g) must be less than the index of the incident medium (%g at %.2f nm)\n", cone.na, sample[0].n.x, lambda);
+		return 3;
+	}
+
 /* ----------------------------------------------------------
 -- Finally, figure out how big the actual layer array will
 -- need to be given expansion of profiles, etc.
 ---------------------------------------------------------- */
-	nlayers = 0;
-	for (i=0; sample[i].type != EOS; i++) {
-		switch (sample[i].doping_profile) {
-			case NO_DOPING:
-			case CONSTANT:
-				nlayers++;
-				break;
-			case EXPONENTIAL:
-			case LINEAR_IMPLANT:
-			case LINEAR:
-				nlayers += sample[i].doping_layers;
-		}
-	}
+	nlayers = TFOC_CountLayers(sample);
 	layers = calloc(nlayers+1, sizeof(*layers));				/* Allocate space (one extra for safety) for layers */
 
 /*	PrintMaterials(); */
@@ -518,9 +611,42 @@ int main(int argc, char *argv[]) {
 /* And go! */
 	if (vary.type == NONE) {
 		TFOC_MakeLayers(sample, layers, temperature, lambda);
-		result = TFOC_ReflN(theta, mode, lambda, layers);
+		result = (cone.na > 0 || cone.half_angle > 0) ? TFOC_ReflNCone(&cone, lambda, layers) : TFOC_ReflN(theta, mode, lambda, layers);
 		fprintf(funit, "%f %f %f\n", result.R, result.T, 1.0-result.R-result.T);
 		if (detail) TFOC_PrintDetail(sample, layers);
+		if (benchmark > 0) {
+			for (i=0; layers[i].type != EOS; i++) ;
+			t0 = clock();
+			for (j=0; j<benchmark; j++) result = TFOC_ReflN(theta, mode, lambda, layers);
+			z = (double) (clock()-t0) / CLOCKS_PER_SEC;
+			fprintf(funit, "# %d evaluations of %d layers in %.3f s (%.3f us each)\n", benchmark, i+1, z, 1E6*z/benchmark);
+		}
+		if (absorb || field_npt > 0) {
+			efield = (field_npt > 0) ? calloc(field_npt, sizeof(*efield)) : NULL;
+			TFOC_ReflNAbsorb(theta, mode, lambda, layers, field_dz, field_npt, efield);
+			if (absorb) {
+				fprintf(funit, "# layer\tnm\tabsorbed\tname  (last is T into substrate)\n");
+				for (i=1; layers[i-1].type != EOS; i++) {
+					fprintf(funit, "%d\t%g\t%g\t%s\n", i, layers[i].z, layers[i].absorb, sample[layers[i].layer].name);
+				}
+			}
+			if (efield != NULL) {
+				fprintf(funit, "# depth (nm)\t|E|^2\n");
+				for (i=0; i<field_npt; i++) fprintf(funit, "%g\t%g\n", i*field_dz, efield[i]);
+				free(efield);
+			}
+		}
+		if (jacobian) {
+			for (i=0; sample[i].type != EOS; i++) ;
+			jac = calloc(i, sizeof(*jac));
+			TFOC_ReflNJacobian(theta, mode, lambda, layers, i, jac);
+			fprintf(funit, "# layer\tdR/dz\tdT/dz\tdR/dn\tdT/dn\tdR/dk\tdT/dk  (z in nm)\n");
+			for (j=0; j<i; j++) {
+				fprintf(funit, "%d\t%g\t%g\t%g\t%g\t%g\t%g\t%s\n", j, jac[j].dz.R, jac[j].dz.T, jac[j].dn.R, jac[j].dn.T,
+						  jac[j].dk.R, jac[j].dk.T, sample[j].name);
+			}
+			free(jac);
+		}
 	} else {
 
 		if (vary.type == EXPLOSIVE) {						/* Some corrections to this mode */
@@ -546,10 +672,17 @@ int main(int argc, char *argv[]) {
 			fprintf(funit, "# ----------------------------------------------------------------------------\n");
 			fprintf(funit, "#  Wavelength:     %.2f\n", lambda);
 			fprintf(funit, "#  Polarization:   %s\n", (mode==TM)?"TM (p)":(mode==TE)?"TE (s)":"Unpolarized");
-			fprintf(funit, "#  Incident Angle: %.2f\n", theta);
+			if (cone.half_angle > 0) {
+				fprintf(funit, "#  Incident Cone:  half-angle %.2f deg, %s pupil\n", cone.half_angle, (cone.fill > 0) ? "Gaussian" : "uniform");
+			} else if (cone.na > 0) {
+				fprintf(funit, "#  Incident Cone:  NA %.3f, %s pupil\n", cone.na, (cone.fill > 0) ? "Gaussian" : "uniform");
+			} else {
+				fprintf(funit, "#  Incident Angle: %.2f\n", theta);
+			}
 			fprintf(funit, "#  Temperature:    %.2f\n", temperature);
 			fprintf(funit, "# Sample structure from %s\n", samplefilename);
 			for (i=0; sample[i].type != EOS; i++) {
+				if (sample[i].repeat > 1) fprintf(funit, "#     repeat %d times, rows %d-%d\n", sample[i].repeat, i, i+sample[i].repeat_rows-1);
 				if (i == 0) {
 					fprintf(funit, "#  %2d INCIDENT  %s", i, sample[i].name);
 				} else if (sample[i].type == SUBSTRATE) {
@@ -557,6 +690,8 @@ int main(int argc, char *argv[]) {
 				} else {
 					fprintf(funit, "#  %2d %8.2f  %s", i, sample[i].z, sample[i].name);
 				}
+				if (sample[i].incoherent) fprintf(funit, " incoherent");
+				if (sample[i].graded) fprintf(funit, (sample[i].grade_material != NULL) ? " graded to %s" : " graded", sample[i].grade_name);
 				switch (sample[i].doping_profile) {
 					case NO_DOPING:
 						break;
@@ -575,6 +710,10 @@ int main(int argc, char *argv[]) {
 						fprintf(funit, " exponentail doping.  Dose=%g  1/e width=%g  nlayers=%d\n", 
 								  sample[i].doping_parms[0], sample[i].doping_parms[1], sample[i].doping_layers);
 						break;
+					case TABULATED:
+						fprintf(funit, " tabulated profile %s.  Scale=%g  Offset=%g nm  nlayers=%d",
+								  sample[i].profile_name, sample[i].doping_parms[0], sample[i].doping_parms[1], sample[i].doping_layers);
+						break;
 					default:
 						fprintf(stderr, "ERROR: Unrecognized doping profile in printout section\n");
 				}
@@ -639,7 +778,34 @@ int main(int argc, char *argv[]) {
 			fprintf(funit, "# x\tR\tT (into substrate)\n");
 		}
 
-		for (i=0; i<npt; i++) {
+		/* Sweeps that only modify a few sample rows can reuse the rest of the stack */
+		switch (vary.type) {
+			case THICKNESS:
+			case FREE_CARRIER:
+			case DOPING_PARM_0_LOG:
+			case DOPING_PARM_0:
+			case DOPING_PARM_1:
+			case DOPING_PARM_2:
+			case N:
+			case K:
+				first_row = last_row = vary.layer;
+				break;
+			case DUAL:
+				first_row = vary.layer; last_row = vary.layer+1;
+				break;
+			case EXPLOSIVE:
+				first_row = vary.layer-1; last_row = vary.layer+1;
+				break;
+			default:
+				break;
+		}
+
+		if (cone.na > 0 || cone.half_angle > 0) last_row = -1;	/* Each point is already a batch of angles */
+
+		for (graded=FALSE,i=0; sample[i].type != EOS; i++) if (sample[i].graded) graded = TRUE;
+		if ((vary.type == WAVELENGTH || vary.type == ENERGY) && cone.na <= 0 && cone.half_angle <= 0 && ! graded) {		/* Spectra go through the batched kernel */
+			SpectralSweep(funit, sample, layers, nlayers, vary.type == ENERGY, vary.min, vary.dx, npt, theta, mode, temperature);
+		} else for (i=0; i<npt; i++) {
 			z = vary.min + vary.dx*i;
 			switch (vary.type) {
 				case NONE:
@@ -691,20 +857,30 @@ int main(int argc, char *argv[]) {
 					break;
 				case TEMP:
 					temperature = z;
+					SampleNK(sample, lambda, temperature, TRUE);
 					break;
 				case WAVELENGTH:
 					lambda = z;
-					for (j=0; sample[j].type != EOS; j++) sample[j].n = TFOC_FindNK(sample[j].material, lambda);
+					SampleNK(sample, lambda, temperature, FALSE);
 					break;
 				case ENERGY:
 					lambda = (z > 0) ? 1239.842/z : 0.001 ;
-					for (j=0; sample[j].type != EOS; j++) sample[j].n = TFOC_FindNK(sample[j].material, lambda);
+					SampleNK(sample, lambda, temperature, FALSE);
 					break;
 			}
-			TFOC_MakeLayers(sample, layers, temperature, lambda);
-			result = TFOC_ReflN(theta, mode, lambda, layers);
+			j = TFOC_MakeLayers(sample, layers, temperature, lambda);
+			if (i == 0 && last_row >= first_row) sweep = TFOC_SweepInit(theta, mode, lambda, layers, first_row, last_row);
+			if (i > 0 && j == 0 && theta == last_theta && lambda == last_lambda) {
+				;															/* Nothing changed (e.g. below -vcmax) */
+			} else if (cone.na > 0 || cone.half_angle > 0) {
+				result = TFOC_ReflNCone(&cone, lambda, layers);
+			} else {
+				result = (sweep != NULL) ? TFOC_SweepRefl(sweep, layers) : TFOC_ReflN(theta, mode, lambda, layers);
+			}
+			last_theta = theta; last_lambda = lambda;
 			fprintf(funit, "%g\t%9.7f\t%9.7f\n", z, result.R, result.T);
 		}
+		if (sweep != NULL) TFOC_SweepFree(sweep);
 	}
 	if (funit != stdout) fclose(funit);
 	return 0;
@@ -718,6 +894,104 @@ TrailingGarbage:
 	return 3;
 }
 
+/* ===========================================================================
+-- Database n,k of every sample row at lambda.  Temperature tables use the
+-- row's own temperature if it has one, else the global temperature.  With
+-- thermal_only, rows that do not depend on temperature are left alone (so
+-- -n/-k changes survive a temperature sweep).  Graded rows also get the
+-- n,k of their grade material.
+=========================================================================== */
+static void SampleNK(TFOC_SAMPLE *sample, double lambda, double temperature, BOOL thermal_only) {
+	double T;
+	int i;
+
+	for (i=0; sample[i].type != EOS; i++) {
+		T = (sample[i].temperature > 0) ? sample[i].temperature : temperature;
+		if (sample[i].grade_material != NULL && (! thermal_only || TFOC_HasTemperature(sample[i].grade_material)))
+			sample[i].n_grade = TFOC_FindNKT(sample[i].grade_material, lambda, T);
+		if (thermal_only && ! TFOC_HasTemperature(sample[i].material)) continue;
+		sample[i].n = TFOC_FindNKT(sample[i].material, lambda, T);
+	}
+	return;
+}
+
+/* ===========================================================================
+-- Spectral (-vw / -ve) sweep.  The n,k lookup and layer expansion are still
+-- done point by point, but the points are collected in blocks and handed
+-- to the wavelength-batched Fresnel kernel in structure-of-arrays form.
+-- All points of a block must share the layer thicknesses, so a block is
+-- cut short where the expansion changes (adaptive sublayers).  Samples with
+-- graded rows are not sent here (the profile is set per wavelength).
+=========================================================================== */
+#define	SWEEP_BLOCK	(256)								/* Points per call of batch kernel */
+
+static void SpectralSweep(FILE *funit, TFOC_SAMPLE *sample, TFOC_LAYER *layers, int nlayers, BOOL energy,
+								  double xmin, double dx, int npt, double theta, POLARIZATION mode, double temperature) {
+
+	double *xval, *lval, *tval, *nx, *ny, *zref;
+	COMPLEX *nk;
+	REFL *rval;
+	int i, j, k, m, nblk, nrows, nref=0;
+
+	for (nrows=0; sample[nrows].type != EOS; nrows++) ;
+	nk   = malloc(nrows*SWEEP_BLOCK*sizeof(*nk));
+	xval = malloc(SWEEP_BLOCK*sizeof(*xval));
+	lval = malloc(SWEEP_BLOCK*sizeof(*lval));
+	tval = malloc(SWEEP_BLOCK*sizeof(*tval));
+	rval = malloc(SWEEP_BLOCK*sizeof(*rval));
+	nx   = malloc((nlayers+1)*SWEEP_BLOCK*sizeof(*nx));
+	ny   = malloc((nlayers+1)*SWEEP_BLOCK*sizeof(*ny));
+	zref = malloc((nlayers+1)*sizeof(*zref));
+
+	for (i=0; i<npt; i+=nblk) {
+		nblk = (npt-i < SWEEP_BLOCK) ? npt-i : SWEEP_BLOCK;
+		for (k=0; k<nblk; k++) {
+			xval[k] = xmin + dx*(i+k);
+			if (energy) {
+				lval[k] = (xval[k] > 0) ? 1239.842/xval[k] : 0.001 ;
+			} else {
+				lval[k] = xval[k];
+			}
+			tval[k] = theta;
+		}
+		for (j=0; j<nrows; j++) {										/* Each material across the block */
+			TFOC_FindNKBatch(sample[j].material, nblk, lval, (sample[j].temperature > 0) ? sample[j].temperature : temperature, nk+j*nblk);
+		}
+		for (k=0; k<nblk; k++) {
+			for (j=0; j<nrows; j++) sample[j].n = nk[j*nblk+k];
+			TFOC_MakeLayers(sample, layers, temperature, lval[k]);
+			for (j=0; ; j++) {											/* Transpose into SoA layout */
+				if (k == 0) {
+					zref[j] = layers[j].z;
+				} else if (j > nref || layers[j].z != zref[j]) {
+					break;
+				}
+				nx[j*nblk+k] = layers[j].n.x;
+				ny[j*nblk+k] = layers[j].n.y;
+				if (layers[j].type == EOS) break;
+			}
+			if (k == 0) {
+				nref = j;
+			} else if (j != nref || layers[j].type != EOS) {		/* New expansion - end block at k */
+				m = nblk; nblk = k;
+				for (j=1; j<=nref; j++) {
+					memmove(nx+j*nblk, nx+j*m, nblk*sizeof(*nx));
+					memmove(ny+j*nblk, ny+j*m, nblk*sizeof(*ny));
+				}
+				for (j=0; j<nrows; j++) sample[j].n = nk[j*m+k-1];
+				TFOC_MakeLayers(sample, layers, temperature, lval[k-1]);
+				break;
+			}
+		}
+		TFOC_ReflNBatch(nblk, tval, mode, lval, layers, nx, ny, rval);
+		for (k=0; k<nblk; k++) fprintf(funit, "%g\t%9.7f\t%9.7f\n", xval[k], rval[k].R, rval[k].T);
+	}
+
+	free(xval); free(lval); free(tval); free(rval);
+	free(nx); free(ny); free(nk); free(zref);
+	return;
+}
+
 /* ===========================================================================
 =========================================================================== */
 static void PrintUsage(void) {
@@ -733,7 +1007,18 @@ static void PrintUsage(void) {
 "     -manual                         More detailed help\n"
 "     -debug                          Print some debug info (development only)\n"
 "     -detail                         On single calculation, print n,k per layer\n"
+"     -jacobian                       On single calculation, print dR,dT with respect\n"
+"                                     to thickness, n and k of every layer\n"
+"     -absorb                         On single calculation, print the fraction of\n"
+"                                     incident power absorbed in each layer\n"
+"     -field         <dz> <npts>      On single calculation, print |E|^2 versus depth\n"
+"                                     at <npts> points <dz> apart (units ok)\n"
+"     -benchmark     <count>          On single calculation, time <count> repeated\n"
+"                                     evaluations of the stack\n"
 "     -a[ngle]       <theta>          Incident angle (in first medium)\n"
+"     -na   <NA>   [<nodes>]          Average R,T over the cone of an objective\n"
+"     -cone <deg>  [<nodes>]          Same, given the cone half-angle instead\n"
+"     -pupil         <fill>           Gaussian pupil (1/e^2 radius / pupil radius)\n"
 "     -w[avelength]  <lambda>[unit>]  Wavelength w/ optional units (nm default)\n"
 "     -lambda        <labmda>[<unit>] Wavelength w/ optional units (nm default)\n"
 "     -temp[erature] <K>              Temperature in K\n"
@@ -746,6 +1031,13 @@ static void PrintUsage(void) {
 "                                     Checks tfocDatabase environment variable, and\n"
 "                                     for ./tfocDatabase or c:/tfocDatabase\n"
 "     -s[ample]      <sample file>    Sample filename - processed immediately\n"
+"     -compile                        Compile the database directory into the\n"
+"                                     binary tfoc.nkb, used in place of the text\n"
+"                                     files from then on (rerun after changes)\n"
+"     -decimate      <tol>            Thin tabulated n,k data to the points whose\n"
+"                                     spline stays within <tol> of it (e.g. 1e-4)\n"
+"     -grid          <tol>            Resample tabulated n,k onto a uniform energy\n"
+"                                     grid matching the spline within <tol>\n"
 "\n"
 "     -vt <layer> <min> <max> <dx>    Vary layer thickness (0=incident media)\n"
 "     -vd <layer> <range>     <dx>    Vary 2 layers with constant total\n"
@@ -776,6 +1068,11 @@ static void PrintUsage(void) {
 "     -cmax <max>                     Set the maximum activated n & p dopant concentration\n"
 "     -cpmax <max>                    Set the maximum activated p-type dopant concentration\n"
 "     -cnmax <max>                    Set the maximum activated n-type dopant concentration\n"
+"     -fcexact                        Evaluate the free carrier model directly rather\n"
+"                                     than from its table (relative error < 2E-5)\n"
+"     -sublayers <tol>                Choose the sublayer count of graded doping\n"
+"                                     profiles for an error of ~<tol> in r, and\n"
+"                                     merge sublayers with nearly equal n,k\n"
 "\n"
 "     -terse                          Output 2 column data only (no description)\n"
 "\n"
@@ -821,9 +1118,10 @@ static void PrintDetails(void) {
 "Models must be one of\n"
 "    [ SERIES | PARALLEL | BRUGGEMAN | LOOYENGA | MAXWELL-GARNETT ]\n"
 "where the series mixing (simple fractional weight of the dielectric constat)\n"
-"is default if no model is specified.  SERIES, PARALLEL and LOOYENGA are\n"
-"implemented for an arbitrary number of components while the others are only\n"
-"valid for two elements.\n"
+"is default if no model is specified.  All models accept any number of\n"
+"components.  For MAXWELL-GARNETT the component with the largest fraction is\n"
+"the host and all others are inclusions in it.  BRUGGEMAN with more than two\n"
+"components is solved iteratively, each point starting from the last.\n"
 "\n"
 "The only material options recognized relate to doping and temperature.\n"
 "Both invoke a free-carrier model for Si, adding the free-carrier k value to\n"
@@ -865,13 +1163,80 @@ static void PrintDetails(void) {
 "      linear_implant <dose> <front hgt> <back hgt> [<nlayers>]\n"
 "  * Implant with exponential varying concentration.\n"
 "      exponential <dose> <1/e width nm> [<nlayers>]\n"
+"  * Concentration (and temperature) tabulated against depth in a file.\n"
+"      profile <file> [<scale> [<offset nm> [<nlayers>]]]\n"
 "  * Layer temperature\n"
 "      temperature <K>\n"
+"  * Thick layer treated without interference (see below)\n"
+"      incoherent\n"
+"  * Continuously graded layer (see below)\n"
+"      graded\n"
+"      grade <material>\n"
 "For doping profiles, internally the film is just expanded to n layers with the\n"
 "integral of the dose over the layer set established as a constant value.  If\n"
 "the number of layers is not specified, a reasonable value will be assumed.  All\n"
 "sublayers will be at the same temperature - either as specified on the line or\n"
 "as the temperature specified on the command line.\n"
+"With -sublayers <tol>, the number of layers becomes a maximum.  The count used\n"
+"is chosen at each wavelength from the thickness relative to the wavelength and\n"
+"the change in k across the profile, and neighboring sublayers whose n,k are\n"
+"within the tolerance are combined (e.g. the tail of an exponential profile).\n"
+"\n"
+"A profile file (e.g. SIMS or process simulation output) has one depth per\n"
+"line: <depth> [units] <cnc> [<K>], with depth as for layer thicknesses, cnc in\n"
+"/cm^3 (negative n-type) and an optional temperature.  Lines not starting with\n"
+"a number are ignored, and a relative name is also looked for next to the\n"
+"sample file.  The data is interpolated with a monotone cubic (which never\n"
+"overshoots between points, so steps do not ring or change sign), held at the\n"
+"end values outside the file, and averaged over each sublayer.  The\n"
+"concentrations are multiplied by <scale> (default 1) and the front of the\n"
+"layer is at depth <offset> in the file (default 0); -vp0 and -vp1 vary these.\n"
+"A temperature column sets the temperature of the free-carrier k through the\n"
+"layer (the n,k of the material stay at the layer temperature), and\n"
+"-sublayers then keeps the given count.\n"
+"      c-Si  2000 profile emitter.dat\n"
+"      c-Si  1 um profile anneal.dat 1 500 graded\n"
+"\n"
+"A graded layer is not divided into sublayers.  Its n,k varies continuously\n"
+"with depth and the transfer matrix is integrated to a relative error of\n"
+"about 1E-8.  The doping profile gives the free-carrier k at each depth, and\n"
+"grade <material> varies the n,k linearly from the row material at the front\n"
+"to <material> at the back (e.g. a SiGe or SiON composition gradient).  Either\n"
+"or both may be given.  Incoherent rows are never graded.\n"
+"      c-Si  500 exponential -1E16 50 graded\n"
+"      SiO2  200 grade Si3N4\n"
+"\n"
+"Periodic structures (Bragg mirrors, superlattices) may be given as a repeat\n"
+"block.  The rows between the braces are repeated <count> times and evaluated\n"
+"as one period raised to a power, so large counts cost little.  Rows may be\n"
+"on separate lines or separated by ; on a single line.  Blocks cannot be\n"
+"nested and cannot include the incident medium or the substrate.\n"
+"      repeat 500 { SiO2 80; TiO2 60 }\n"
+"      repeat 20 {\n"
+"         SiO2  80\n"
+"         Si3N4 60\n"
+"      }\n"
+"Rows inside a block are numbered once (-vt, -t, etc. change every period).\n"
+"\n"
+"Layers much thicker than the coherence length (a 725 um wafer, a glass slide)\n"
+"may be marked incoherent.  Multiple reflections inside them are added in\n"
+"intensity rather than amplitude, giving the fringe-averaged R and T directly.\n"
+"Thin films in the stack remain coherent.  For a wafer with back-side\n"
+"reflection, make the wafer an incoherent layer and air the final medium.\n"
+"      AIR\n"
+"      SiO2   100\n"
+"      c-Si   725 um incoherent\n"
+"      AIR\n"
+"\n"
+"Microspot reflectometers illuminate through an objective, so the sample sees\n"
+"a cone of angles rather than a single angle.  -na <NA> or -cone <half-angle>\n"
+"averages R and T over a cone about the normal, weighting each angle by its\n"
+"area in the objective pupil.  The pupil is uniformly filled unless -pupil\n"
+"gives the 1/e^2 radius of a Gaussian beam relative to the pupil radius.\n"
+"Integration uses Gauss-Legendre quadrature (12 nodes, or <nodes> up to 64).\n"
+"Azimuthal averaging mixes TE and TM equally, so the result is unpolarized\n"
+"(and -TE or -TM is an error).\n"
+"      tfoc -na 0.25 -vw 400 800 2 film.sam\n"
 "\n"
 "The materials database directory must contain a file for each material\n"
 "specified in the sample descriptor.  The file contains three columns giving\n"
@@ -879,6 +1244,47 @@ static void PrintDetails(void) {
 "of the index (k).  The sign of the imaginary part will be ignored - internal\n"
 "convention is n = n-ik.  Given entries in the database will be interpolated for\n"
 "all wavelengths using a cubic spline with constant extension at the limits.\n"
+"There is no limit on the number of points or the line length.  Very large\n"
+"measured files (ellipsometry exports) can be thinned as they are read with\n"
+"-decimate <tol>, keeping only the points needed for the spline through them\n"
+"to pass within <tol> (in n and k) of every point dropped.  With -grid <tol> each table is instead resampled at load\n"
+"onto a uniform energy grid that reproduces the spline within <tol>; lookups\n"
+"are then a direct index rather than a search (tables that would need more\n"
+"than 65536 cells keep the spline).\n"
+"\n"
+"A material may instead be an analytic dispersion model, either as the first\n"
+"line of its database file or inline as a layer name:\n"
+"      model tauc_lorentz A=122 E0=3.45 C=2.54 Eg=1.2 einf=1.15\n"
+"      [ cauchy 1.45 0.0036 ] 100\n"
+"Values are given in order or as name=value; missing values take the default\n"
+"(in parentheses).  Energies in eV, wavelengths L in um.\n"
+"   cauchy        A(1) B C alpha beta gamma   n = A+B/L^2+C/L^4\n"
+"                                             k = alpha*exp(beta*(E-gamma))\n"
+"   sellmeier     A(1) B1 C1 B2 C2 B3 C3      n^2 = A + sum Bi*L^2/(L^2-Ci)\n"
+"   drude         einf(1) wp gamma            eps = einf - wp^2/(E^2+i*gamma*E)\n"
+"   tauc_lorentz  A E0 C Eg einf(1)           Jellison-Modine\n"
+"   cody_lorentz  A E0 C Eg Ep Et Eu einf(1)  Ferlauto et al. (Urbach tail below Et)\n"
+"Models are evaluated in closed form at each wavelength.  The Cody-Lorentz eps1\n"
+"(and Tauc-Lorentz with C >= 2*E0) comes from a Kramers-Kronig integral done\n"
+"once when the model is read.\n"
+"\n"
+"A temperature dependent material is a database file starting with the line\n"
+"\"temperature [K|C]\" followed by lines giving a temperature and the database\n"
+"material (same energy grid preferred) at that temperature, e.g. si_T:\n"
+"      temperature C\n"
+"        20  si020\n"
+"       100  si100\n"
+"n,k are interpolated in energy and then by a cubic spline in temperature\n"
+"(constant beyond the end temperatures), using the layer temperature= option\n"
+"or else the -temp value, so -vtemp sweeps and thermal profiles see the\n"
+"changing index.  Without a temperature, 300 K is used.\n"
+"\n"
+"tfoc -compile [-d <directory>] reads every file of the database directory once\n"
+"and writes the fitted splines to <directory>/tfoc.nkb.  When that file exists\n"
+"it is memory mapped and used instead of parsing the text files, which makes\n"
+"start-up nearly free and lets processes share the data.  Materials missing\n"
+"from tfoc.nkb are still read from their text files.  Recompile after editing\n"
+"or adding files; until then edited files are read from text (with a warning).\n"
 "\n"
 "Lines beginning with the ! character set simulation parameters.  Currently only\n"
 "the maximum activated concentrations for n and p can also be set.\n"
@@ -21,6 +21,7 @@ typedef enum _FC_MODE {FIXED_K, SIMPLE_MU, SPLINE_MU, KLAASSEN_MU} FC_MODE;
 void   fc_set_mstar_mode(int mode);
 double fc_alpha(double doping, double excess, double T, double lambda, FC_MODE mode);
 double fc_k(double doping, double excess, double T, double lambda, FC_MODE mode);
+void   fc_use_table(int enable);
 
 typedef struct _COMPLEX {
 	double x,y;
@@ -29,6 +30,7 @@ typedef struct _COMPLEX {
 /* Structures where I want to keep the details unknown */
 typedef struct _TFOC_MATERIAL			TFOC_MATERIAL;
 typedef struct _TFOC_MATERIAL_MIX	TFOC_MATERIAL_MIX;
+typedef struct _TFOC_PROFILE			TFOC_PROFILE;
 
 typedef enum _TFOC_LAYER_TYPE {INCIDENT, SUBLAYER, SUBSTRATE, IGNORE_LAYER, EOS} TFOC_LAYER_TYPE;
 
@@ -39,15 +41,30 @@ typedef struct _TFOC_SAMPLE {
 	TFOC_LAYER_TYPE type;
 	char name[MATERIAL_NAME_LENGTH];		/* Material name						*/
 
-	enum {NO_DOPING, CONSTANT, LINEAR, EXPONENTIAL, LINEAR_IMPLANT} doping_profile;
+	enum {NO_DOPING, CONSTANT, LINEAR, EXPONENTIAL, LINEAR_IMPLANT, TABULATED} doping_profile;
 	int    doping_layers;					/* Number of sub-layers				*/
 	double doping_parms[NPARMS_DOPING];	/* Doping parameters (profile)	*/
 	double temperature;						/* Layer temperature (non-uniform) */
 	double z;									/* Thickness in nm					*/
 	COMPLEX n;									/* Default n,k for material		*/
 	TFOC_MATERIAL *material;				/* Source of raw data				*/
+	int repeat;									/* First row of "repeat N { }" - N	*/
+	int repeat_rows;							/* Rows in the repeated block		*/
+	int incoherent;							/* Thick layer, add intensities	*/
+	int graded;									/* Continuous profile, no sublayers */
+	char grade_name[MATERIAL_NAME_LENGTH];	/* Material at the back ("" if none) */
+	TFOC_MATERIAL *grade_material;		/* Source of raw data for it		*/
+	COMPLEX n_grade;							/* n,k of grade material			*/
+	char profile_name[MATERIAL_NAME_LENGTH];	/* Depth profile file (TABULATED) */
+	TFOC_PROFILE *profile;					/* Its data, shared between rows	*/
 } TFOC_SAMPLE;
 
+/* Continuously graded layer - n(u)-n(0) at fractional depth u in [0,1] */
+typedef struct _TFOC_GRADED TFOC_GRADED;
+struct _TFOC_GRADED {
+	COMPLEX (*dn)(TFOC_GRADED *graded, double u);
+};
+
 typedef struct _TFOC_LAYER {
 	TFOC_LAYER_TYPE type;
 	double z;									/* Thickness							*/
@@ -55,24 +72,67 @@ typedef struct _TFOC_LAYER {
 	char *name;									/* Name (pointer into TFOC_SAMPLE) */
 	double doping;
 	int layer;
+	int repeat;									/* First layer of periodic block - N	*/
+	int repeat_layers;						/* Layers in one period of block		*/
+	int incoherent;							/* Treat with intensity matrices		*/
+	double absorb;								/* Absorbed fraction (TFOC_ReflNAbsorb) */
+	TFOC_GRADED *graded;						/* Continuous profile from n (NULL if uniform) */
 } TFOC_LAYER;
 
 /* Sample interpretation and layer expansion */
 double cpmax, cnmax;							/* Maximum activated concentrations n and p */
 TFOC_SAMPLE *TFOC_LoadSample(char *fname);
-void TFOC_MakeLayers(TFOC_SAMPLE *sample, TFOC_LAYER *layers, double T, double lambda);
+int TFOC_MakeLayers(TFOC_SAMPLE *sample, TFOC_LAYER *layers, double T, double lambda);
+int TFOC_CountLayers(TFOC_SAMPLE *sample);
+void TFOC_SetSublayerTolerance(double tolerance);
 double get_nm_value(char *aptr, char **endptr, double dflt);
 
 /* Materials Database routines and global constants */
 int TFOC_GetMaterialName(char *str, char *name, size_t namelen, char **endptr);
 TFOC_MATERIAL *TFOC_FindMaterial(char *name, char *database);
+char *TFOC_ReadLine(FILE *funit, char **buf, size_t *len);
 COMPLEX TFOC_FindNK(TFOC_MATERIAL *material, double lambda);
+COMPLEX TFOC_FindNKT(TFOC_MATERIAL *material, double lambda, double T);
+void TFOC_FindNKBatch(TFOC_MATERIAL *material, int npt, double lambda[], double T, COMPLEX nk[]);
+int TFOC_HasTemperature(TFOC_MATERIAL *material);
+#define	TFOC_ROOM_TEMPERATURE	(300.0)		/* K, for TFOC_FindNK of temperature tables */
 void TFOC_PrintMaterials(void);
+int TFOC_CompileDatabase(char *database);
+int TFOC_PrefetchMaterials(TFOC_SAMPLE *sample, char *database);
+void TFOC_SetDecimation(double tolerance);
+void TFOC_SetLookupGrid(double tolerance);
 void TFOC_PrintDetail(TFOC_SAMPLE *sample, TFOC_LAYER *layers);
 
 REFL TFOC_ReflN(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[]);
+void TFOC_ReflNBatch(int npt, double theta[], POLARIZATION mode, double lambda[], TFOC_LAYER layer[], double nx[], double ny[], REFL result[]);
 REFL TFOC_Refl(double theta, POLARIZATION mode, double lambda, COMPLEX n0, COMPLEX n1, COMPLEX ns, double z);
 
+/* Average over a cone of incidence centred on the normal (microspot objectives) */
+typedef struct _TFOC_CONE {
+	double na;							/* Numerical aperture in the incident medium	*/
+	double half_angle;				/* Cone half-angle (deg), used if > 0			*/
+	int nodes;							/* Gauss-Legendre nodes (0 = default)			*/
+	double fill;						/* Gaussian pupil fill factor, 0 = uniform	*/
+} TFOC_CONE;
+REFL TFOC_ReflNCone(TFOC_CONE *cone, double lambda, TFOC_LAYER layer[]);
+
+/* Absorbed fraction per layer (layer[].absorb) and optional |E|^2 depth profile */
+REFL TFOC_ReflNAbsorb(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[], double dz, int npt, double efield[]);
+
+/* Cached left/right products for sweeps that vary a range of sample rows */
+typedef struct _TFOC_SWEEP				TFOC_SWEEP;
+TFOC_SWEEP *TFOC_SweepInit(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[], int first_row, int last_row);
+REFL TFOC_SweepRefl(TFOC_SWEEP *sweep, TFOC_LAYER layer[]);
+void TFOC_SweepFree(TFOC_SWEEP *sweep);
+
+/* Analytic derivatives of R and T with respect to each sample row */
+typedef struct _TFOC_JACOBIAN {
+	REFL dz;								/* dR/dz, dT/dz (per nm) */
+	REFL dn;								/* dR/dn, dT/dn */
+	REFL dk;								/* dR/dk, dT/dk */
+} TFOC_JACOBIAN;
+REFL TFOC_ReflNJacobian(double theta, POLARIZATION mode, double lambda, TFOC_LAYER layer[], int nrows, TFOC_JACOBIAN jac[]);
+
 
 /* Debug interface */
 int TFOC_Debug_Flag;
@@ -82,6 +142,14 @@ int TFOC_Debug_Flag;
 #define	DEBUG_COMPLEX_MATH		(0x100)
 #define	DEBUG_MOST					(0xFF)		/* All but complex math calculation modules */
 
+/* Test for a debug class.  Compile with TFOC_NO_DEBUG defined for release
+ * builds and every test (and the printing behind it) drops out entirely */
+#ifdef TFOC_NO_DEBUG
+	#define	TFOC_DEBUG(flag)		(0)
+#else
+	#define	TFOC_DEBUG(flag)		(TFOC_Debug_Flag & (flag))
+#endif
+
 #ifdef TFOC_CODE
 	#define	pi				(3.141592653589793)				/* Guess	*/
 	#define	TRUE			(1)
@@ -97,15 +165,19 @@ int TFOC_Debug_Flag;
 /* Spline routines */
 	void *GVFitSpline(void *work, REAL *x, REAL *y, int npt, int opts);
 	REAL GVEvalSpline(void *work, REAL x);
+	REAL GVEvalSplineAt(void *work, int npt, REAL x, int *cursor);
+	size_t GVSplineSize(int npt);
+	REAL GVSplineKnot(void *work, int i);
 
-/* Complex mathematical operations (from Fresnel) */
-	COMPLEX CADD(COMPLEX a, COMPLEX b);
-	COMPLEX CSUB(COMPLEX a, COMPLEX b);
-	COMPLEX CMUL(COMPLEX a, COMPLEX b);
-	COMPLEX CDIV(COMPLEX a, COMPLEX b);
-	COMPLEX CCSQRT(COMPLEX r);
-	double CABS(COMPLEX a);
+/* Complex mathematical operations (inline, and CPOW from Fresnel) */
+	#include "tfoc_math.h"
 	COMPLEX CPOW(COMPLEX r, double pow);
-	COMPLEX CSQRT(double r);
+
+/* Analytic dispersion models (dispersion.c) */
+	typedef struct _TFOC_DISPERSION		TFOC_DISPERSION;
+	BOOL TFOC_IsDispersion(char *text);
+	TFOC_DISPERSION *TFOC_ParseDispersion(char *text);
+	COMPLEX TFOC_EvalDispersion(TFOC_DISPERSION *model, double lambda);
+	void TFOC_FreeDispersion(TFOC_DISPERSION *model);
 
 #endif
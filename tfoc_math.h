@@ -0,0 +1,141 @@
+/* tfoc_math.h - inline complex arithmetic and 2x2 complex matrix kernel */
+
+/* ---------------------------------------------------------------------------
+ * The complex operations are in the inner loop of every Fresnel calculation
+ * and of the effective medium models.  As out-of-line functions in fresnel.c
+ * they could not be inlined across files, so they are defined here as
+ * static inline functions instead.  COMPLEX is kept as the simple x,y
+ * structure (the MSVC C compiler has no C99 _Complex), which the compilers
+ * keep in registers once inlined.
+ *
+ * Included from tfoc.h for TFOC_CODE modules, after COMPLEX and the debug
+ * interface are defined.
+ * ------------------------------------------------------------------------ */
+#ifndef __tfoc_math
+	#define __tfoc_math
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _MSC_VER
+	#define	TFOC_INLINE	static __inline
+#else
+	#define	TFOC_INLINE	static inline
+#endif
+
+/* Transfer (characteristic) matrix [A B; C D] */
+typedef struct _M_ARRAY {
+	COMPLEX A,B,C,D;
+} M_ARRAY;
+
+TFOC_INLINE COMPLEX CADD(COMPLEX a, COMPLEX b) {
+	COMPLEX result;
+	result.x = a.x+b.x;
+	result.y = a.y+b.y;
+	return result;
+}
+
+TFOC_INLINE COMPLEX CSUB(COMPLEX a, COMPLEX b) {
+	COMPLEX result;
+	result.x = a.x-b.x;
+	result.y = a.y-b.y;
+	return result;
+}
+
+TFOC_INLINE COMPLEX CMUL(COMPLEX a, COMPLEX b) {
+	COMPLEX result;
+	result.x = a.x*b.x - a.y*b.y;
+	result.y = a.x*b.y + a.y*b.x;
+	return result;
+}
+
+TFOC_INLINE COMPLEX CDIV(COMPLEX a, COMPLEX b) {
+	COMPLEX result;
+	double magn;
+	magn = b.x*b.x+b.y*b.y;
+	result.x =  ( a.x*b.x + a.y*b.y) / magn ;
+	result.y =  (-a.x*b.y + a.y*b.x) / magn ;
+	return result;
+}
+
+TFOC_INLINE double CABS(COMPLEX a) {
+	return sqrt(a.x*a.x+a.y*a.y);
+}
+
+/* Square root of a real number, imaginary if negative */
+TFOC_INLINE COMPLEX CSQRT(double r) {
+	COMPLEX c;
+	c.x = (r>0) ? sqrt(r)  : 0;
+	c.y = (r<0) ? sqrt(-r) : 0;
+
+	if (TFOC_DEBUG(DEBUG_COMPLEX_MATH)) printf("CSQRT: %g %g %g\n", r, c.x, c.y);
+
+	return c;
+}
+
+/* ---------------------------------------------------------------------------
+ * Principal square root of a complex number without atan2/cos/sin.
+ *   t = sqrt((|r|+|x|)/2), then sqrt(r) = (t, y/2t) for x >= 0
+ *                                       or (|y|/2t, +/-t) for x < 0
+ * A zero imaginary part is treated as +0 (branch cut from above), as the
+ * polar form did.
+ * ------------------------------------------------------------------------ */
+TFOC_INLINE COMPLEX CCSQRT(COMPLEX r) {
+	COMPLEX c;
+	double t;
+
+	t = sqrt(0.5*(sqrt(r.x*r.x+r.y*r.y) + fabs(r.x)));
+	if (t == 0) {
+		c.x = c.y = 0;
+	} else if (r.x >= 0) {
+		c.x = t;
+		c.y = r.y/(2*t);
+	} else {
+		c.x = fabs(r.y)/(2*t);
+		c.y = (r.y < 0) ? -t : t;
+	}
+
+	if (TFOC_DEBUG(DEBUG_COMPLEX_MATH)) printf("CSQRT: %g %g = %g %g\n", r.x, r.y, c.x, c.y);
+
+	return c;
+}
+
+/* exp(z) */
+TFOC_INLINE COMPLEX CEXP(COMPLEX z) {
+	COMPLEX c;
+	double r;
+
+	r = exp(z.x);
+	c.x = r*cos(z.y);
+	c.y = r*sin(z.y);
+	return c;
+}
+
+TFOC_INLINE M_ARRAY IDENTITY_MATRIX(void) {
+
+	M_ARRAY ab;
+
+	memset(&ab, 0, sizeof(ab));
+	ab.A.x = ab.D.x = 1.0;
+
+	return ab;
+}
+
+/* 2x2 complex product with the eight multiplies written out */
+TFOC_INLINE M_ARRAY MATMUL(M_ARRAY *a, M_ARRAY *b) {
+
+	M_ARRAY ab;
+
+	ab.A.x = a->A.x*b->A.x - a->A.y*b->A.y + a->B.x*b->C.x - a->B.y*b->C.y;
+	ab.A.y = a->A.x*b->A.y + a->A.y*b->A.x + a->B.x*b->C.y + a->B.y*b->C.x;
+	ab.B.x = a->A.x*b->B.x - a->A.y*b->B.y + a->B.x*b->D.x - a->B.y*b->D.y;
+	ab.B.y = a->A.x*b->B.y + a->A.y*b->B.x + a->B.x*b->D.y + a->B.y*b->D.x;
+	ab.C.x = a->C.x*b->A.x - a->C.y*b->A.y + a->D.x*b->C.x - a->D.y*b->C.y;
+	ab.C.y = a->C.x*b->A.y + a->C.y*b->A.x + a->D.x*b->C.y + a->D.y*b->C.x;
+	ab.D.x = a->C.x*b->B.x - a->C.y*b->B.y + a->D.x*b->D.x - a->D.y*b->D.y;
+	ab.D.y = a->C.x*b->B.y + a->C.y*b->B.x + a->D.x*b->D.y + a->D.y*b->D.x;
+	return ab;
+}
+
+#endif	/* __tfoc_math */
@@ -43,7 +43,6 @@
 /* ------------------------------- */
 /* Locally defined global vars     */
 /* ------------------------------- */
-#define	DATABASE	(NULL)
 
 
 /* ===========================================================================
@@ -124,24 +123,20 @@ REFL TFOC_GetRefl(char *SampleFile, double lambda, double theta, POLARIZATION mo
 			-- at the same time, figure out how big the actual layer
 			-- array will need to be given expansion of profiles, etc.
 			---------------------------------------------------------- */
-		nlayers = 0;
+		TFOC_PrefetchMaterials(sample, database);
 		for (i=0; sample[i].type != EOS; i++) {
-			if ( (sample[i].material = TFOC_FindMaterial(sample[i].name, DATABASE)) == NULL) {
+			if ( (sample[i].material = TFOC_FindMaterial(sample[i].name, database)) == NULL) {
 				fprintf(stderr, "ERROR: Unable to locate %s in the materials database directory\n", sample[i].name);
 				result.R = result.T = -1;
 				return result;
 			}
-			switch (sample[i].doping_profile) {
-				case NO_DOPING:
-				case CONSTANT:
-					nlayers++;
-					break;
-				case EXPONENTIAL:
-				case LINEAR_IMPLANT:
-				case LINEAR:
-					nlayers += sample[i].doping_layers;
+			if (*sample[i].grade_name != '\0' && (sample[i].grade_material = TFOC_FindMaterial(sample[i].grade_name, database)) == NULL) {
+				fprintf(stderr, "ERROR: Unable to locate %s in the materials database directory\n", sample[i].grade_name);
+				result.R = result.T = -1;
+				return result;
 			}
 		}
+		nlayers = TFOC_CountLayers(sample);
 		layers = calloc(nlayers+1, sizeof(*layers));				/* Allocate space (one extra for safety) for layers */
 	}
 
@@ -153,7 +148,9 @@ REFL TFOC_GetRefl(char *SampleFile, double lambda, double theta, POLARIZATION mo
 
 /* And go! */
 	for (i=0; sample[i].type != EOS; i++) {
-		sample[i].n = TFOC_FindNK(sample[i].material, lambda);
+		sample[i].n = TFOC_FindNKT(sample[i].material, lambda, (sample[i].temperature > 0) ? sample[i].temperature : temperature);
+		if (sample[i].grade_material != NULL)
+			sample[i].n_grade = TFOC_FindNKT(sample[i].grade_material, lambda, (sample[i].temperature > 0) ? sample[i].temperature : temperature);
 	}
 	TFOC_MakeLayers(sample, layers, temperature, lambda);
 	result = TFOC_ReflN(theta, mode, lambda, layers);